@@ -6,290 +6,7568 @@
 #include <ctime>
 #include <iomanip>
 #include <sstream>
-#include <openssl/md5.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/ssl.h>
 #include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <optional>
+#include <atomic>
+
+#include <array>
+#include <system_error>
+#include <memory>
+#include <limits>
+#include <string_view>
+#include <unordered_set>
+#include <unordered_map>
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <utility>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+
+// statx 需要 glibc 2.28 及以上；io_uring 只需要内核头文件(经由系统调用直接使用)
+#if defined(__linux__) && defined(STATX_MODE)
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#define BACKUP_HAVE_STATX 1
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define BACKUP_HAVE_IO_URING 1
+#endif
+#endif
+
+// 可选的快速哈希后端，编译时定义对应宏并链接相应的库
+#ifdef BACKUP_WITH_BLAKE3
+#include <blake3.h>
+#endif
+#ifdef BACKUP_WITH_XXHASH
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+#endif
+
+// 可选的归档压缩后端
+#ifdef BACKUP_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef BACKUP_WITH_LZ4
+#include <lz4.h>
+#endif
 
 namespace fs = std::filesystem;
 
-class BackupApp {
+// 摘要算法。数值写入清单，只能追加不能修改
+enum class HashAlgorithm : uint8_t {
+    MD5 = 0,
+    SHA256 = 1,
+    BLAKE2s256 = 2,
+    BLAKE3 = 3,     // 需要 BACKUP_WITH_BLAKE3
+    XXH3_128 = 4,   // 需要 BACKUP_WITH_XXHASH，非加密哈希，仅用于变更检测
+};
+
+constexpr size_t MAX_DIGEST_LENGTH = 32;
+
+// 定长二进制摘要，未使用的字节保持为 0，比较时直接比较整块内存。
+// 十六进制形式只在显示和日志中生成
+struct Digest {
+    std::array<uint8_t, MAX_DIGEST_LENGTH> bytes{};
+    uint8_t length = 0;     // 0 表示尚未计算
+    HashAlgorithm type = HashAlgorithm::MD5;
+
+    bool empty() const { return length == 0; }
+
+    bool operator==(const Digest& other) const {
+        return type == other.type && length == other.length && bytes == other.bytes;
+    }
+    bool operator!=(const Digest& other) const { return !(*this == other); }
+
+    std::string hex() const {
+        static constexpr char digits[] = "0123456789abcdef";
+        std::string out(length * 2, '0');
+        for (size_t i = 0; i < length; ++i) {
+            out[i * 2] = digits[bytes[i] >> 4];
+            out[i * 2 + 1] = digits[bytes[i] & 0x0f];
+        }
+        return out;
+    }
+
+    // 解析旧版清单中的十六进制摘要，格式不对时返回空摘要
+    static Digest from_hex(const std::string& hex, HashAlgorithm type) {
+        Digest digest;
+        if (hex.size() % 2 != 0 || hex.size() / 2 > MAX_DIGEST_LENGTH) return digest;
+        auto nibble = [](char c) -> int {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return -1;
+        };
+        for (size_t i = 0; i < hex.size() / 2; ++i) {
+            int hi = nibble(hex[i * 2]), lo = nibble(hex[i * 2 + 1]);
+            if (hi < 0 || lo < 0) return Digest();
+            digest.bytes[i] = static_cast<uint8_t>(hi << 4 | lo);
+        }
+        digest.length = static_cast<uint8_t>(hex.size() / 2);
+        digest.type = type;
+        return digest;
+    }
+};
+
+// 增量哈希接口，每个算法一个实现
+class Hasher {
+public:
+    virtual ~Hasher() = default;
+    virtual void update(const void* data, size_t len) = 0;
+    // 写出摘要并返回字节数，out 至少 MAX_DIGEST_LENGTH 字节
+    virtual size_t finish(unsigned char* out) = 0;
+    // 丢弃已输入的数据重新开始，沿用已分配的上下文。逐块计算摘要时一个对象反复使用
+    virtual void reset() = 0;
+
+    Digest finish_digest(HashAlgorithm algorithm) {
+        Digest digest;
+        digest.length = static_cast<uint8_t>(finish(digest.bytes.data()));
+        digest.type = algorithm;
+        return digest;
+    }
+
+    static const char* name(HashAlgorithm algorithm) {
+        switch (algorithm) {
+            case HashAlgorithm::MD5: return "md5";
+            case HashAlgorithm::SHA256: return "sha256";
+            case HashAlgorithm::BLAKE2s256: return "blake2s";
+            case HashAlgorithm::BLAKE3: return "blake3";
+            case HashAlgorithm::XXH3_128: return "xxh3";
+        }
+        return "unknown";
+    }
+
+    static std::optional<HashAlgorithm> parse(const std::string& name) {
+        for (auto algorithm : {HashAlgorithm::MD5, HashAlgorithm::SHA256, HashAlgorithm::BLAKE2s256,
+                               HashAlgorithm::BLAKE3, HashAlgorithm::XXH3_128}) {
+            if (name == Hasher::name(algorithm)) return algorithm;
+        }
+        return std::nullopt;
+    }
+
+    static bool available(HashAlgorithm algorithm) {
+        switch (algorithm) {
+#ifdef BACKUP_WITH_BLAKE3
+            case HashAlgorithm::BLAKE3: return true;
+#else
+            case HashAlgorithm::BLAKE3: return false;
+#endif
+#ifdef BACKUP_WITH_XXHASH
+            case HashAlgorithm::XXH3_128: return true;
+#else
+            case HashAlgorithm::XXH3_128: return false;
+#endif
+            default: return true;
+        }
+    }
+
+    static std::unique_ptr<Hasher> create(HashAlgorithm algorithm);
+};
+
+// OpenSSL EVP 实现(MD5 / SHA-256 / BLAKE2s-256)，OpenSSL 会按CPU特性选择汇编或SIMD实现
+class EvpHasher : public Hasher {
+public:
+    explicit EvpHasher(const EVP_MD* md) : md_(md), ctx_(EVP_MD_CTX_new()) {
+        if (!ctx_ || EVP_DigestInit_ex(ctx_, md, nullptr) != 1) {
+            EVP_MD_CTX_free(ctx_);
+            throw std::runtime_error("无法初始化摘要算法");
+        }
+    }
+    ~EvpHasher() override { EVP_MD_CTX_free(ctx_); }
+    EvpHasher(const EvpHasher&) = delete;
+    EvpHasher& operator=(const EvpHasher&) = delete;
+
+    void update(const void* data, size_t len) override { EVP_DigestUpdate(ctx_, data, len); }
+
+    size_t finish(unsigned char* out) override {
+        unsigned int len = 0;
+        EVP_DigestFinal_ex(ctx_, out, &len);
+        return len;
+    }
+
+    void reset() override {
+        if (EVP_DigestInit_ex(ctx_, md_, nullptr) != 1) throw std::runtime_error("无法初始化摘要算法");
+    }
+
+private:
+    const EVP_MD* md_;
+    EVP_MD_CTX* ctx_;
+};
+
+#ifdef BACKUP_WITH_BLAKE3
+class Blake3Hasher : public Hasher {
+public:
+    Blake3Hasher() { blake3_hasher_init(&state_); }
+    void update(const void* data, size_t len) override { blake3_hasher_update(&state_, data, len); }
+    size_t finish(unsigned char* out) override {
+        blake3_hasher_finalize(&state_, out, BLAKE3_OUT_LEN);
+        return BLAKE3_OUT_LEN;
+    }
+    void reset() override { blake3_hasher_init(&state_); }
+
+private:
+    blake3_hasher state_;
+};
+#endif
+
+#ifdef BACKUP_WITH_XXHASH
+class Xxh3Hasher : public Hasher {
+public:
+    Xxh3Hasher() : state_(XXH3_createState()) { XXH3_128bits_reset(state_); }
+    ~Xxh3Hasher() override { XXH3_freeState(state_); }
+    Xxh3Hasher(const Xxh3Hasher&) = delete;
+    Xxh3Hasher& operator=(const Xxh3Hasher&) = delete;
+
+    void update(const void* data, size_t len) override { XXH3_128bits_update(state_, data, len); }
+    size_t finish(unsigned char* out) override {
+        XXH128_canonical_t canonical;
+        XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(state_));
+        std::copy(canonical.digest, canonical.digest + sizeof(canonical.digest), out);
+        return sizeof(canonical.digest);
+    }
+    void reset() override { XXH3_128bits_reset(state_); }
+
+private:
+    XXH3_state_t* state_;
+};
+#endif
+
+inline std::unique_ptr<Hasher> Hasher::create(HashAlgorithm algorithm) {
+    switch (algorithm) {
+        case HashAlgorithm::MD5: return std::make_unique<EvpHasher>(EVP_md5());
+        case HashAlgorithm::SHA256: return std::make_unique<EvpHasher>(EVP_sha256());
+        case HashAlgorithm::BLAKE2s256: return std::make_unique<EvpHasher>(EVP_blake2s256());
+#ifdef BACKUP_WITH_BLAKE3
+        case HashAlgorithm::BLAKE3: return std::make_unique<Blake3Hasher>();
+#endif
+#ifdef BACKUP_WITH_XXHASH
+        case HashAlgorithm::XXH3_128: return std::make_unique<Xxh3Hasher>();
+#endif
+        default: break;
+    }
+    throw std::runtime_error(std::string("当前版本未编译摘要算法: ") + name(algorithm));
+}
+
+// 紧凑的文件索引。路径按目录拆分存放：每个目录只记录父目录编号和自身名称，
+// 每个文件只记录所在目录编号和文件名，名称统一放在一块字符串区里；
+// 大小、修改时间、inode、摘要按列存放。每个文件占用固定几十字节加文件名长度，
+// 不再为每个文件单独分配 fs::path 和 std::string
+class FileIndex {
+public:
+    using Id = uint32_t;
+    static constexpr Id npos = std::numeric_limits<Id>::max();
+    static constexpr Id root = 0;   // 根目录(扫描起点)，名称为空
+
+    enum Flag : uint8_t {
+        MatchesPrevious = 1,    // 扫描时已确认与上次备份中的同名文件内容一致
+        Resumed = 2,            // 中断的上一次运行已完成该文件(见断点日志)，不必再哈希或复制
+    };
+
+    // 按列存放的文件属性，下标为文件编号
+    std::vector<uint64_t> sizes;
+    std::vector<int64_t> mtimes;    // file_clock 计数
+    std::vector<uint64_t> inodes;   // 0 表示平台不支持或未知
+    std::vector<Digest> digests;    // 为空表示尚未计算
+    std::vector<uint8_t> flags;
+
+    FileIndex() { dirs_.push_back({0, 0, npos}); }
+
+    size_t file_count() const { return files_.size(); }
+    size_t directory_count() const { return dirs_.size(); }
+
+    Id file_dir(Id file) const { return files_[file].parent; }
+    std::string_view file_name(Id file) const { return name_of(files_[file]); }
+    Id dir_parent(Id dir) const { return dirs_[dir].parent; }
+    std::string_view dir_name(Id dir) const { return name_of(dirs_[dir]); }
+
+    // 添加子目录，已存在时返回原有编号
+    Id add_directory(Id parent, std::string_view name) {
+        Id existing = find_in(dir_table_, dirs_, parent, name);
+        if (existing != npos) return existing;
+        Id id = static_cast<Id>(dirs_.size());
+        dirs_.push_back(make_name(parent, name));
+        insert_into(dir_table_, dirs_, id);
+        return id;
+    }
+
+    Id add_file(Id dir, std::string_view name, uint64_t size, int64_t mtime, uint64_t inode) {
+        Id id = static_cast<Id>(files_.size());
+        files_.push_back(make_name(dir, name));
+        sizes.push_back(size);
+        mtimes.push_back(mtime);
+        inodes.push_back(inode);
+        digests.emplace_back();
+        flags.push_back(0);
+        insert_into(file_table_, files_, id);
+        return id;
+    }
+
+    // 按 generic 格式的相对路径添加文件，沿途目录按需创建
+    Id add_path(std::string_view relative, uint64_t size, int64_t mtime, uint64_t inode) {
+        Id dir = root;
+        size_t start = 0;
+        for (size_t slash; (slash = relative.find('/', start)) != std::string_view::npos; start = slash + 1) {
+            if (slash > start) dir = add_directory(dir, relative.substr(start, slash - start));
+        }
+        return add_file(dir, relative.substr(start), size, mtime, inode);
+    }
+
+    Id find_directory(Id parent, std::string_view name) const {
+        return parent == npos ? npos : find_in(dir_table_, dirs_, parent, name);
+    }
+
+    Id find_file(Id dir, std::string_view name) const {
+        return dir == npos ? npos : find_in(file_table_, files_, dir, name);
+    }
+
+    Id find_path(std::string_view relative) const {
+        Id dir = root;
+        size_t start = 0;
+        for (size_t slash; (slash = relative.find('/', start)) != std::string_view::npos; start = slash + 1) {
+            if (slash > start) dir = find_directory(dir, relative.substr(start, slash - start));
+        }
+        return find_file(dir, relative.substr(start));
+    }
+
+    // 对本索引的每个目录给出 other 中同一路径目录的编号(没有则为 npos)。
+    // 目录总是先于其子目录加入，按编号顺序一遍即可完成
+    std::vector<Id> match_directories(const FileIndex& other) const {
+        std::vector<Id> mapping(dirs_.size(), npos);
+        mapping[root] = root;
+        for (Id d = 1; d < dirs_.size(); ++d) {
+            mapping[d] = other.find_directory(mapping[dirs_[d].parent], name_of(dirs_[d]));
+        }
+        return mapping;
+    }
+
+    std::string directory_path(Id dir) const {
+        std::vector<std::string_view> parts;
+        for (Id d = dir; d != root && d != npos; d = dirs_[d].parent) {
+            parts.push_back(name_of(dirs_[d]));
+        }
+        std::string path;
+        for (auto it = parts.rbegin(); it != parts.rend(); ++it) {
+            if (!path.empty()) path += '/';
+            path.append(it->data(), it->size());
+        }
+        return path;
+    }
+
+    std::string relative_path(Id file) const {
+        std::string path = directory_path(files_[file].parent);
+        if (!path.empty()) path += '/';
+        path += file_name(file);
+        return path;
+    }
+
+    // 删除 drop[i] 非 0 的文件，其余文件保持原有顺序但编号会变化
+    void erase_files(const std::vector<char>& drop) {
+        FileIndex kept;
+        kept.arena_ = arena_;
+        kept.dirs_ = dirs_;
+        kept.dir_table_ = dir_table_;
+        for (Id f = 0; f < files_.size(); ++f) {
+            if (drop[f]) continue;
+            Id id = static_cast<Id>(kept.files_.size());
+            kept.files_.push_back(files_[f]);
+            kept.sizes.push_back(sizes[f]);
+            kept.mtimes.push_back(mtimes[f]);
+            kept.inodes.push_back(inodes[f]);
+            kept.digests.push_back(digests[f]);
+            kept.flags.push_back(flags[f]);
+            kept.insert_into(kept.file_table_, kept.files_, id);
+        }
+        *this = std::move(kept);
+    }
+
+    size_t memory_usage() const {
+        return arena_.capacity() + (dirs_.capacity() + files_.capacity()) * sizeof(Name) +
+               (dir_table_.slots.capacity() + file_table_.slots.capacity()) * sizeof(Id) +
+               sizes.capacity() * sizeof(uint64_t) + mtimes.capacity() * sizeof(int64_t) +
+               inodes.capacity() * sizeof(uint64_t) + digests.capacity() * sizeof(Digest) +
+               flags.capacity();
+    }
+
+private:
+    struct Name {
+        uint64_t offset;    // 在 arena_ 中的位置
+        uint32_t length;
+        Id parent;          // 所在目录
+    };
+
+    // 开放寻址哈希表，槽位里只存编号，键(父目录, 名称)从 Name 中取
+    struct Table {
+        std::vector<Id> slots;
+        size_t used = 0;
+    };
+
+    std::string arena_;
+    std::vector<Name> dirs_;
+    std::vector<Name> files_;
+    Table dir_table_;
+    Table file_table_;
+
+    std::string_view name_of(const Name& name) const {
+        return std::string_view(arena_.data() + name.offset, name.length);
+    }
+
+    Name make_name(Id parent, std::string_view name) {
+        Name entry{arena_.size(), static_cast<uint32_t>(name.size()), parent};
+        arena_.append(name.data(), name.size());
+        return entry;
+    }
+
+    static size_t hash_key(Id parent, std::string_view name) {
+        size_t h = std::hash<std::string_view>()(name);
+        return h ^ (static_cast<size_t>(parent) * 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+    }
+
+    Id find_in(const Table& table, const std::vector<Name>& names, Id parent, std::string_view name) const {
+        if (table.slots.empty()) return npos;
+        size_t mask = table.slots.size() - 1;
+        for (size_t i = hash_key(parent, name) & mask;; i = (i + 1) & mask) {
+            Id id = table.slots[i];
+            if (id == npos) return npos;
+            if (names[id].parent == parent && name_of(names[id]) == name) return id;
+        }
+    }
+
+    void insert_into(Table& table, const std::vector<Name>& names, Id id) {
+        if ((table.used + 1) * 2 > table.slots.size()) {
+            // 负载超过一半时容量翻倍并重新放入所有编号
+            std::vector<Id> old = std::move(table.slots);
+            table.slots.assign(std::max<size_t>(16, old.size() * 2), npos);
+            table.used = 0;
+            for (Id existing : old) {
+                if (existing != npos) place(table, names, existing);
+            }
+        }
+        place(table, names, id);
+    }
+
+    void place(Table& table, const std::vector<Name>& names, Id id) {
+        size_t mask = table.slots.size() - 1;
+        size_t i = hash_key(names[id].parent, name_of(names[id])) & mask;
+        while (table.slots[i] != npos) i = (i + 1) & mask;
+        table.slots[i] = id;
+        table.used++;
+    }
+};
+
+#ifndef _WIN32
+// 文件描述符的 RAII 封装
+class UniqueFd {
+public:
+    UniqueFd() = default;
+    explicit UniqueFd(int fd) : fd_(fd) {}
+    UniqueFd(UniqueFd&& other) noexcept : fd_(other.release()) {}
+    UniqueFd& operator=(UniqueFd&& other) noexcept {
+        if (this != &other) reset(other.release());
+        return *this;
+    }
+    UniqueFd(const UniqueFd&) = delete;
+    UniqueFd& operator=(const UniqueFd&) = delete;
+    ~UniqueFd() { reset(); }
+
+    int get() const { return fd_; }
+    explicit operator bool() const { return fd_ >= 0; }
+    int release() { int fd = fd_; fd_ = -1; return fd; }
+    void reset(int fd = -1) {
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = fd;
+    }
+
+private:
+    int fd_ = -1;
+};
+#endif
+
+// 读取文件内容的方式
+enum class ReadMode : uint8_t {
+    Buffered,   // read() 到对齐的大缓冲区
+    Mmap,       // 整个文件 mmap，按顺序访问提示内核预读
+    Direct,     // O_DIRECT 绕过页缓存；不支持时退回普通读取并丢弃已读过的页缓存
+};
+
+// 顺序读取整个文件，按不超过缓冲区大小的块交给回调。
+// 每个线程复用一块按页对齐的缓冲区，小文件不会反复分配
+class FileReader {
+public:
+    static constexpr size_t ALIGNMENT = 4096;
+    static constexpr size_t DEFAULT_BUFFER_SIZE = 1024 * 1024;
+
+    FileReader(ReadMode mode, size_t buffer_size)
+        : mode_(mode), buffer_size_((std::max(buffer_size, ALIGNMENT) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT) {}
+
+    static const char* name(ReadMode mode) {
+        switch (mode) {
+            case ReadMode::Buffered: return "buffered";
+            case ReadMode::Mmap: return "mmap";
+            case ReadMode::Direct: return "direct";
+        }
+        return "unknown";
+    }
+
+    static std::optional<ReadMode> parse(const std::string& name) {
+        for (ReadMode mode : {ReadMode::Buffered, ReadMode::Mmap, ReadMode::Direct}) {
+            if (name == FileReader::name(mode)) return mode;
+        }
+        return std::nullopt;
+    }
+
+#ifndef _WIN32
+    // 分配的块少于文件大小，说明文件中有空洞
+    static bool is_sparse(const struct stat& st) {
+        return st.st_size > 0 && static_cast<uint64_t>(st.st_blocks) * 512 < static_cast<uint64_t>(st.st_size);
+    }
+#endif
+
+    // 把 len 个 0 字节分段交给 consume，数据来自静态的全 0 缓冲区
+    template <typename Consume>
+    static void feed_zeros(Consume&& consume, uint64_t len) {
+        static const uint8_t zeros[DEFAULT_BUFFER_SIZE] = {};
+        while (len > 0) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(len, sizeof(zeros)));
+            consume(zeros, n);
+            len -= n;
+        }
+    }
+
+    // 空洞按全 0 数据交给 consume，摘要与逐字节读取时相同，但空洞部分不读磁盘
+    template <typename Consume>
+    void read(const fs::path& path, Consume&& consume) const {
+        read(path, consume, [&](uint64_t len) { feed_zeros(consume, len); });
+    }
+
+    // 稀疏文件按 SEEK_DATA/SEEK_HOLE 只读取数据区，空洞只把长度交给 on_hole
+    template <typename Consume, typename Hole>
+    void read(const fs::path& path, Consume&& consume, Hole&& on_hole) const {
+#ifndef _WIN32
+        UniqueFd fd = open_file(path);
+        if (read_sparse(fd.get(), path, consume, on_hole)) return;
+        if (mode_ == ReadMode::Mmap && read_mapped(fd.get(), consume)) return;
+#ifdef POSIX_FADV_SEQUENTIAL
+        ::posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        uint8_t* buffer = thread_buffer();
+        off_t offset = 0;
+        while (true) {
+            ssize_t n = ::read(fd.get(), buffer, buffer_size_);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EINVAL && drop_direct(fd.get())) continue;
+            if (n < 0) throw std::system_error(errno, std::generic_category(), "read " + path.string());
+            if (n == 0) break;
+            consume(static_cast<const uint8_t*>(buffer), static_cast<size_t>(n));
+#ifdef POSIX_FADV_DONTNEED
+            if (mode_ == ReadMode::Direct) ::posix_fadvise(fd.get(), offset, n, POSIX_FADV_DONTNEED);
+#endif
+            offset += n;
+        }
+#else
+        (void)on_hole;
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("无法打开文件: " + path.string());
+        }
+        std::vector<char> buffer(buffer_size_);
+        while (in) {
+            in.read(buffer.data(), buffer.size());
+            if (in.gcount() > 0) {
+                consume(reinterpret_cast<const uint8_t*>(buffer.data()), static_cast<size_t>(in.gcount()));
+            }
+        }
+        if (in.bad()) {
+            throw std::runtime_error("读取失败: " + path.string());
+        }
+#endif
+    }
+
+private:
+#ifndef _WIN32
+    UniqueFd open_file(const fs::path& path) const {
+#ifdef O_DIRECT
+        if (mode_ == ReadMode::Direct) {
+            UniqueFd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT));
+            if (fd || errno != EINVAL) {
+                if (!fd) throw std::system_error(errno, std::generic_category(), "open " + path.string());
+                return fd;
+            }
+            // tmpfs 等文件系统不支持 O_DIRECT
+        }
+#endif
+        UniqueFd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!fd) throw std::system_error(errno, std::generic_category(), "open " + path.string());
+        return fd;
+    }
+
+    // 短读之后或读取长度不对齐时 O_DIRECT 读取会返回 EINVAL，此时去掉 O_DIRECT 继续
+    bool drop_direct(int fd) const {
+#ifdef O_DIRECT
+        if (mode_ != ReadMode::Direct) return false;
+        int flags = ::fcntl(fd, F_GETFL);
+        return flags >= 0 && (flags & O_DIRECT) && ::fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+#else
+        (void)fd;
+        return false;
+#endif
+    }
+
+    // 文件不稀疏或文件系统不支持 SEEK_DATA 时返回 false，由调用方顺序读取
+    template <typename Consume, typename Hole>
+    bool read_sparse(int fd, const fs::path& path, Consume& consume, Hole& on_hole) const {
+#ifdef SEEK_DATA
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || !is_sparse(st)) return false;
+        const off_t size = st.st_size;
+        uint8_t* buffer = thread_buffer();
+        off_t offset = 0;
+        while (offset < size) {
+            off_t data = ::lseek(fd, offset, SEEK_DATA);
+            if (data < 0 && errno == ENXIO) data = size;    // 之后全是空洞
+            if (data < 0) {
+                if (offset == 0 && (errno == EINVAL || errno == ENOTSUP)) return false;
+                throw std::system_error(errno, std::generic_category(), "lseek " + path.string());
+            }
+            data = std::min(data, size);
+            if (data > offset) on_hole(static_cast<uint64_t>(data - offset));
+            offset = data;
+            if (offset >= size) break;
+
+            off_t hole = ::lseek(fd, offset, SEEK_HOLE);
+            if (hole < 0) throw std::system_error(errno, std::generic_category(), "lseek " + path.string());
+            hole = std::min(hole, size);
+            while (offset < hole) {
+                size_t want = static_cast<size_t>(std::min<off_t>(static_cast<off_t>(buffer_size_), hole - offset));
+                ssize_t n = ::pread(fd, buffer, want, offset);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && errno == EINVAL && drop_direct(fd)) continue;
+                if (n < 0) throw std::system_error(errno, std::generic_category(), "read " + path.string());
+                if (n == 0) return true;    // 读取期间文件被截断
+                consume(static_cast<const uint8_t*>(buffer), static_cast<size_t>(n));
+                offset += n;
+            }
+        }
+        return true;
+#else
+        (void)fd, (void)path, (void)consume, (void)on_hole;
+        return false;
+#endif
+    }
+
+    // 映射整个文件后按缓冲区大小分段交给回调。映射期间文件被截断会触发 SIGBUS，
+    // 所以默认不使用这种方式。空文件或映射失败时返回 false，由调用方退回 read()
+    template <typename Consume>
+    bool read_mapped(int fd, Consume& consume) const {
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size <= 0) return false;
+        size_t total = static_cast<size_t>(st.st_size);
+        void* map = ::mmap(nullptr, total, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) return false;
+        std::unique_ptr<void, std::function<void(void*)>> unmap(map, [total](void* p) { ::munmap(p, total); });
+        ::madvise(map, total, MADV_SEQUENTIAL);
+
+        const uint8_t* data = static_cast<const uint8_t*>(map);
+        for (size_t done = 0; done < total;) {
+            size_t n = std::min(buffer_size_, total - done);
+            consume(data + done, n);
+            done += n;
+        }
+        return true;
+    }
+
+    uint8_t* thread_buffer() const {
+        struct AlignedFree {
+            void operator()(uint8_t* p) const { std::free(p); }
+        };
+        thread_local std::unique_ptr<uint8_t, AlignedFree> buffer;
+        thread_local size_t capacity = 0;
+        if (capacity < buffer_size_) {
+            buffer.reset(static_cast<uint8_t*>(std::aligned_alloc(ALIGNMENT, buffer_size_)));
+            if (!buffer) throw std::bad_alloc();
+            capacity = buffer_size_;
+        }
+        return buffer.get();
+    }
+#endif
+
+    ReadMode mode_;
+    size_t buffer_size_;
+};
+
+// 保留空洞地写出文件：hole() 只移动写入位置，detect_zeros 为 true 时按文件偏移
+// 对齐的整页全 0 数据也当作空洞跳过，跨两次 write() 的页先暂存凑齐再判断。
+// finish() 写出暂存的数据并把文件扩展到最终大小(末尾是空洞时)
+class SparseWriter {
+public:
+    static constexpr size_t PAGE = 4096;
+
+    SparseWriter(const fs::path& path, bool detect_zeros)
+        : path_(path), out_(path, std::ios::binary | std::ios::trunc), detect_zeros_(detect_zeros) {
+        if (!out_) {
+            throw std::runtime_error("无法创建文件: " + path.string());
+        }
+    }
+
+    void write(const uint8_t* data, size_t len) {
+        if (!detect_zeros_) {
+            emit(data, len);
+            return;
+        }
+        // 按页切分，相邻的非零页合并为一次写入
+        // 先把上次留下的不完整页补齐
+        if (partial_len_ > 0) {
+            size_t n = std::min(PAGE - partial_len_, len);
+            std::memcpy(partial_.data() + partial_len_, data, n);
+            partial_len_ += n;
+            data += n;
+            len -= n;
+            if (partial_len_ < PAGE) return;
+            write_page(partial_.data());
+            partial_len_ = 0;
+        }
+        // 按页切分，相邻的非零页合并为一次写入，末尾不满一页的部分暂存
+        size_t run = 0, done = 0;
+        for (; len - done >= PAGE; done += PAGE) {
+            if (is_zero(data + done, PAGE)) {
+                emit(data + done - run, run);
+                position_ += PAGE;
+                run = 0;
+            } else {
+                run += PAGE;
+            }
+        }
+        emit(data + done - run, run);
+        std::memcpy(partial_.data(), data + done, len - done);
+        partial_len_ = len - done;
+    }
+
+    void hole(uint64_t len) {
+        flush_partial();
+        position_ += len;
+    }
+
+    void finish() {
+        flush_partial();
+        if (!out_.flush()) {
+            throw std::runtime_error("写入失败: " + path_.string());
+        }
+        out_.close();
+        if (position_ > written_end_) fs::resize_file(path_, position_);
+    }
+
+private:
+    static bool is_zero(const uint8_t* data, size_t len) {
+        static const uint8_t zeros[PAGE] = {};
+        return std::memcmp(data, zeros, len) == 0;
+    }
+
+    void write_page(const uint8_t* page) {
+        if (is_zero(page, PAGE)) {
+            position_ += PAGE;
+        } else {
+            emit(page, PAGE);
+        }
+    }
+
+    void flush_partial() {
+        emit(partial_.data(), partial_len_);
+        partial_len_ = 0;
+    }
+
+    void emit(const uint8_t* data, size_t len) {
+        if (len == 0) return;
+        if (position_ != written_end_) out_.seekp(static_cast<std::streamoff>(position_));
+        if (!out_.write(reinterpret_cast<const char*>(data), len)) {
+            throw std::runtime_error("写入失败: " + path_.string());
+        }
+        position_ += len;
+        written_end_ = position_;
+    }
+
+    fs::path path_;
+    std::ofstream out_;
+    bool detect_zeros_;
+    std::array<uint8_t, PAGE> partial_{};   // 暂存的不完整页，起点总在页边界上
+    size_t partial_len_ = 0;
+    uint64_t position_ = 0;     // 下一个字节在文件中的偏移
+    uint64_t written_end_ = 0;  // 最后一次写入的末尾，也是当前的文件大小
+};
+
+#ifdef BACKUP_HAVE_IO_URING
+// 直接通过系统调用使用 io_uring(不依赖 liburing)。只由一个线程使用
+class IoUring {
+public:
+    explicit IoUring(unsigned entries) {
+        io_uring_params params{};
+        fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+        try {
+            sq_len_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_len_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap) sq_len_ = cq_len_ = std::max(sq_len_, cq_len_);
+            sq_ring_ = map(sq_len_, IORING_OFF_SQ_RING);
+            cq_ring_ = single_mmap ? sq_ring_ : map(cq_len_, IORING_OFF_CQ_RING);
+            sqes_len_ = params.sq_entries * sizeof(io_uring_sqe);
+            sqes_ = static_cast<io_uring_sqe*>(map(sqes_len_, IORING_OFF_SQES));
+        } catch (...) {
+            release();
+            throw;
+        }
+
+        sq_entries_ = params.sq_entries;
+        sq_head_ = ring_field(sq_ring_, params.sq_off.head);
+        sq_tail_ = ring_field(sq_ring_, params.sq_off.tail);
+        sq_mask_ = *ring_field(sq_ring_, params.sq_off.ring_mask);
+        sq_array_ = ring_field(sq_ring_, params.sq_off.array);
+        cq_head_ = ring_field(cq_ring_, params.cq_off.head);
+        cq_tail_ = ring_field(cq_ring_, params.cq_off.tail);
+        cq_mask_ = *ring_field(cq_ring_, params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(static_cast<char*>(cq_ring_) + params.cq_off.cqes);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    ~IoUring() { release(); }
+
+    // 内核是否支持 io_uring 以及这里用到的操作(Linux 5.6 起)。结果只探测一次
+    static bool supported() {
+        static const bool result = [] {
+            try {
+                IoUring ring(4);
+                std::vector<uint8_t> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+                auto* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+                if (::syscall(__NR_io_uring_register, ring.fd_, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+                for (int op : {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE}) {
+                    if (op >= probe->ops_len || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+                }
+                return true;
+            } catch (const std::exception&) {
+                return false;
+            }
+        }();
+        return result;
+    }
+
+    unsigned entries() const { return sq_entries_; }
+
+    // 把一个请求放入提交队列，队列已满时返回 false
+    bool push(const io_uring_sqe& sqe) {
+        unsigned tail = *sq_tail_;
+        if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) return false;
+        unsigned index = tail & sq_mask_;
+        sqes_[index] = sqe;
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted_;
+        return true;
+    }
+
+    // 提交所有排队的请求，并等待至少 wait_nr 个完成
+    void submit(unsigned wait_nr) {
+        while (true) {
+            long n = ::syscall(__NR_io_uring_enter, fd_, unsubmitted_, wait_nr,
+                               wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (n >= 0) {
+                unsubmitted_ -= static_cast<unsigned>(n);
+                return;
+            }
+            if (errno != EINTR) throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+        }
+    }
+
+    // 取出所有已完成的请求，依次调用 f(user_data, res)
+    template <typename F>
+    void reap(F&& f) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            uint64_t user_data = cqe.user_data;
+            int res = cqe.res;
+            __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+            f(user_data, res);
+        }
+    }
+
+private:
+    void* map(size_t len, off_t offset) {
+        void* p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        if (p == MAP_FAILED) throw std::system_error(errno, std::generic_category(), "mmap io_uring");
+        return p;
+    }
+
+    static unsigned* ring_field(void* ring, uint32_t offset) {
+        return reinterpret_cast<unsigned*>(static_cast<char*>(ring) + offset);
+    }
+
+    void release() {
+        if (sqes_) ::munmap(sqes_, sqes_len_);
+        if (cq_ring_ && cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_len_);
+        if (sq_ring_) ::munmap(sq_ring_, sq_len_);
+        if (fd_ >= 0) ::close(fd_);
+        sqes_ = nullptr;
+        cq_ring_ = sq_ring_ = nullptr;
+        fd_ = -1;
+    }
+
+    int fd_ = -1;
+    void* sq_ring_ = nullptr;
+    void* cq_ring_ = nullptr;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sq_len_ = 0, cq_len_ = 0, sqes_len_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* sq_array_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned unsubmitted_ = 0;
+};
+
+// 基于 io_uring 的批量读取/复制。每个槽位处理一个文件，按 statx → openat → read(→ write) → close
+// 的顺序提交请求，同时有 depth 个文件在途；读到的数据块交给任务的回调(通常是哈希)
+class UringPipeline {
 public:
-    struct FileInfo {
-        fs::path path;
-        std::string md5;
-        uintmax_t size;
-        time_t last_modified;
+    struct Job {
+        std::string source;
+        std::string dest;   // 非空时把读到的数据写入这个文件
+        std::function<void(const uint8_t*, size_t)> consume;
+        std::function<void(int error)> done;    // error 为 0 表示成功，SPARSE 或 errno 表示失败
+    };
+
+    // 写目标文件的任务遇到稀疏源文件时不处理，由调用方改用保留空洞的复制
+    static constexpr int SPARSE = -1;
+
+    UringPipeline(unsigned depth, size_t buffer_size)
+        : ring_(std::max(1u, depth)),
+          buffer_size_((std::max(buffer_size, FileReader::ALIGNMENT) + FileReader::ALIGNMENT - 1) /
+                       FileReader::ALIGNMENT * FileReader::ALIGNMENT),
+          slots_(ring_.entries()) {
+        for (uint32_t i = 0; i < slots_.size(); ++i) {
+            slots_[i].buffer.reset(static_cast<uint8_t*>(std::aligned_alloc(FileReader::ALIGNMENT, buffer_size_)));
+            if (!slots_[i].buffer) throw std::bad_alloc();
+            free_.push_back(i);
+        }
+    }
+
+    // pull(wait) 提供下一个任务。wait 为 false 时不应阻塞，返回空表示暂时没有任务；
+    // wait 为 true 时返回空表示任务已全部提供
+    template <typename Pull>
+    void run(Pull&& pull) {
+        bool exhausted = false;
+        while (true) {
+            while (!exhausted && !free_.empty()) {
+                std::optional<Job> job = pull(in_flight_ == 0);
+                if (!job) {
+                    exhausted = in_flight_ == 0;
+                    break;
+                }
+                start(std::move(*job));
+            }
+            if (in_flight_ == 0) {
+                if (exhausted) return;
+                continue;
+            }
+            ring_.submit(1);
+            ring_.reap([this](uint64_t slot, int res) { advance(static_cast<uint32_t>(slot), res); });
+        }
+    }
+
+private:
+    enum class Stage { Statx, OpenSource, OpenDest, Read, Write, CloseSource, CloseDest };
+
+    struct AlignedFree {
+        void operator()(uint8_t* p) const { std::free(p); }
+    };
+
+    struct Slot {
+        Job job;
+        Stage stage = Stage::Read;
+        int source = -1;
+        int dest = -1;
+        uint64_t offset = 0;
+        uint32_t pending = 0;   // 当前块的长度和已写出的部分
+        uint32_t written = 0;
+        int error = 0;
+        struct statx stx {};
+        std::unique_ptr<uint8_t, AlignedFree> buffer;
     };
 
-    struct BackupInfo {
-        std::string timestamp;
-        fs::path backup_path;
-        size_t file_count;
-        size_t copied_files;
-        fs::path source_dir;
-        bool is_incremental;
-        std::string based_on;
-    };
+    void start(Job job) {
+        uint32_t id = free_.back();
+        free_.pop_back();
+        ++in_flight_;
+        Slot& slot = slots_[id];
+        slot.job = std::move(job);
+        slot.source = slot.dest = -1;
+        slot.offset = 0;
+        slot.error = 0;
+        // 写目标文件时需要源文件的权限，并据此判断源文件是否稀疏
+        if (!slot.job.dest.empty()) {
+            slot.stage = Stage::Statx;
+            queue(id, IORING_OP_STATX, AT_FDCWD, slot.job.source.c_str(), STATX_MODE | STATX_SIZE | STATX_BLOCKS,
+                  reinterpret_cast<uint64_t>(&slot.stx), 0);
+        } else {
+            open_source(id);
+        }
+    }
+
+    void open_source(uint32_t id) {
+        Slot& slot = slots_[id];
+        slot.stage = Stage::OpenSource;
+        queue(id, IORING_OP_OPENAT, AT_FDCWD, slot.job.source.c_str(), 0, 0, O_RDONLY | O_CLOEXEC);
+    }
+
+    void read_next(uint32_t id) {
+        Slot& slot = slots_[id];
+        slot.stage = Stage::Read;
+        queue(id, IORING_OP_READ, slot.source, slot.buffer.get(), static_cast<uint32_t>(buffer_size_), slot.offset, 0);
+    }
+
+    void write_rest(uint32_t id) {
+        Slot& slot = slots_[id];
+        slot.stage = Stage::Write;
+        queue(id, IORING_OP_WRITE, slot.dest, slot.buffer.get() + slot.written, slot.pending - slot.written,
+              slot.offset + slot.written, 0);
+    }
+
+    // 依次关闭打开的文件，全部关闭后结束任务
+    void close_next(uint32_t id) {
+        Slot& slot = slots_[id];
+        if (slot.source >= 0) {
+            slot.stage = Stage::CloseSource;
+            queue(id, IORING_OP_CLOSE, slot.source, nullptr, 0, 0, 0);
+            slot.source = -1;
+        } else if (slot.dest >= 0) {
+            slot.stage = Stage::CloseDest;
+            queue(id, IORING_OP_CLOSE, slot.dest, nullptr, 0, 0, 0);
+            slot.dest = -1;
+        } else {
+            Job job = std::move(slot.job);
+            free_.push_back(id);
+            --in_flight_;
+            job.done(slot.error);
+        }
+    }
+
+    void advance(uint32_t id, int res) {
+        Slot& slot = slots_[id];
+        if (res < 0) {
+            if (slot.error == 0 && slot.stage != Stage::CloseSource) slot.error = -res;
+            close_next(id);
+            return;
+        }
+
+        switch (slot.stage) {
+            case Stage::Statx:
+                if (slot.stx.stx_blocks * 512 < slot.stx.stx_size) {
+                    slot.error = SPARSE;
+                    close_next(id);
+                    break;
+                }
+                open_source(id);
+                break;
+            case Stage::OpenSource:
+                slot.source = res;
+                if (slot.job.dest.empty()) {
+                    read_next(id);
+                } else {
+                    slot.stage = Stage::OpenDest;
+                    queue(id, IORING_OP_OPENAT, AT_FDCWD, slot.job.dest.c_str(), slot.stx.stx_mode & 07777, 0,
+                          O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+                }
+                break;
+            case Stage::OpenDest:
+                slot.dest = res;
+                read_next(id);
+                break;
+            case Stage::Read:
+                if (res == 0) {
+                    close_next(id);
+                    break;
+                }
+                try {
+                    slot.job.consume(slot.buffer.get(), static_cast<size_t>(res));
+                } catch (const std::exception&) {
+                    slot.error = EIO;
+                    close_next(id);
+                    break;
+                }
+                if (slot.dest >= 0) {
+                    slot.pending = static_cast<uint32_t>(res);
+                    slot.written = 0;
+                    write_rest(id);
+                } else {
+                    slot.offset += static_cast<uint64_t>(res);
+                    read_next(id);
+                }
+                break;
+            case Stage::Write:
+                if (res == 0) {
+                    slot.error = EIO;
+                    close_next(id);
+                    break;
+                }
+                slot.written += static_cast<uint32_t>(res);
+                if (slot.written < slot.pending) {
+                    write_rest(id);
+                } else {
+                    slot.offset += slot.pending;
+                    read_next(id);
+                }
+                break;
+            case Stage::CloseSource:
+            case Stage::CloseDest:
+                close_next(id);
+                break;
+        }
+    }
+
+    void queue(uint32_t id, uint8_t opcode, int fd, const void* addr, uint32_t len, uint64_t offset,
+               uint32_t op_flags) {
+        io_uring_sqe sqe{};
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(addr);
+        sqe.len = len;
+        sqe.off = offset;
+        sqe.open_flags = op_flags;  // 与 rw_flags/statx_flags 共用同一字段
+        sqe.user_data = id;
+        // 每个槽位同一时刻只有一个请求，提交队列不会满
+        ring_.push(sqe);
+    }
+
+    IoUring ring_;
+    size_t buffer_size_;
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> free_;
+    unsigned in_flight_ = 0;
+};
+#endif
+
+#ifdef BACKUP_HAVE_STATX
+// 目录列举：getdents64 大块读取目录项，目录凭 d_type 识别不必 stat，
+// 其余条目用一次 statx(相对目录 fd)取得类型/大小/修改时间/inode
+class DirectoryLister {
+public:
+    struct Entry {
+        std::string name;
+        bool directory;
+        uint64_t size;
+        int64_t mtime;      // 与 fs::last_write_time(...).time_since_epoch().count() 相同的计数
+        uint64_t inode;
+    };
+
+    struct Listing {
+        std::vector<Entry> entries;     // 只含目录和普通文件(含指向普通文件的符号链接)，保持目录项原有顺序
+        int error = 0;
+    };
+
+    static constexpr size_t BUFFER_SIZE = 256 * 1024;
+
+    // statx 时间与 fs::file_time_type 计数之间的差值。标准库的文件时钟纪元因实现而异，
+    // 用同一个路径的两种结果校准，保证与旧清单中的修改时间逐位一致。不支持 statx 时返回空
+    static std::optional<int64_t> mtime_offset(const fs::path& path) {
+        struct statx stx;
+        if (::statx(AT_FDCWD, path.c_str(), 0, STATX_MTIME, &stx) != 0 || !(stx.stx_mask & STATX_MTIME)) {
+            return std::nullopt;
+        }
+        std::error_code ec;
+        auto mtime = fs::last_write_time(path, ec);
+        if (ec) return std::nullopt;
+        return mtime.time_since_epoch().count() - to_count(stx.stx_mtime);
+    }
+
+    static Listing list(const fs::path& dir, int64_t mtime_offset) {
+        Listing listing;
+        UniqueFd fd(::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (!fd) {
+            listing.error = errno;
+            return listing;
+        }
+
+        std::vector<char> buffer(BUFFER_SIZE);
+        while (true) {
+            long n = ::syscall(SYS_getdents64, fd.get(), buffer.data(), buffer.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                listing.error = errno;
+                return listing;
+            }
+            if (n == 0) break;
+
+            for (long pos = 0; pos < n;) {
+                const auto* d = reinterpret_cast<const Dirent64*>(buffer.data() + pos);
+                pos += d->d_reclen;
+                std::string_view name(d->d_name);
+                if (name == "." || name == "..") continue;
+
+                Entry entry{std::string(name), d->d_type == DT_DIR, 0, 0, 0};
+                if (!entry.directory && !describe(fd.get(), d->d_name, d->d_type, mtime_offset, entry)) continue;
+                listing.entries.push_back(std::move(entry));
+            }
+        }
+        return listing;
+    }
+
+private:
+    struct Dirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    };
+
+    static int64_t to_count(const struct statx_timestamp& ts) {
+        return std::chrono::duration_cast<fs::file_time_type::duration>(
+                   std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)).count();
+    }
+
+    // 与 recursive_directory_iterator 的处理保持一致：目录的符号链接不进入，
+    // 指向普通文件的符号链接按目标文件处理。返回 false 表示跳过该条目
+    static bool describe(int dirfd, const char* name, unsigned char type, int64_t mtime_offset, Entry& entry) {
+        constexpr unsigned mask = STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO;
+        struct statx stx;
+        int flags = type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW;
+        if (::statx(dirfd, name, flags, mask, &stx) != 0) return false;
+        if (type == DT_UNKNOWN && S_ISDIR(stx.stx_mode)) {
+            entry.directory = true;
+            return true;
+        }
+        if (type == DT_UNKNOWN && S_ISLNK(stx.stx_mode) && ::statx(dirfd, name, 0, mask, &stx) != 0) return false;
+        if (!S_ISREG(stx.stx_mode)) return false;
+        entry.size = stx.stx_size;
+        entry.mtime = to_count(stx.stx_mtime) + mtime_offset;
+        entry.inode = stx.stx_ino;
+        return true;
+    }
+};
+#endif
+
+#ifdef BACKUP_HAVE_STATX
+// 用 inotify 递归监视一个目录树，把发生变更的目录记入脏目录集合。
+// 新建或移入的目录连同整个子树记为递归脏目录。watch 数量达到上限或事件队列溢出时记为不完整
+class DirectoryWatcher {
+public:
+    struct Dirty {
+        bool recursive = false;
+        int64_t stamp = 0;      // 最近一次变更事件的时刻(file_clock 计数)
+    };
+
+    explicit DirectoryWatcher(const fs::path& root) : root_(root) {
+        fd_.reset(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+        if (!fd_) throw std::system_error(errno, std::generic_category(), "inotify_init1");
+        watch_tree("");
+    }
+
+    int fd() const { return fd_.get(); }
+    // 自上次调用以来是否丢失过事件
+    bool take_overflow() {
+        bool overflowed = overflowed_;
+        overflowed_ = false;
+        return overflowed;
+    }
+    size_t watch_count() const { return dirs_.size(); }
+    std::unordered_map<std::string, Dirty>& dirty() { return dirty_; }
+
+    // 读取所有已到达的事件，返回是否有新的变更
+    bool drain(int64_t now) {
+        alignas(inotify_event) char buffer[64 * 1024];
+        bool changed = false;
+        while (true) {
+            ssize_t n = ::read(fd_.get(), buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            for (ssize_t pos = 0; pos < n;) {
+                const auto* event = reinterpret_cast<const inotify_event*>(buffer + pos);
+                pos += sizeof(inotify_event) + event->len;
+                changed |= handle(*event, now);
+            }
+        }
+        return changed;
+    }
+
+private:
+    static constexpr uint32_t MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                     IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+                                     IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+    static std::string join(const std::string& dir, std::string_view name) {
+        return dir.empty() ? std::string(name) : dir + "/" + std::string(name);
+    }
+
+    // 先加 watch 再列举子目录，列举之后出现的子目录会产生 IN_CREATE 事件，不会遗漏。
+    // 已监视的目录(同一 inode)重新加入时得到原来的 wd，正好用来更新移动后的路径
+    void watch_tree(const std::string& relative) {
+        std::vector<std::string> pending{relative};
+        while (!pending.empty()) {
+            std::string dir = std::move(pending.back());
+            pending.pop_back();
+            int wd = ::inotify_add_watch(fd_.get(), (root_ / dir).c_str(), MASK);
+            if (wd < 0) {
+                if (errno == ENOSPC) overflowed_ = true;    // 超过 fs.inotify.max_user_watches
+                continue;
+            }
+            dirs_[wd] = dir;
+            DirectoryLister::Listing listing = DirectoryLister::list(root_ / dir, 0);
+            for (const auto& entry : listing.entries) {
+                if (entry.directory) pending.push_back(join(dir, entry.name));
+            }
+        }
+    }
+
+    void mark(const std::string& dir, bool recursive, int64_t now) {
+        Dirty& dirty = dirty_[dir];
+        dirty.recursive |= recursive;
+        dirty.stamp = now;
+    }
+
+    bool handle(const inotify_event& event, int64_t now) {
+        if (event.mask & IN_Q_OVERFLOW) {
+            overflowed_ = true;
+            return true;
+        }
+        auto it = dirs_.find(event.wd);
+        if (it == dirs_.end()) return false;
+        if (event.mask & IN_IGNORED) {
+            dirs_.erase(it);
+            return false;
+        }
+        if (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF)) return false;     // 由父目录的事件记录
+
+        const std::string dir = it->second;
+        mark(dir, false, now);
+        if ((event.mask & IN_ISDIR) && (event.mask & (IN_CREATE | IN_MOVED_TO)) && event.len) {
+            std::string child = join(dir, event.name);
+            mark(child, true, now);
+            watch_tree(child);
+        }
+        return true;
+    }
+
+    fs::path root_;
+    UniqueFd fd_;
+    std::unordered_map<int, std::string> dirs_;     // wd -> 相对路径
+    std::unordered_map<std::string, Dirty> dirty_;
+    bool overflowed_ = false;
+};
+#endif
+
+// 无锁有界 MPMC 队列(Vyukov)：每个槽位带一个序号，生产者和消费者各自用 CAS 推进位置，
+// 互不加锁。容量向上取整到 2 的幂，满时 try_push、空时 try_pop 立即返回 false
+template <typename T>
+class MpmcQueue {
+public:
+    explicit MpmcQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        mask_ = size - 1;
+        cells_ = std::make_unique<Cell[]>(size);
+        for (size_t i = 0; i < size; ++i) cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // 成功时取走 item，失败时 item 保持不变
+    bool try_push(T& item) {
+        size_t pos = enqueue_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& item) {
+        size_t pos = dequeue_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_.load(std::memory_order_relaxed);
+            }
+        }
+        item = std::move(cell->value);
+        cell->value = T();
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> enqueue_{0};
+    alignas(64) std::atomic<size_t> dequeue_{0};
+};
+
+// 有界阻塞队列：生产者在队列满时等待，close() 后消费者取完剩余元素即结束。
+// 元素经 MpmcQueue 无锁传递，只有队列满或空、需要睡眠时才用到互斥锁；
+// 等待方先登记再检查队列，另一方操作后看到有人登记才加锁唤醒，不会漏掉通知
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : ring_(capacity ? capacity : 1) {}
+
+    void push(T item) {
+        if (!ring_.try_push(item)) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            producers_waiting_.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            not_full_.wait(lock, [&] { return ring_.try_push(item); });
+            producers_waiting_.fetch_sub(1);
+        }
+        wake(consumers_waiting_, not_empty_);
+    }
+
+    std::optional<T> pop() {
+        T item;
+        if (!ring_.try_pop(item)) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            consumers_waiting_.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool popped = false;
+            not_empty_.wait(lock, [&] { return (popped = ring_.try_pop(item)) || closed_; });
+            consumers_waiting_.fetch_sub(1);
+            if (!popped) return std::nullopt;
+        }
+        wake(producers_waiting_, not_full_);
+        return item;
+    }
+
+    // 不等待，队列为空时立即返回
+    std::optional<T> try_pop() {
+        T item;
+        if (!ring_.try_pop(item)) return std::nullopt;
+        wake(producers_waiting_, not_full_);
+        return item;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+private:
+    void wake(const std::atomic<unsigned>& waiting, std::condition_variable& cv) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed) == 0) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        cv.notify_one();
+    }
+
+    MpmcQueue<T> ring_;
+    bool closed_ = false;   // 只在持有 mutex_ 时读写
+    std::atomic<unsigned> producers_waiting_{0};
+    std::atomic<unsigned> consumers_waiting_{0};
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+// 调度器中的一个任务。调度队列和提交方(TaskGroup)各持有一份引用，
+// 谁先把状态从 Queued 改为 Running 谁执行，另一方只释放引用
+class SchedulerTask {
+public:
+    enum State : int { Queued, Running, Done };
+
+    explicit SchedulerTask(std::function<void()> fn) : fn_(std::move(fn)) {}
+
+    bool claim() {
+        int expected = Queued;
+        return state_.compare_exchange_strong(expected, Running);
+    }
+
+    // 执行已认领的任务，异常留给提交方取出
+    void run() {
+        try {
+            fn_();
+        } catch (...) {
+            error_ = std::current_exception();
+        }
+        fn_ = nullptr;
+        state_.store(Done);
+    }
+
+    bool done() const { return state_.load() == Done; }
+    std::exception_ptr error() const { return error_; }
+
+    void release() {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+    }
+
+private:
+    std::function<void()> fn_;
+    std::exception_ptr error_;
+    std::atomic<int> state_{Queued};
+    std::atomic<int> refs_{2};
+};
+
+// Chase-Lev 工作窃取双端队列：只有所属的工作线程在底部压入和弹出，其他线程从顶部窃取，
+// 全程无锁。数组写满时所属线程换成两倍大的新数组，旧数组保留到队列销毁，正在窃取的线程仍可安全读取
+class WorkStealingDeque {
+public:
+    WorkStealingDeque() {
+        arrays_.push_back(std::make_unique<Array>(256));
+        array_.store(arrays_.back().get(), std::memory_order_relaxed);
+    }
+
+    void push(SchedulerTask* task) {
+        int64_t bottom = bottom_.load(std::memory_order_relaxed);
+        int64_t top = top_.load(std::memory_order_acquire);
+        Array* array = array_.load(std::memory_order_relaxed);
+        if (bottom - top >= static_cast<int64_t>(array->size())) {
+            arrays_.push_back(array->grow(top, bottom));
+            array = arrays_.back().get();
+            array_.store(array, std::memory_order_release);
+        }
+        array->put(bottom, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    SchedulerTask* pop() {
+        int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+        Array* array = array_.load(std::memory_order_relaxed);
+        bottom_.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = top_.load(std::memory_order_relaxed);
+        if (top > bottom) {
+            bottom_.store(bottom + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        SchedulerTask* task = array->get(bottom);
+        if (top == bottom) {
+            // 只剩最后一个，与窃取方竞争
+            if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                task = nullptr;
+            }
+            bottom_.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    SchedulerTask* steal() {
+        int64_t top = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = bottom_.load(std::memory_order_acquire);
+        if (top >= bottom) return nullptr;
+        SchedulerTask* task = array_.load(std::memory_order_acquire)->get(top);
+        if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return task;
+    }
+
+    bool empty() const {
+        return top_.load(std::memory_order_acquire) >= bottom_.load(std::memory_order_acquire);
+    }
+
+private:
+    class Array {
+    public:
+        explicit Array(size_t size) : mask_(size - 1), slots_(new std::atomic<SchedulerTask*>[size]) {}
+
+        size_t size() const { return mask_ + 1; }
+        SchedulerTask* get(int64_t i) const { return slots_[i & mask_].load(std::memory_order_acquire); }
+        void put(int64_t i, SchedulerTask* task) { slots_[i & mask_].store(task, std::memory_order_release); }
+
+        std::unique_ptr<Array> grow(int64_t top, int64_t bottom) const {
+            auto bigger = std::make_unique<Array>(size() * 2);
+            for (int64_t i = top; i < bottom; ++i) bigger->put(i, get(i));
+            return bigger;
+        }
+
+    private:
+        size_t mask_;
+        std::unique_ptr<std::atomic<SchedulerTask*>[]> slots_;
+    };
+
+    alignas(64) std::atomic<int64_t> top_{0};
+    alignas(64) std::atomic<int64_t> bottom_{0};
+    std::atomic<Array*> array_{nullptr};
+    std::vector<std::unique_ptr<Array>> arrays_;    // 只由所属线程修改
+};
+
+// 进程内共享的工作窃取调度器：遍历、哈希、复制、恢复、校验和上传都把任务提交到这里，
+// 不再各自创建线程。工作线程提交的任务压入自己的 WorkStealingDeque，其他线程提交的进入
+// 无锁的注入队列；空闲的工作线程依次查看自己的队列、注入队列，再随机窃取别人的任务，
+// 都没有时才睡眠。线程数由 configure 在首次使用前设置
+class TaskScheduler {
+public:
+    static void configure(unsigned threads) { configured_threads() = std::max(1u, threads); }
+
+    static TaskScheduler& shared() {
+        static TaskScheduler scheduler(configured_threads());
+        return scheduler;
+    }
+
+    ~TaskScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stopping_ = true;
+        }
+        sleep_cv_.notify_all();
+        for (auto& thread : threads_) thread.join();
+    }
+
+    unsigned size() const { return static_cast<unsigned>(threads_.size()); }
+
+#ifdef __linux__
+    // 各工作线程的线程号，用于单独设置它们的 I/O 和 CPU 优先级
+    const std::vector<pid_t>& thread_ids() const { return thread_ids_; }
+#endif
+
+    void submit(SchedulerTask* task) {
+        if (current_scheduler() == this) {
+            workers_[current_worker()]->deque.push(task);
+        } else if (!injected_.try_push(task)) {
+            std::lock_guard<std::mutex> lock(overflow_mutex_);
+            overflow_.push_back(task);
+            overflow_size_.fetch_add(1);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            sleep_cv_.notify_one();
+        }
+    }
+
+    // 等待一个已被别的线程认领的任务结束
+    void wait(const SchedulerTask& task) {
+        if (task.done()) return;
+        std::unique_lock<std::mutex> lock(done_mutex_);
+        done_waiting_.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        done_cv_.wait(lock, [&] { return task.done(); });
+        done_waiting_.fetch_sub(1);
+    }
+
+private:
+    struct Worker {
+        WorkStealingDeque deque;
+    };
+
+    explicit TaskScheduler(unsigned threads) : injected_(1024) {
+        for (unsigned i = 0; i < threads; ++i) workers_.push_back(std::make_unique<Worker>());
+#ifdef __linux__
+        thread_ids_.assign(threads, 0);
+        std::atomic<unsigned> started{0};
+#endif
+        for (unsigned i = 0; i < threads; ++i) {
+            threads_.emplace_back([this, i
+#ifdef __linux__
+                                   , &started
+#endif
+            ] {
+                current_scheduler() = this;
+                current_worker() = i;
+#ifdef __linux__
+                thread_ids_[i] = static_cast<pid_t>(::syscall(SYS_gettid));
+                started++;
+#endif
+                loop(i);
+            });
+        }
+#ifdef __linux__
+        while (started.load() < threads) std::this_thread::yield();
+#endif
+    }
+
+    static unsigned& configured_threads() {
+        static unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+        return threads;
+    }
+    static TaskScheduler*& current_scheduler() {
+        thread_local TaskScheduler* scheduler = nullptr;
+        return scheduler;
+    }
+    static unsigned& current_worker() {
+        thread_local unsigned worker = 0;
+        return worker;
+    }
+
+    SchedulerTask* find(unsigned self, std::minstd_rand& random) {
+        if (SchedulerTask* task = workers_[self]->deque.pop()) return task;
+        SchedulerTask* task = nullptr;
+        if (injected_.try_pop(task)) return task;
+        if (overflow_size_.load() > 0) {
+            std::lock_guard<std::mutex> lock(overflow_mutex_);
+            if (!overflow_.empty()) {
+                task = overflow_.front();
+                overflow_.pop_front();
+                overflow_size_.fetch_sub(1);
+                return task;
+            }
+        }
+        size_t count = workers_.size();
+        size_t start = random() % count;
+        for (size_t k = 0; k < count; ++k) {
+            size_t victim = (start + k) % count;
+            if (victim == self) continue;
+            if ((task = workers_[victim]->deque.steal())) return task;
+        }
+        return nullptr;
+    }
+
+    void execute(SchedulerTask* task) {
+        if (task->claim()) {
+            task->run();
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (done_waiting_.load(std::memory_order_relaxed) > 0) {
+                std::lock_guard<std::mutex> lock(done_mutex_);
+                done_cv_.notify_all();
+            }
+        }
+        task->release();
+    }
+
+    void loop(unsigned self) {
+        std::minstd_rand random(self + 1);
+        while (true) {
+            SchedulerTask* task = find(self, random);
+            for (int spin = 0; !task && spin < 64; ++spin) {
+                std::this_thread::yield();
+                task = find(self, random);
+            }
+            if (task) {
+                execute(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            sleeping_.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            sleep_cv_.wait(lock, [&] { return stopping_ || (task = find(self, random)) != nullptr; });
+            sleeping_.fetch_sub(1);
+            if (!task) return;
+            lock.unlock();
+            execute(task);
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+#ifdef __linux__
+    std::vector<pid_t> thread_ids_;
+#endif
+    MpmcQueue<SchedulerTask*> injected_;
+    std::mutex overflow_mutex_;
+    std::deque<SchedulerTask*> overflow_;     // 注入队列满时的后备
+    std::atomic<size_t> overflow_size_{0};
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_cv_;
+    std::atomic<unsigned> sleeping_{0};
+    bool stopping_ = false;
+    std::mutex done_mutex_;
+    std::condition_variable done_cv_;
+    std::atomic<unsigned> done_waiting_{0};
+};
+
+// 一组提交到共享调度器的任务。wait 依次处理每个任务：还没被工作线程取走的由等待方
+// 直接执行，已在执行的等它结束。因此任务里可以阻塞等待同组或其他阶段的任务，
+// 即使所有工作线程都忙，等待方也总能推进。任务抛出的第一个异常由 wait 重新抛出
+class TaskGroup {
+public:
+    TaskGroup() : scheduler_(TaskScheduler::shared()) {}
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    ~TaskGroup() {
+        for (size_t i = 0; i < tasks_.size(); ++i) finish(i);
+    }
+
+    // 提交一个任务，返回它在组内的序号
+    size_t run(std::function<void()> fn) {
+        auto* task = new SchedulerTask(std::move(fn));
+        tasks_.push_back(task);
+        scheduler_.submit(task);
+        return tasks_.size() - 1;
+    }
+
+    size_t size() const { return tasks_.size(); }
+
+    // 等待序号为 index 的任务
+    void wait(size_t index) {
+        finish(index);
+        rethrow();
+    }
+
+    void wait() {
+        for (size_t i = 0; i < tasks_.size(); ++i) finish(i);
+        rethrow();
+    }
+
+private:
+    void finish(size_t index) {
+        SchedulerTask* task = tasks_[index];
+        if (!task) return;
+        if (task->claim()) {
+            task->run();
+        } else {
+            scheduler_.wait(*task);
+        }
+        if (!error_ && task->error()) error_ = task->error();
+        task->release();
+        tasks_[index] = nullptr;
+    }
+
+    void rethrow() {
+        if (error_) std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+
+    TaskScheduler& scheduler_;
+    std::vector<SchedulerTask*> tasks_;     // 只由提交线程访问
+    std::exception_ptr error_;
+};
+
+// 内容寻址块的引用
+struct ChunkRef {
+    Digest id;
+    uint32_t length;
+};
+
+// 每个文件引用的块列表，扁平存放：文件 f 的块为 refs[begin[f], begin[f + 1])
+struct ChunkLists {
+    std::vector<ChunkRef> refs;
+    std::vector<uint64_t> begin{0};
+
+    void add_file(const ChunkRef* first, size_t count) {
+        refs.insert(refs.end(), first, first + count);
+        begin.push_back(refs.size());
+    }
+
+    size_t file_count() const { return begin.size() - 1; }
+    size_t count(FileIndex::Id file) const { return begin[file + 1] - begin[file]; }
+    const ChunkRef* chunks(FileIndex::Id file) const { return refs.data() + begin[file]; }
+};
+
+struct DigestHash {
+    size_t operator()(const Digest& digest) const {
+        size_t h;
+        std::memcpy(&h, digest.bytes.data(), sizeof(h));
+        return h;
+    }
+};
+
+// FastCDC 内容定义分块(归一化分块)：块边界只取决于内容，
+// 文件中间插入或删除数据只影响附近的一两个块，其余块仍可去重
+class Chunker {
+public:
+    static constexpr size_t MIN_SIZE = 64 * 1024;
+    static constexpr size_t AVG_SIZE = 256 * 1024;
+    static constexpr size_t MAX_SIZE = 1024 * 1024;
+
+    // 返回从 data 开始的第一个块的长度。len 小于 MAX_SIZE 时调用方必须保证已到文件末尾
+    static size_t cut(const uint8_t* data, size_t len) {
+        if (len <= MIN_SIZE) return len;
+        size_t normal = std::min(len, AVG_SIZE);
+        size_t limit = std::min(len, MAX_SIZE);
+        uint64_t hash = 0;
+        size_t i = MIN_SIZE;
+        for (; i < normal; ++i) {
+            hash = (hash << 1) + gear()[data[i]];
+            if (!(hash & MASK_SMALL)) return i + 1;
+        }
+        for (; i < limit; ++i) {
+            hash = (hash << 1) + gear()[data[i]];
+            if (!(hash & MASK_LARGE)) return i + 1;
+        }
+        return limit;
+    }
+
+private:
+    // 平均块以下用更严格的掩码、以上用更宽松的掩码，使块大小集中在平均值附近
+    static constexpr uint64_t MASK_SMALL = ((1ULL << 20) - 1) << 44;
+    static constexpr uint64_t MASK_LARGE = ((1ULL << 16) - 1) << 48;
+
+    // Gear 表由固定种子生成，保证不同版本、不同机器切出的块一致
+    static const std::array<uint64_t, 256>& gear() {
+        static const std::array<uint64_t, 256> table = [] {
+            std::array<uint64_t, 256> t{};
+            uint64_t state = 0x6a09e667f3bcc908ULL;
+            for (auto& value : t) {
+                state += 0x9e3779b97f4a7c15ULL;     // splitmix64
+                uint64_t z = state;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                value = z ^ (z >> 31);
+            }
+            return t;
+        }();
+        return table;
+    }
+};
+
+// rsync 的弱校验和：a 为窗口内字节之和，b 为按位置加权的和，各取低 16 位。
+// 窗口向后滑动一个字节时 O(1) 更新，用来在新文件的任意偏移处查找旧文件的块
+class RollingChecksum {
+public:
+    void reset(const uint8_t* data, size_t len) {
+        a_ = b_ = 0;
+        len_ = static_cast<uint32_t>(len);
+        for (size_t i = 0; i < len; ++i) {
+            a_ += data[i];
+            b_ += static_cast<uint32_t>(len - i) * data[i];
+        }
+    }
+
+    // 移出窗口首字节 out，移入 in
+    void roll(uint8_t out, uint8_t in) {
+        a_ += static_cast<uint32_t>(in) - out;
+        b_ += a_ - len_ * out;
+    }
+
+    uint32_t value() const { return (a_ & 0xffff) | (b_ << 16); }
+
+private:
+    uint32_t a_ = 0, b_ = 0, len_ = 0;
+};
+
+// 共享块仓库：backup_dir/chunks/<前两位>/<摘要>，同一内容只保存一份，
+// 不同快照、不同源目录之间自动去重
+class ChunkStore {
+public:
+    static constexpr const char* DIR_NAME = "chunks";
+    static constexpr const char* LOCK_NAME = ".lock";
+
+    // 仓库锁：使用块仓库的备份在整个运行期间持有共享锁，垃圾回收必须取得排他锁，
+    // 所以回收时标记出的引用集合不会漏掉正在写入的快照
+    class Lock {
+    public:
+        // 共享锁等待垃圾回收结束；排他锁不等待，取不到时 held() 为 false
+        Lock(const fs::path& backup_dir, bool exclusive) {
+            std::error_code ec;
+            fs::create_directories(backup_dir / DIR_NAME, ec);
+#ifndef _WIN32
+            fs::path path = backup_dir / DIR_NAME / LOCK_NAME;
+            fd_.reset(::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+            held_ = fd_ && ::flock(fd_.get(), exclusive ? LOCK_EX | LOCK_NB : LOCK_SH) == 0;
+#else
+            (void)exclusive;
+            held_ = true;
+#endif
+        }
+
+        bool held() const { return held_; }
+
+    private:
+#ifndef _WIN32
+        UniqueFd fd_;
+#endif
+        bool held_ = false;
+    };
+
+    explicit ChunkStore(const fs::path& backup_dir) : root_(backup_dir / DIR_NAME) {
+        for (int i = 0; i < 256; ++i) {
+            static constexpr char digits[] = "0123456789abcdef";
+            fs::create_directories(root_ / std::string{digits[i >> 4], digits[i & 0x0f]});
+        }
+    }
+
+    // 块 id 使用加密哈希，不采用 xxh3 这类只适合变更检测的算法
+    static HashAlgorithm algorithm() {
+        return Hasher::available(HashAlgorithm::BLAKE3) ? HashAlgorithm::BLAKE3 : HashAlgorithm::SHA256;
+    }
+
+    const fs::path& root() const { return root_; }
+
+    fs::path path_of(const Digest& id) const {
+        std::string hex = id.hex();
+        return root_ / hex.substr(0, 2) / hex;
+    }
+
+    // 不创建仓库目录，只计算块在 backup_dir 下的位置(恢复时使用)
+    static fs::path path_of(const fs::path& backup_dir, const Digest& id) {
+        std::string hex = id.hex();
+        return backup_dir / DIR_NAME / hex.substr(0, 2) / hex;
+    }
+
+    // 保存一个块，已存在时不重复写入。返回是否新写入
+    bool put(const Digest& id, const uint8_t* data, size_t len) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (known_.count(id)) return false;
+        }
+
+        fs::path path = path_of(id);
+        std::error_code ec;
+        if (fs::exists(path, ec)) {
+            remember(id);
+            return false;
+        }
+
+        // 先写临时文件、落盘后再重命名。共享锁允许多个备份同时写入仓库，临时文件名带上进程号和
+        // 线程号并以 O_EXCL 创建，互不覆盖；并发写入同一块时后完成的覆盖先完成的，内容相同
+        fs::path tmp_path = path;
+        tmp_path += ".tmp." + std::to_string(::getpid()) + "." +
+                    std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + "." +
+                    std::to_string(next_tmp_++);
+        if (!write_file(tmp_path, data, len)) {
+            fs::remove(tmp_path, ec);
+            throw std::runtime_error("无法写入数据块: " + path.string());
+        }
+        fs::rename(tmp_path, path, ec);
+        if (ec) {
+            // 不能替换已存在文件的平台上，另一个写入者先完成了同一块
+            std::error_code exists_ec;
+            bool stored = fs::exists(path, exists_ec);
+            fs::remove(tmp_path, exists_ec);
+            if (!stored) throw std::runtime_error("无法写入数据块: " + path.string() + ": " + ec.message());
+            remember(id);
+            return false;
+        }
+        remember(id);
+        return true;
+    }
+
+private:
+    void remember(const Digest& id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        known_.insert(id);
+    }
+
+    // 新建文件写入全部数据并落盘；文件已存在时失败
+    static bool write_file(const fs::path& path, const uint8_t* data, size_t len) {
+#ifndef _WIN32
+        UniqueFd fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644));
+        if (!fd) return false;
+        while (len > 0) {
+            ssize_t n = ::write(fd.get(), data, len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            len -= static_cast<size_t>(n);
+        }
+        return ::fsync(fd.get()) == 0;
+#else
+        if (fs::exists(path)) return false;
+        std::ofstream out(path, std::ios::binary);
+        return out && out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(len)) && out.flush();
+#endif
+    }
+
+    fs::path root_;
+    std::mutex mutex_;
+    std::unordered_set<Digest, DigestHash> known_;    // 本次运行已确认存在的块
+    std::atomic<uint64_t> next_tmp_{0};
+};
+
+// 归档段中数据帧的压缩方式。数值写入帧头，只能追加不能修改
+enum class Codec : uint8_t {
+    None = 0,
+    Zstd = 1,
+    LZ4 = 2,
+};
+
+// 帧格式：codec(u8) 原始长度(u32) 存储长度(u32) 数据。
+// 每个帧独立压缩，恢复单个文件时只需定位到它的第一个帧
+class FrameCodec {
+public:
+    static constexpr size_t FRAME_SIZE = 1024 * 1024;
+    static constexpr size_t HEADER_SIZE = 9;
+
+    static const char* name(Codec codec) {
+        switch (codec) {
+            case Codec::None: return "none";
+            case Codec::Zstd: return "zstd";
+            case Codec::LZ4: return "lz4";
+        }
+        return "unknown";
+    }
+
+    static std::optional<Codec> parse(const std::string& name) {
+        for (Codec codec : {Codec::None, Codec::Zstd, Codec::LZ4}) {
+            if (name == FrameCodec::name(codec)) return codec;
+        }
+        return std::nullopt;
+    }
+
+    static bool available(Codec codec) {
+        switch (codec) {
+            case Codec::None: return true;
+#ifdef BACKUP_WITH_ZSTD
+            case Codec::Zstd: return true;
+#endif
+#ifdef BACKUP_WITH_LZ4
+            case Codec::LZ4: return true;
+#endif
+            default: return false;
+        }
+    }
+
+    // 默认优先 zstd，其次 lz4，都没有编译进来时不压缩
+    static Codec preferred() {
+        if (available(Codec::Zstd)) return Codec::Zstd;
+        if (available(Codec::LZ4)) return Codec::LZ4;
+        return Codec::None;
+    }
+
+    // 把一帧(不超过 FRAME_SIZE)追加到 out。压缩后不比原始数据小时按原样存储
+    static void encode(Codec codec, int level, const uint8_t* data, size_t len, std::vector<uint8_t>& out) {
+        size_t header = out.size();
+        out.resize(header + HEADER_SIZE + bound(codec, len));
+        uint8_t* payload = out.data() + header + HEADER_SIZE;
+
+        size_t stored = 0;
+        switch (codec) {
+#ifdef BACKUP_WITH_ZSTD
+            case Codec::Zstd: {
+                size_t n = ZSTD_compress(payload, bound(codec, len), data, len, level);
+                if (!ZSTD_isError(n)) stored = n;
+                break;
+            }
+#endif
+#ifdef BACKUP_WITH_LZ4
+            case Codec::LZ4: {
+                int n = LZ4_compress_fast(reinterpret_cast<const char*>(data), reinterpret_cast<char*>(payload),
+                                          static_cast<int>(len), static_cast<int>(bound(codec, len)),
+                                          std::max(1, level));
+                if (n > 0) stored = static_cast<size_t>(n);
+                break;
+            }
+#endif
+            default:
+                break;
+        }
+        (void)level;
+        if (stored == 0 || stored >= len) {
+            codec = Codec::None;
+            stored = len;
+            std::memcpy(payload, data, len);
+        }
+
+        uint8_t* h = out.data() + header;
+        uint32_t raw_len = static_cast<uint32_t>(len), stored_len = static_cast<uint32_t>(stored);
+        h[0] = static_cast<uint8_t>(codec);
+        std::memcpy(h + 1, &raw_len, sizeof(raw_len));
+        std::memcpy(h + 5, &stored_len, sizeof(stored_len));
+        out.resize(header + HEADER_SIZE + stored);
+    }
+
+    // 解析帧头，格式不合法时返回 false
+    static bool parse_header(const uint8_t* h, Codec& codec, uint32_t& raw_len, uint32_t& stored_len) {
+        codec = static_cast<Codec>(h[0]);
+        std::memcpy(&raw_len, h + 1, sizeof(raw_len));
+        std::memcpy(&stored_len, h + 5, sizeof(stored_len));
+        return raw_len <= FRAME_SIZE && stored_len <= bound(codec, FRAME_SIZE) &&
+               (codec != Codec::None || raw_len == stored_len);
+    }
+
+    // 把一帧的数据解码为 raw_len 字节写入 out
+    static bool decode(Codec codec, const uint8_t* payload, size_t stored, uint8_t* out, size_t raw_len) {
+        switch (codec) {
+            case Codec::None:
+                std::memcpy(out, payload, raw_len);
+                return stored == raw_len;
+#ifdef BACKUP_WITH_ZSTD
+            case Codec::Zstd:
+                return ZSTD_decompress(out, raw_len, payload, stored) == raw_len;
+#endif
+#ifdef BACKUP_WITH_LZ4
+            case Codec::LZ4:
+                return LZ4_decompress_safe(reinterpret_cast<const char*>(payload), reinterpret_cast<char*>(out),
+                                           static_cast<int>(stored), static_cast<int>(raw_len)) ==
+                       static_cast<int>(raw_len);
+#endif
+            default:
+                return false;   // 本程序编译时未包含对应的解压后端
+        }
+    }
+
+private:
+    static size_t bound(Codec codec, size_t len) {
+        switch (codec) {
+#ifdef BACKUP_WITH_ZSTD
+            case Codec::Zstd: return std::max(len, ZSTD_compressBound(len));
+#endif
+#ifdef BACKUP_WITH_LZ4
+            case Codec::LZ4: return std::max(len, static_cast<size_t>(LZ4_compressBound(static_cast<int>(len))));
+#endif
+            default: return len;
+        }
+    }
+};
+
+// 文件在归档段中的位置：从 offset 开始连续 stored 字节的帧
+struct ArchiveLocation {
+    uint32_t segment = 0;
+    uint64_t offset = 0;
+    uint64_t stored = 0;
+};
+
+// 归档快照的可寻址索引。段文件路径相对备份根目录，
+// 增量快照沿用上一个快照的段表，未变更的文件继续指向旧段
+struct ArchiveIndex {
+    std::vector<std::string> segments;
+    std::vector<ArchiveLocation> locations;     // 按文件编号
+};
+
+// 归档段的存放位置。段按顺序写入，finish 之后才算完整；失败时 write/finish 抛出 std::runtime_error
+class SegmentStore {
+public:
+    class Output {
+    public:
+        virtual ~Output() = default;
+        virtual void write(const uint8_t* data, size_t len) = 0;
+        virtual void flush() {}
+        virtual void finish() = 0;
+    };
+
+    virtual ~SegmentStore() = default;
+
+    // file 为段在快照目录中的文件名，name 为登记到段表中的名字("<快照名>/<file>")
+    virtual std::unique_ptr<Output> create(const std::string& file, const std::string& name) = 0;
+
+    // 检查点时是否要封闭当前段：对象存储上的段在上传完成之前不存在，日志不能引用它
+    virtual bool seal_on_checkpoint() const { return false; }
+
+    // 快照完成时发布它的清单(name 为 "<快照名>/manifest.bin")。本地的清单已经在快照目录中
+    virtual void publish(const std::string& name, const std::string& data) {
+        (void)name;
+        (void)data;
+    }
+};
+
+// 本地目录中的段文件
+class LocalSegmentStore : public SegmentStore {
+public:
+    explicit LocalSegmentStore(fs::path dir) : dir_(std::move(dir)) {}
+
+    std::unique_ptr<Output> create(const std::string& file, const std::string&) override {
+        return std::make_unique<FileOutput>(dir_ / file);
+    }
+
+private:
+    class FileOutput : public Output {
+    public:
+        explicit FileOutput(fs::path path) : path_(std::move(path)) {
+            out_.rdbuf()->pubsetbuf(buffer_.data(), buffer_.size());
+            out_.open(path_, std::ios::binary | std::ios::trunc);
+            if (!out_) {
+                throw std::runtime_error("无法创建归档段: " + path_.string());
+            }
+        }
+
+        void write(const uint8_t* data, size_t len) override {
+            if (!out_.write(reinterpret_cast<const char*>(data), len)) {
+                throw std::runtime_error("写入归档段失败: " + path_.string());
+            }
+        }
+
+        void flush() override { out_.flush(); }
+
+        void finish() override {
+            if (!out_.flush()) throw std::runtime_error("写入归档段失败: " + path_.string());
+            out_.close();
+        }
+
+    private:
+        fs::path path_;
+        std::vector<char> buffer_ = std::vector<char>(4 * 1024 * 1024);   // 大块顺序写
+        std::ofstream out_;
+    };
+
+    fs::path dir_;
+};
+
+// 把多个文件顺序写入少量大段文件。同时写入的每个文件各借用一个通道，每个通道有自己正在写的段，
+// 文件在通道的段内连续存放且不跨段，写满 SEGMENT_SIZE 后换新段。读取、编码和限速都在锁外进行：
+// 通道锁只在追加一批已编码的帧时持有，段表锁只在登记新段和借还通道时持有
+class ArchiveWriter {
+    struct Lane;
+
+public:
+    static constexpr uint64_t SEGMENT_SIZE = 1ull << 30;
+
+    // 段由 store 创建，以 "<name>/pack-NNNN.seg" 登记到 index，name 为快照完成后的目录名。
+    // 编号从 first_segment 开始，续传时不覆盖上次已写出的段
+    ArchiveWriter(std::shared_ptr<SegmentStore> store, std::string name, ArchiveIndex& index,
+                  uint32_t first_segment = 0)
+        : store_(std::move(store)), name_(std::move(name)), index_(index), next_segment_(first_segment) {}
+
+    ~ArchiveWriter() { close(); }
+
+    // 正在写入的一个文件：构造时借用一个空闲通道，write 分批追加帧，finish 返回文件的位置。
+    // 未调用 finish 就析构时(出错)归还通道，已写入的帧留在段内不被引用
+    class File {
+    public:
+        explicit File(ArchiveWriter& writer) : writer_(writer), lane_(writer.checkout()) {
+            std::lock_guard<std::mutex> lock(lane_->mutex);
+            lane_->busy = true;
+            if (!lane_->out || lane_->size >= SEGMENT_SIZE) writer_.open_segment(*lane_);
+            location_.segment = lane_->segment;
+            location_.offset = lane_->size;
+        }
+
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+
+        ~File() {
+            if (lane_) release();
+        }
+
+        void write(const std::vector<uint8_t>& frames) {
+            std::lock_guard<std::mutex> lock(lane_->mutex);
+            lane_->out->write(frames.data(), frames.size());
+            lane_->size += frames.size();
+        }
+
+        ArchiveLocation finish() {
+            {
+                std::lock_guard<std::mutex> lock(lane_->mutex);
+                location_.stored = lane_->size - location_.offset;
+            }
+            release();
+            return location_;
+        }
+
+    private:
+        void release() {
+            {
+                std::lock_guard<std::mutex> lock(lane_->mutex);
+                lane_->busy = false;
+            }
+            lane_->idle.notify_all();
+            writer_.checkin(lane_);
+            lane_ = nullptr;
+        }
+
+        ArchiveWriter& writer_;
+        Lane* lane_;
+        ArchiveLocation location_;
+    };
+
+    // 追加一个已经编码好的完整文件
+    ArchiveLocation append(const std::vector<uint8_t>& frames) {
+        File file(*this);
+        file.write(frames);
+        return file.finish();
+    }
+
+    // 把写缓冲交给内核；对象存储上的段则等通道上正在写的文件结束后完成上传，之后的文件写入新段。
+    // 返回之前写入的段是否都已完整
+    bool flush() {
+        const bool seal = store_->seal_on_checkpoint();
+        for (Lane* lane : lanes()) {
+            std::unique_lock<std::mutex> lock(lane->mutex);
+            if (!lane->out) continue;
+            if (seal) {
+                lane->idle.wait(lock, [&] { return !lane->busy; });
+                finish_segment(*lane);
+            } else {
+                lane->out->flush();
+            }
+        }
+        return !failed_;
+    }
+
+    std::string segment_name(uint32_t segment) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return index_.segments[segment];
+    }
+
+    // 完成各通道的最后一个段，返回所有段是否都已完整写出。调用时不能再有正在写入的文件
+    bool close() {
+        for (Lane* lane : lanes()) {
+            std::lock_guard<std::mutex> lock(lane->mutex);
+            if (lane->out) finish_segment(*lane);
+        }
+        return !failed_;
+    }
+
+private:
+    struct Lane {
+        std::mutex mutex;
+        std::condition_variable idle;
+        bool busy = false;      // 有文件正在写入
+        std::unique_ptr<SegmentStore::Output> out;
+        uint32_t segment = 0;
+        uint64_t size = 0;
+    };
+
+    Lane* checkout() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_.empty()) {
+            Lane* lane = free_.back();
+            free_.pop_back();
+            return lane;
+        }
+        lanes_.push_back(std::make_unique<Lane>());
+        return lanes_.back().get();
+    }
+
+    void checkin(Lane* lane) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(lane);
+    }
+
+    std::vector<Lane*> lanes() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<Lane*> lanes;
+        for (auto& lane : lanes_) lanes.push_back(lane.get());
+        return lanes;
+    }
+
+    // 段写失败后已经登记到段表的文件都不可用，failed_ 一直保持到结束。调用方持有通道锁
+    void finish_segment(Lane& lane) {
+        try {
+            lane.out->finish();
+        } catch (const std::exception& e) {
+            failed_ = true;
+            std::cerr << e.what() << std::endl;
+        }
+        lane.out.reset();
+    }
+
+    // 调用方持有通道锁；段表锁只在登记时持有
+    void open_segment(Lane& lane) {
+        if (lane.out) finish_segment(lane);
+        std::string file, registered;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::ostringstream name;
+            name << "pack-" << std::setw(4) << std::setfill('0') << next_segment_++ << ".seg";
+            file = name.str();
+            registered = (fs::path(name_) / file).generic_string();
+            lane.segment = static_cast<uint32_t>(index_.segments.size());
+            index_.segments.push_back(registered);
+        }
+        lane.out = store_->create(file, registered);
+        lane.size = 0;
+    }
+
+    std::shared_ptr<SegmentStore> store_;
+    std::string name_;
+    ArchiveIndex& index_;
+    std::mutex mutex_;      // 保护段表、next_segment_ 和通道列表
+    std::vector<std::unique_ptr<Lane>> lanes_;
+    std::vector<Lane*> free_;
+    std::atomic<bool> failed_{false};
+    uint32_t next_segment_;
+};
+
+// 对象存储用的 HTTP/1.1 客户端连接：http:// 直连，https:// 经 OpenSSL 并校验证书和主机名。
+// 保持长连接，出错后关闭，下次请求时重新连接
+class HttpConnection {
+public:
+    struct Response {
+        int status = 0;
+        std::unordered_map<std::string, std::string> headers;  // 名字为小写
+        std::string body;
+    };
+
+    HttpConnection(std::string host, std::string port, bool tls)
+        : host_(std::move(host)), port_(std::move(port)), tls_(tls) {}
+    HttpConnection(const HttpConnection&) = delete;
+    HttpConnection& operator=(const HttpConnection&) = delete;
+    ~HttpConnection() { close(); }
+
+    bool is_open() const { return bio_ != nullptr; }
+
+    // 发送请求并读取完整响应，连接失败或中途断开时抛出 std::runtime_error
+    Response request(const std::string& method, const std::string& target,
+                     const std::vector<std::pair<std::string, std::string>>& headers, const uint8_t* body,
+                     size_t len) {
+        try {
+            if (!bio_) connect();
+            std::string head = method + " " + target + " HTTP/1.1\r\n";
+            for (const auto& [name, value] : headers) head += name + ": " + value + "\r\n";
+            head += "Content-Length: " + std::to_string(len) + "\r\n\r\n";
+            send_all(head.data(), head.size());
+            if (len) send_all(body, len);
+            return read_response(method == "HEAD");
+        } catch (...) {
+            close();
+            throw;
+        }
+    }
+
+private:
+    // 所有 https 连接共用一个 TLS 上下文，使用系统的根证书
+    static SSL_CTX* tls_context() {
+        static SSL_CTX* ctx = [] {
+            SSL_CTX* c = SSL_CTX_new(TLS_client_method());
+            if (c) {
+                SSL_CTX_set_default_verify_paths(c);
+                SSL_CTX_set_verify(c, SSL_VERIFY_PEER, nullptr);
+            }
+            return c;
+        }();
+        return ctx;
+    }
+
+    void connect() {
+        std::string address = host_ + ":" + port_;
+        if (tls_) {
+            if (!tls_context()) throw std::runtime_error("无法初始化 TLS");
+            bio_ = BIO_new_ssl_connect(tls_context());
+            SSL* ssl = nullptr;
+            if (bio_) BIO_get_ssl(bio_, &ssl);
+            if (!ssl) throw std::runtime_error("无法初始化 TLS");
+            SSL_set_tlsext_host_name(ssl, host_.c_str());
+            SSL_set1_host(ssl, host_.c_str());
+            BIO_set_conn_hostname(bio_, address.c_str());
+        } else {
+            bio_ = BIO_new_connect(address.c_str());
+        }
+        if (!bio_ || BIO_do_connect(bio_) <= 0 || (tls_ && BIO_do_handshake(bio_) <= 0)) {
+            close();
+            throw std::runtime_error("无法连接到 " + address);
+        }
+    }
+
+    void close() {
+        if (bio_) BIO_free_all(bio_);
+        bio_ = nullptr;
+        in_.clear();
+        in_pos_ = 0;
+    }
+
+    void send_all(const void* data, size_t len) {
+        const char* p = static_cast<const char*>(data);
+        while (len > 0) {
+            int n = BIO_write(bio_, p, static_cast<int>(std::min<size_t>(len, 1 << 30)));
+            if (n <= 0) throw std::runtime_error("发送请求失败: " + host_);
+            p += n;
+            len -= static_cast<size_t>(n);
+        }
+    }
+
+    // 至少再读入一些数据，连接关闭时返回 false
+    bool fill() {
+        if (in_pos_ > 0) {
+            in_.erase(0, in_pos_);
+            in_pos_ = 0;
+        }
+        char buffer[64 * 1024];
+        int n = BIO_read(bio_, buffer, sizeof(buffer));
+        if (n <= 0) return false;
+        in_.append(buffer, static_cast<size_t>(n));
+        return true;
+    }
+
+    std::string read_line() {
+        while (true) {
+            size_t end = in_.find("\r\n", in_pos_);
+            if (end != std::string::npos) {
+                std::string line = in_.substr(in_pos_, end - in_pos_);
+                in_pos_ = end + 2;
+                return line;
+            }
+            if (!fill()) throw std::runtime_error("读取响应失败: " + host_);
+        }
+    }
+
+    void read_exact(std::string& out, size_t n) {
+        while (in_.size() - in_pos_ < n) {
+            if (!fill()) throw std::runtime_error("读取响应失败: " + host_);
+        }
+        out.append(in_, in_pos_, n);
+        in_pos_ += n;
+    }
+
+    Response read_response(bool head_only) {
+        Response response;
+        std::string status = read_line();
+        if (status.compare(0, 5, "HTTP/") != 0 || status.size() < 12) {
+            throw std::runtime_error("无效的 HTTP 响应: " + status);
+        }
+        response.status = std::atoi(status.c_str() + 9);
+        for (std::string line = read_line(); !line.empty(); line = read_line()) {
+            size_t colon = line.find(':');
+            if (colon == std::string::npos) continue;
+            std::string name = line.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+            size_t value = line.find_first_not_of(' ', colon + 1);
+            response.headers[name] = value == std::string::npos ? "" : line.substr(value);
+        }
+
+        auto header = [&](const char* name) {
+            auto it = response.headers.find(name);
+            return it == response.headers.end() ? std::string() : it->second;
+        };
+        bool no_body = head_only || response.status == 204 || response.status == 304 || response.status / 100 == 1;
+        if (no_body) {
+        } else if (header("transfer-encoding").find("chunked") != std::string::npos) {
+            while (true) {
+                size_t size = std::strtoul(read_line().c_str(), nullptr, 16);
+                if (size == 0) break;
+                read_exact(response.body, size);
+                read_line();
+            }
+            while (!read_line().empty()) {
+            }
+        } else if (!header("content-length").empty()) {
+            read_exact(response.body, std::strtoull(header("content-length").c_str(), nullptr, 10));
+        } else {
+            // 没有长度的响应读到连接关闭为止
+            while (fill()) {
+            }
+            response.body = in_.substr(in_pos_);
+            close();
+            return response;
+        }
+        std::string connection = header("connection");
+        std::transform(connection.begin(), connection.end(), connection.begin(),
+                       [](unsigned char c) { return std::tolower(c); });
+        if (connection == "close") close();
+        return response;
+    }
+
+    std::string host_;
+    std::string port_;
+    bool tls_;
+    BIO* bio_ = nullptr;
+    std::string in_;        // 已读入还未解析的数据从 in_pos_ 开始
+    size_t in_pos_ = 0;
+};
+
+// S3 兼容的对象存储客户端：路径风格寻址(endpoint/bucket/key)，AWS Signature V4 签名，
+// 连接池由所有线程共享。网络错误、5xx 和 429 最多重试 4 次，间隔指数增长
+class S3Client {
+public:
+    struct Config {
+        std::string endpoint;       // 如 https://s3.us-east-1.amazonaws.com 或 http://127.0.0.1:9000
+        std::string region = "us-east-1";
+        std::string access_key;
+        std::string secret_key;
+        std::string session_token;
+    };
+
+    // 从环境变量读取配置：AWS_ACCESS_KEY_ID / AWS_SECRET_ACCESS_KEY / AWS_SESSION_TOKEN，
+    // 区域取 AWS_REGION 或 AWS_DEFAULT_REGION，endpoint 为空时使用 BACKUP_S3_ENDPOINT 或 AWS 的区域地址
+    static std::optional<Config> from_environment(const std::string& endpoint, std::string& error) {
+        auto env = [](const char* name) {
+            const char* value = std::getenv(name);
+            return value ? std::string(value) : std::string();
+        };
+        Config config;
+        config.access_key = env("AWS_ACCESS_KEY_ID");
+        config.secret_key = env("AWS_SECRET_ACCESS_KEY");
+        config.session_token = env("AWS_SESSION_TOKEN");
+        for (const char* name : {"AWS_REGION", "AWS_DEFAULT_REGION"}) {
+            if (!env(name).empty()) {
+                config.region = env(name);
+                break;
+            }
+        }
+        config.endpoint = !endpoint.empty() ? endpoint : env("BACKUP_S3_ENDPOINT");
+        if (config.endpoint.empty()) config.endpoint = "https://s3." + config.region + ".amazonaws.com";
+        if (config.access_key.empty() || config.secret_key.empty()) {
+            error = "缺少对象存储凭证 (AWS_ACCESS_KEY_ID / AWS_SECRET_ACCESS_KEY)";
+            return std::nullopt;
+        }
+        return config;
+    }
+
+    S3Client(Config config, std::string bucket) : config_(std::move(config)), bucket_(std::move(bucket)) {
+        std::string url = config_.endpoint;
+        tls_ = url.rfind("https://", 0) == 0;
+        if (url.rfind("http://", 0) != 0 && !tls_) throw std::runtime_error("无效的对象存储地址: " + url);
+        std::string authority = url.substr(tls_ ? 8 : 7);
+        authority = authority.substr(0, authority.find('/'));
+        size_t colon = authority.rfind(':');
+        host_ = colon == std::string::npos ? authority : authority.substr(0, colon);
+        port_ = colon == std::string::npos ? (tls_ ? "443" : "80") : authority.substr(colon + 1);
+        host_header_ = authority;
+    }
+
+    void put_object(const std::string& key, const uint8_t* data, size_t len) {
+        send("PUT", key, {}, data, len);
+    }
+
+    std::string create_multipart(const std::string& key) {
+        std::string upload_id = xml_value(send("POST", key, {{"uploads", ""}}, nullptr, 0).body, "UploadId");
+        if (upload_id.empty()) throw std::runtime_error("对象存储没有返回 UploadId: " + key);
+        return upload_id;
+    }
+
+    // 返回分片的 ETag
+    std::string upload_part(const std::string& key, const std::string& upload_id, int part, const uint8_t* data,
+                            size_t len) {
+        HttpConnection::Response response =
+            send("PUT", key, {{"partNumber", std::to_string(part)}, {"uploadId", upload_id}}, data, len);
+        auto etag = response.headers.find("etag");
+        if (etag == response.headers.end()) throw std::runtime_error("对象存储没有返回 ETag: " + key);
+        return etag->second;
+    }
+
+    void complete_multipart(const std::string& key, const std::string& upload_id,
+                            const std::vector<std::string>& etags) {
+        std::string body = "<CompleteMultipartUpload>";
+        for (size_t i = 0; i < etags.size(); ++i) {
+            body += "<Part><PartNumber>" + std::to_string(i + 1) + "</PartNumber><ETag>" + etags[i] + "</ETag></Part>";
+        }
+        body += "</CompleteMultipartUpload>";
+        // 完成请求可能返回 200 但响应体是错误
+        HttpConnection::Response response = send("POST", key, {{"uploadId", upload_id}},
+                                                 reinterpret_cast<const uint8_t*>(body.data()), body.size());
+        if (response.body.find("<Error>") != std::string::npos) {
+            throw std::runtime_error("完成分片上传失败: " + key + ": " + xml_value(response.body, "Message"));
+        }
+    }
+
+    void abort_multipart(const std::string& key, const std::string& upload_id) noexcept {
+        try {
+            send("DELETE", key, {{"uploadId", upload_id}}, nullptr, 0);
+        } catch (const std::exception&) {
+        }
+    }
+
+    // 读取对象，length 不为 0 时只读取 [offset, offset + length)
+    std::string get_object(const std::string& key, uint64_t offset = 0, uint64_t length = 0) {
+        std::vector<std::pair<std::string, std::string>> headers;
+        if (length) headers.emplace_back("Range", "bytes=" + std::to_string(offset) + "-" + std::to_string(offset + length - 1));
+        return send("GET", key, {}, nullptr, 0, headers).body;
+    }
+
+private:
+    static std::string hex(const unsigned char* data, size_t len) {
+        static constexpr char digits[] = "0123456789abcdef";
+        std::string out(len * 2, '0');
+        for (size_t i = 0; i < len; ++i) {
+            out[i * 2] = digits[data[i] >> 4];
+            out[i * 2 + 1] = digits[data[i] & 0x0f];
+        }
+        return out;
+    }
+
+    static std::string sha256_hex(const void* data, size_t len) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len = 0;
+        EVP_Digest(data, len, digest, &digest_len, EVP_sha256(), nullptr);
+        return hex(digest, digest_len);
+    }
+
+    static std::string hmac(const std::string& key, const std::string& data) {
+        unsigned char out[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+             reinterpret_cast<const unsigned char*>(data.data()), data.size(), out, &len);
+        return std::string(reinterpret_cast<char*>(out), len);
+    }
+
+    // RFC 3986 编码，路径中保留 '/'
+    static std::string uri_encode(const std::string& text, bool keep_slash) {
+        static constexpr char digits[] = "0123456789ABCDEF";
+        std::string out;
+        for (unsigned char c : text) {
+            if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (keep_slash && c == '/')) {
+                out += static_cast<char>(c);
+            } else {
+                out += '%';
+                out += digits[c >> 4];
+                out += digits[c & 0x0f];
+            }
+        }
+        return out;
+    }
+
+    static std::string xml_value(const std::string& xml, const std::string& tag) {
+        size_t begin = xml.find("<" + tag + ">");
+        if (begin == std::string::npos) return "";
+        begin += tag.size() + 2;
+        size_t end = xml.find("</" + tag + ">", begin);
+        return end == std::string::npos ? "" : xml.substr(begin, end - begin);
+    }
+
+    using Query = std::vector<std::pair<std::string, std::string>>;
+
+    HttpConnection::Response send(const std::string& method, const std::string& key, Query query,
+                                  const uint8_t* data, size_t len,
+                                  const std::vector<std::pair<std::string, std::string>>& extra = {}) {
+        std::string path = "/" + uri_encode(bucket_, false) + "/" + uri_encode(key, true);
+        std::sort(query.begin(), query.end());
+        std::string canonical_query;
+        for (const auto& [name, value] : query) {
+            if (!canonical_query.empty()) canonical_query += '&';
+            canonical_query += uri_encode(name, false) + "=" + uri_encode(value, false);
+        }
+        std::string target = canonical_query.empty() ? path : path + "?" + canonical_query;
+        std::string payload_hash = sha256_hex(data, len);
+
+        for (int attempt = 0;; ++attempt) {
+            std::string error;
+            bool retry = true;  // 网络错误总是重试
+            try {
+                auto headers = sign(method, path, canonical_query, payload_hash);
+                headers.insert(headers.end(), extra.begin(), extra.end());
+                std::unique_ptr<HttpConnection> connection = acquire();
+                HttpConnection::Response response = connection->request(method, target, headers, data, len);
+                release(std::move(connection));
+                if (response.status / 100 == 2) return response;
+                error = "HTTP " + std::to_string(response.status);
+                std::string message = xml_value(response.body, "Message");
+                if (!message.empty()) error += ": " + message;
+                retry = response.status >= 500 || response.status == 429;
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+            if (!retry || attempt >= 3) throw std::runtime_error(method + " " + key + " 失败: " + error);
+            std::this_thread::sleep_for(std::chrono::milliseconds(200 << attempt));
+        }
+    }
+
+    std::vector<std::pair<std::string, std::string>> sign(const std::string& method, const std::string& path,
+                                                          const std::string& query, const std::string& payload_hash) {
+        std::time_t now = std::time(nullptr);
+        std::tm tm{};
+#ifdef _WIN32
+        gmtime_s(&tm, &now);
+#else
+        gmtime_r(&now, &tm);
+#endif
+        char stamp[17];
+        std::strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+        std::string amz_date = stamp;
+        std::string date = amz_date.substr(0, 8);
+
+        // 规范请求中的头按名字排序
+        std::vector<std::pair<std::string, std::string>> signed_headers{
+            {"host", host_header_}, {"x-amz-content-sha256", payload_hash}, {"x-amz-date", amz_date}};
+        if (!config_.session_token.empty()) signed_headers.emplace_back("x-amz-security-token", config_.session_token);
+        std::string canonical_headers, header_names;
+        for (const auto& [name, value] : signed_headers) {
+            canonical_headers += name + ":" + value + "\n";
+            header_names += (header_names.empty() ? "" : ";") + name;
+        }
+        std::string canonical_request = method + "\n" + path + "\n" + query + "\n" + canonical_headers + "\n" +
+                                        header_names + "\n" + payload_hash;
+        std::string scope = date + "/" + config_.region + "/s3/aws4_request";
+        std::string string_to_sign = "AWS4-HMAC-SHA256\n" + amz_date + "\n" + scope + "\n" +
+                                     sha256_hex(canonical_request.data(), canonical_request.size());
+        std::string key = hmac(hmac(hmac(hmac("AWS4" + config_.secret_key, date), config_.region), "s3"),
+                               "aws4_request");
+        std::string signature = hmac(key, string_to_sign);
+
+        std::vector<std::pair<std::string, std::string>> headers;
+        headers.emplace_back("Host", host_header_);
+        headers.emplace_back("x-amz-content-sha256", payload_hash);
+        headers.emplace_back("x-amz-date", amz_date);
+        if (!config_.session_token.empty()) headers.emplace_back("x-amz-security-token", config_.session_token);
+        headers.emplace_back("Authorization", "AWS4-HMAC-SHA256 Credential=" + config_.access_key + "/" + scope +
+                                                  ", SignedHeaders=" + header_names + ", Signature=" +
+                                                  hex(reinterpret_cast<const unsigned char*>(signature.data()),
+                                                      signature.size()));
+        return headers;
+    }
+
+    std::unique_ptr<HttpConnection> acquire() {
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex_);
+            if (!idle_.empty()) {
+                auto connection = std::move(idle_.back());
+                idle_.pop_back();
+                return connection;
+            }
+        }
+        return std::make_unique<HttpConnection>(host_, port_, tls_);
+    }
+
+    void release(std::unique_ptr<HttpConnection> connection) {
+        if (!connection->is_open()) return;
+        std::lock_guard<std::mutex> lock(pool_mutex_);
+        idle_.push_back(std::move(connection));
+    }
+
+    Config config_;
+    std::string bucket_;
+    std::string host_;
+    std::string port_;
+    std::string host_header_;
+    bool tls_ = false;
+    std::mutex pool_mutex_;
+    std::vector<std::unique_ptr<HttpConnection>> idle_;
+};
+
+// 对象存储上的归档段：每个段是 prefix/<快照名>/pack-NNNN.seg 一个对象。小段一次 PUT，
+// 超过一个分片的段改用分片上传，每个分片作为一个任务交给共享调度器并发发送，写入方(读取、哈希、
+// 压缩源文件的线程)不必等待网络；在途分片数有上限，网络跟不上时写入方等待最早的分片，
+// 它还没开始时由写入方自己上传
+class S3SegmentStore : public SegmentStore {
+public:
+    static constexpr size_t MIN_PART_SIZE = 5 << 20;   // S3 要求除最后一片外每片至少 5 MiB
+
+    S3SegmentStore(S3Client& client, std::string prefix, size_t part_size, unsigned jobs)
+        : client_(client), prefix_(std::move(prefix)), part_size_(std::max(part_size, MIN_PART_SIZE)),
+          max_pending_(std::max(1u, jobs)) {}
+
+    std::string key_of(const std::string& name) const { return prefix_.empty() ? name : prefix_ + "/" + name; }
+
+    std::unique_ptr<Output> create(const std::string&, const std::string& name) override {
+        return std::make_unique<Upload>(*this, key_of(name));
+    }
+
+    bool seal_on_checkpoint() const override { return true; }
+
+    // 清单最后上传，对象存储上有清单的快照才是完整的
+    void publish(const std::string& name, const std::string& data) override {
+        client_.put_object(key_of(name), reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    }
+
+private:
+    class Upload : public Output {
+    public:
+        Upload(S3SegmentStore& store, std::string key) : store_(store), key_(std::move(key)) {}
+
+        ~Upload() override {
+            wait();
+            if (!upload_id_.empty() && !completed_) store_.client_.abort_multipart(key_, upload_id_);
+        }
+
+        void write(const uint8_t* data, size_t len) override {
+            part_.insert(part_.end(), data, data + len);
+            while (part_.size() >= store_.part_size_) {
+                std::vector<uint8_t> rest(part_.begin() + store_.part_size_, part_.end());
+                part_.resize(store_.part_size_);
+                ship(std::move(part_));
+                part_ = std::move(rest);
+            }
+        }
+
+        void finish() override {
+            if (upload_id_.empty()) {
+                store_.client_.put_object(key_, part_.data(), part_.size());
+                return;
+            }
+            if (!part_.empty()) ship(std::move(part_));
+            wait();
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_.empty()) throw std::runtime_error(error_);
+            store_.client_.complete_multipart(key_, upload_id_, etags_);
+            completed_ = true;
+        }
+
+    private:
+        void ship(std::vector<uint8_t> part) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!error_.empty()) throw std::runtime_error(error_);
+            }
+            if (upload_id_.empty()) upload_id_ = store_.client_.create_multipart(key_);
+            while (parts_.size() - waited_ >= store_.max_pending_) parts_.wait(waited_++);
+            int number = static_cast<int>(etags_.size()) + 1;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                etags_.emplace_back();
+            }
+            auto data = std::make_shared<std::vector<uint8_t>>(std::move(part));
+            parts_.run([this, number, data] {
+                std::string etag, error;
+                try {
+                    etag = store_.client_.upload_part(key_, upload_id_, number, data->data(), data->size());
+                } catch (const std::exception& e) {
+                    error = e.what();
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                etags_[number - 1] = etag;
+                if (!error.empty() && error_.empty()) error_ = error;
+            });
+        }
+
+        void wait() {
+            while (waited_ < parts_.size()) parts_.wait(waited_++);
+        }
+
+        S3SegmentStore& store_;
+        std::string key_;
+        std::string upload_id_;
+        std::vector<uint8_t> part_;
+        std::mutex mutex_;
+        std::vector<std::string> etags_;
+        std::string error_;
+        bool completed_ = false;
+        TaskGroup parts_;
+        size_t waited_ = 0;     // parts_ 中已等待结束的分片数
+    };
+
+    S3Client& client_;
+    std::string prefix_;
+    size_t part_size_;
+    size_t max_pending_;
+};
+
+// 令牌桶：每秒补充 rate 个令牌，最多积攒 burst 个。acquire 先扣除，余额为负时睡眠到欠账还清，
+// 多个线程共享一个桶时后来者等得更久，总速率不超过 rate
+class TokenBucket {
+public:
+    void configure(double rate, double burst) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rate_ = rate;
+        burst_ = burst;
+        tokens_ = burst;
+        last_ = std::chrono::steady_clock::now();
+    }
+
+    bool limited() const { return rate_ > 0; }
+
+    void acquire(double n) {
+        if (rate_ <= 0) return;
+        std::chrono::duration<double> wait;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto now = std::chrono::steady_clock::now();
+            tokens_ = std::min(burst_, tokens_ + std::chrono::duration<double>(now - last_).count() * rate_);
+            last_ = now;
+            tokens_ -= n;
+            if (tokens_ >= 0) return;
+            wait = std::chrono::duration<double>(-tokens_ / rate_);
+        }
+        std::this_thread::sleep_for(wait);
+    }
+
+private:
+    std::mutex mutex_;
+    double rate_ = 0;
+    double burst_ = 0;
+    double tokens_ = 0;
+    std::chrono::steady_clock::time_point last_;
+};
+
+// 读写限速：读字节、写字节和 I/O 次数各一个令牌桶，由所有哈希和复制线程共享。
+// 每次 read/write 调用计为一次 I/O；没有设置限制时只是一次分支。
+// 命令行给出的限额由 process() 这一组桶执行，并行运行的作业一起受它约束；
+// 作业自己的 Throttle 只在作业文件给出更低的限额时才另外扣一份
+class Throttle {
+public:
+    struct Limits {
+        uint64_t read_bytes = 0;    // 每秒读取字节数，0 表示不限
+        uint64_t write_bytes = 0;   // 每秒写入字节数
+        uint64_t ops = 0;           // 每秒 I/O 次数
+    };
+
+    // 整个进程的总限额，main 解析完命令行后配置一次
+    static Throttle& process() {
+        static Throttle throttle;
+        return throttle;
+    }
+
+    // 最多积攒 0.1 秒的额度，短暂空闲后不会一下子冲出很大的突发
+    void configure(const Limits& limits) {
+        read_.configure(static_cast<double>(limits.read_bytes), limits.read_bytes / 10.0);
+        write_.configure(static_cast<double>(limits.write_bytes), limits.write_bytes / 10.0);
+        ops_.configure(static_cast<double>(limits.ops), std::max(1.0, limits.ops / 10.0));
+        limits_ = limits;
+        active_ = limits.read_bytes || limits.write_bytes || limits.ops;
+    }
+
+    // 单个作业的限额：先扣进程的总额度，作业的某项限额比总限额更低时再扣作业自己的桶，
+    // 作业只能把限额调低，调高的部分不起作用
+    void configure_job(const Limits& limits) {
+        const Limits& total = process().limits_;
+        auto lower = [](uint64_t job, uint64_t total) { return job && (!total || job < total) ? job : 0; };
+        configure({lower(limits.read_bytes, total.read_bytes), lower(limits.write_bytes, total.write_bytes),
+                   lower(limits.ops, total.ops)});
+        auto effective = [](uint64_t own, uint64_t total) { return own ? own : total; };
+        limits_ = {effective(limits_.read_bytes, total.read_bytes), effective(limits_.write_bytes, total.write_bytes),
+                   effective(limits_.ops, total.ops)};
+        parent_ = process().active_ ? &process() : nullptr;
+        active_ = active_ || parent_;
+    }
+
+    bool active() const { return active_; }
+
+    void read(uint64_t bytes) {
+        if (!active_) return;
+        if (parent_) parent_->read(bytes);
+        ops_.acquire(1);
+        read_.acquire(static_cast<double>(bytes));
+    }
+
+    void write(uint64_t bytes) {
+        if (!active_) return;
+        if (parent_) parent_->write(bytes);
+        ops_.acquire(1);
+        write_.acquire(static_cast<double>(bytes));
+    }
+
+    // 一次系统调用最多处理的字节数：限速时取约 1/20 秒的额度，不让单次调用透支太多
+    size_t step(size_t max) const {
+        uint64_t rate = std::max(limits_.read_bytes, limits_.write_bytes);
+        if (limits_.read_bytes && limits_.write_bytes) rate = std::min(limits_.read_bytes, limits_.write_bytes);
+        if (!rate) return max;
+        return static_cast<size_t>(std::clamp<uint64_t>(rate / 20, 64 * 1024, max));
+    }
+
+private:
+    TokenBucket read_;
+    TokenBucket write_;
+    TokenBucket ops_;
+    Limits limits_;
+    bool active_ = false;
+    Throttle* parent_ = nullptr;    // 进程的总限额，configure_job 设置
+};
+
+// 当前进程可用的 CPU 数：cgroup(v2 的 cpu.max 或 v1 的 cfs 配额)限制了 CPU 时间时按配额向上取整，
+// 容器里 hardware_concurrency 返回的是整机核数，按它开线程只会互相抢配额
+static unsigned available_cpus() {
+    unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+#ifdef __linux__
+    auto quota_cpus = [](double quota, double period) -> unsigned {
+        if (quota <= 0 || period <= 0) return 0;
+        return static_cast<unsigned>(std::max(1.0, std::ceil(quota / period)));
+    };
+    unsigned limit = 0;
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::string line;
+    while (!limit && std::getline(cgroups, line)) {
+        // 每行为 "层级:控制器列表:路径"，v2 的层级为 0 且控制器列表为空
+        size_t first = line.find(':'), last = line.rfind(':');
+        if (first == std::string::npos || first == last) continue;
+        std::string path = line.substr(last + 1);
+        std::string controllers = "," + line.substr(first + 1, last - first - 1) + ",";
+        if (line.rfind("0::", 0) == 0) {
+            std::ifstream max("/sys/fs/cgroup" + path + "/cpu.max");
+            std::string quota;
+            double period = 0;
+            if (max >> quota >> period && quota != "max") limit = quota_cpus(std::atof(quota.c_str()), period);
+        } else if (controllers.find(",cpu,") != std::string::npos) {
+            for (const std::string& base : {std::string("/sys/fs/cgroup/cpu,cpuacct"), std::string("/sys/fs/cgroup/cpu")}) {
+                std::ifstream quota_file(base + path + "/cpu.cfs_quota_us");
+                std::ifstream period_file(base + path + "/cpu.cfs_period_us");
+                double quota = 0, period = 0;
+                if (quota_file >> quota && period_file >> period) {
+                    limit = quota_cpus(quota, period);
+                    break;
+                }
+            }
+        }
+    }
+    if (limit) cpus = std::min(cpus, limit);
+#endif
+    return cpus;
+}
+
+// 一次备份或恢复的分阶段计数器和计时器。工作线程每处理完一个文件只做几次 relaxed 原子操作，
+// 进度行、结束时的阶段统计和导出的指标都读取同一组计数器
+class RunMetrics {
+public:
+    using Clock = std::chrono::steady_clock;
+    enum Stage : size_t { Scan, Hash, Compare, Link, Copy, StageCount };
+
+    static const char* stage_name(size_t stage) {
+        static const char* names[StageCount] = {"遍历", "哈希", "比对", "链接", "复制"};
+        return names[stage];
+    }
+
+    // 导出时使用的阶段名
+    static const char* stage_key(size_t stage) {
+        static const char* keys[StageCount] = {"scan", "hash", "compare", "link", "copy"};
+        return keys[stage];
+    }
+
+    struct Totals {
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+        double seconds = 0;         // 阶段第一条记录开始到最后一条记录结束
+        double busy_seconds = 0;    // 所有线程在该阶段的耗时之和
+    };
+
+    RunMetrics() { reset(); }
+
+    void reset() {
+        origin_ = Clock::now();
+        for (Slot& slot : slots_) {
+            slot.files = 0;
+            slot.bytes = 0;
+            slot.busy_ns = 0;
+            slot.first_ns = std::numeric_limits<int64_t>::max();
+            slot.last_ns = 0;
+            slot.expected_files = 0;
+            slot.expected_bytes = 0;
+            slot.inflight = 0;
+            slot.begun_ns = std::numeric_limits<int64_t>::max();
+        }
+        queued = 0;
+        active_ = Scan;
+    }
+
+    // 只计数，不计时
+    void add(Stage stage, uint64_t files, uint64_t bytes) {
+        Slot& slot = slots_[stage];
+        slot.files.fetch_add(files, std::memory_order_relaxed);
+        slot.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    // 计数并把 [start, end) 计入该阶段
+    void record(Stage stage, uint64_t files, uint64_t bytes, Clock::time_point start,
+                Clock::time_point end = Clock::now()) {
+        add(stage, files, bytes);
+        Slot& slot = slots_[stage];
+        int64_t from = offset(start), to = offset(end);
+        slot.busy_ns.fetch_add(to - from, std::memory_order_relaxed);
+        for (int64_t seen = slot.first_ns.load(std::memory_order_relaxed);
+             from < seen && !slot.first_ns.compare_exchange_weak(seen, from, std::memory_order_relaxed);) {
+        }
+        for (int64_t seen = slot.last_ns.load(std::memory_order_relaxed);
+             to > seen && !slot.last_ns.compare_exchange_weak(seen, to, std::memory_order_relaxed);) {
+        }
+    }
+
+    // 阶段开始：进度行切换到该阶段，给出总量时据此估算剩余时间
+    void begin(Stage stage, uint64_t files = 0, uint64_t bytes = 0) {
+        Slot& slot = slots_[stage];
+        slot.expected_files.fetch_add(files, std::memory_order_relaxed);
+        slot.expected_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        int64_t none = std::numeric_limits<int64_t>::max();
+        slot.begun_ns.compare_exchange_strong(none, offset(Clock::now()), std::memory_order_relaxed);
+        active_ = stage;
+    }
+
+    // 处理单个文件过程中已读写的数据量，只用于进度行，大文件不必等到完成才有进展；
+    // 文件完成时由 record 计入正式计数，这里加上的部分在析构时撤销
+    class Streaming {
+    public:
+        Streaming(RunMetrics& metrics, Stage stage) : inflight_(metrics.slots_[stage].inflight) {}
+        ~Streaming() { inflight_.fetch_sub(added_, std::memory_order_relaxed); }
+        Streaming(const Streaming&) = delete;
+        Streaming& operator=(const Streaming&) = delete;
+
+        void add(uint64_t bytes) {
+            added_ += bytes;
+            inflight_.fetch_add(bytes, std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<uint64_t>& inflight_;
+        uint64_t added_ = 0;
+    };
+
+    Totals totals(size_t stage) const {
+        const Slot& slot = slots_[stage];
+        Totals t;
+        t.files = slot.files.load(std::memory_order_relaxed);
+        t.bytes = slot.bytes.load(std::memory_order_relaxed);
+        int64_t first = slot.first_ns.load(std::memory_order_relaxed);
+        int64_t last = slot.last_ns.load(std::memory_order_relaxed);
+        if (last > first) t.seconds = (last - first) / 1e9;
+        t.busy_seconds = slot.busy_ns.load(std::memory_order_relaxed) / 1e9;
+        return t;
+    }
+
+    double elapsed() const { return std::chrono::duration<double>(Clock::now() - origin_).count(); }
+
+    // 进度行：当前阶段的完成量、速率、排队任务数和预计剩余时间
+    std::string progress_line() const {
+        size_t stage = active_;
+        const Slot& slot = slots_[stage];
+        uint64_t files = slot.files.load(std::memory_order_relaxed);
+        uint64_t bytes = slot.bytes.load(std::memory_order_relaxed) + slot.inflight.load(std::memory_order_relaxed);
+        uint64_t expected_files = slot.expected_files.load(std::memory_order_relaxed);
+        uint64_t expected_bytes = slot.expected_bytes.load(std::memory_order_relaxed);
+        // 遍历结束后哈希可能还在进行，遍历速率按遍历本身的耗时计算
+        double seconds = stage == Scan && slot.last_ns.load(std::memory_order_relaxed)
+                             ? std::max(1e-3, totals(Scan).seconds)
+                             : running_seconds(slot);
+
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(1) << "[" << stage_name(stage) << "] " << files;
+        if (expected_files) line << "/" << expected_files;
+        line << " 个文件";
+        if (expected_bytes) line << "  " << bytes / (1 << 20) << "/" << expected_bytes / (1 << 20) << " MB";
+        if (files) line << "  " << files / seconds << " 文件/s";
+        if (bytes) line << "  " << bytes / seconds / (1 << 20) << " MB/s";
+        // 遍历与哈希同时进行，遍历阶段一并显示哈希的进度和队列中等待哈希的文件数
+        if (stage == Scan) {
+            const Slot& hash = slots_[Hash];
+            uint64_t hashed = hash.bytes.load(std::memory_order_relaxed) + hash.inflight.load(std::memory_order_relaxed);
+            if (hashed) {
+                line << "  哈希 " << hash.files.load(std::memory_order_relaxed) << " 个文件 "
+                     << hashed / running_seconds(slot) / (1 << 20) << " MB/s";
+            }
+            int64_t depth = queued.load(std::memory_order_relaxed);
+            if (depth > 0) line << "  队列 " << depth;
+        }
+        double remaining = -1;
+        if (expected_bytes > bytes && bytes) remaining = (expected_bytes - bytes) / (bytes / seconds);
+        else if (expected_files > files && files) remaining = (expected_files - files) / (files / seconds);
+        if (remaining >= 0) {
+            auto total = static_cast<uint64_t>(remaining);
+            line << "  剩余 " << total / 60 << ":" << std::setw(2) << std::setfill('0') << total % 60;
+        }
+        return line.str();
+    }
+
+    // 结束时的阶段统计：每个阶段的文件数、数据量、耗时和吞吐
+    void report(std::ostream& out) const {
+        out << "\n阶段统计:" << std::endl;
+        for (size_t s = 0; s < StageCount; ++s) {
+            Totals t = totals(s);
+            if (!t.files && t.seconds == 0) continue;
+            double seconds = std::max(t.seconds, 1e-9);
+            out << "  " << stage_name(s) << ": " << t.files << " 个文件";
+            if (t.bytes) out << "，" << t.bytes / (1 << 20) << " MB";
+            out << std::fixed << std::setprecision(3) << "，" << t.seconds << " 秒 (线程合计 " << t.busy_seconds
+                << " 秒)" << std::setprecision(0) << "，" << t.files / seconds << " 文件/s";
+            if (t.bytes) out << std::setprecision(1) << "，" << t.bytes / seconds / (1 << 20) << " MB/s";
+            out << std::endl;
+            out.unsetf(std::ios::fixed);
+        }
+        out << "  总耗时 " << std::fixed << std::setprecision(3) << elapsed() << " 秒" << std::endl;
+        out.unsetf(std::ios::fixed);
+    }
+
+    // 导出指标。扩展名为 .prom 时写 Prometheus textfile(整体替换，供 node_exporter 的
+    // textfile collector 采集)，否则向文件追加一行 JSON
+    bool export_to(const fs::path& path, const std::string& command, const fs::path& source,
+                   const fs::path& target, bool ok) const {
+        static std::mutex export_mutex;     // 并行作业写同一个文件时逐个写
+        std::lock_guard<std::mutex> lock(export_mutex);
+        auto timestamp = std::chrono::duration_cast<std::chrono::seconds>(
+                             std::chrono::system_clock::now().time_since_epoch()).count();
+        if (path.extension() == ".prom") {
+            fs::path temp = path;
+            temp += ".tmp";
+            {
+                std::ofstream out(temp, std::ios::trunc);
+                if (!out) return false;
+                write_prometheus(out, command, source, target, ok, timestamp);
+                if (!out) return false;
+            }
+            std::error_code ec;
+            fs::rename(temp, path, ec);
+            return !ec;
+        }
+        std::ofstream out(path, std::ios::app);
+        if (!out) return false;
+        write_json(out, command, source, target, ok, timestamp);
+        return static_cast<bool>(out);
+    }
+
+    std::atomic<int64_t> queued{0};     // 已列举、等待哈希的文件数
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> files{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<int64_t> busy_ns{0};
+        std::atomic<int64_t> first_ns{0};
+        std::atomic<int64_t> last_ns{0};
+        std::atomic<uint64_t> expected_files{0};
+        std::atomic<uint64_t> expected_bytes{0};
+        std::atomic<uint64_t> inflight{0};
+        std::atomic<int64_t> begun_ns{0};       // 第一次 begin 的时刻
+    };
+
+    // 阶段开始(begin 或第一条记录)至今的秒数，进度行据此计算速率
+    double running_seconds(const Slot& slot) const {
+        int64_t from = std::min(slot.begun_ns.load(std::memory_order_relaxed),
+                                slot.first_ns.load(std::memory_order_relaxed));
+        int64_t now = offset(Clock::now());
+        return std::max(1e-3, (now - std::min(from, now)) / 1e9);
+    }
+
+    int64_t offset(Clock::time_point t) const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t - origin_).count();
+    }
+
+    static std::string json_string(const std::string& text) {
+        std::string out = "\"";
+        for (unsigned char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += static_cast<char>(c);
+            } else if (c < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            } else {
+                out += static_cast<char>(c);
+            }
+        }
+        return out + "\"";
+    }
+
+    // 标签值的转义规则：反斜杠、双引号和换行
+    static std::string label_value(const std::string& text) {
+        std::string out;
+        for (char c : text) {
+            if (c == '\\' || c == '"') out += '\\';
+            if (c == '\n') {
+                out += "\\n";
+                continue;
+            }
+            out += c;
+        }
+        return out;
+    }
+
+    void write_json(std::ostream& out, const std::string& command, const fs::path& source, const fs::path& target,
+                    bool ok, int64_t timestamp) const {
+        out << "{\"time\":" << timestamp << ",\"command\":" << json_string(command)
+            << ",\"source\":" << json_string(source.string()) << ",\"target\":" << json_string(target.string())
+            << ",\"success\":" << (ok ? "true" : "false") << ",\"seconds\":" << elapsed() << ",\"stages\":{";
+        for (size_t s = 0; s < StageCount; ++s) {
+            Totals t = totals(s);
+            out << (s ? "," : "") << "\"" << stage_key(s) << "\":{\"files\":" << t.files << ",\"bytes\":" << t.bytes
+                << ",\"seconds\":" << t.seconds << ",\"busy_seconds\":" << t.busy_seconds << "}";
+        }
+        out << "}}" << std::endl;
+    }
+
+    void write_prometheus(std::ostream& out, const std::string& command, const fs::path& source,
+                          const fs::path& target, bool ok, int64_t timestamp) const {
+        std::string labels = "command=\"" + label_value(command) + "\",source=\"" + label_value(source.string()) +
+                             "\",target=\"" + label_value(target.string()) + "\"";
+        auto metric = [&](const char* name, const char* type, const char* help) {
+            out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+        };
+        metric("backup_stage_files", "gauge", "Files processed by each stage in the last run.");
+        for (size_t s = 0; s < StageCount; ++s) {
+            out << "backup_stage_files{" << labels << ",stage=\"" << stage_key(s) << "\"} " << totals(s).files << "\n";
+        }
+        metric("backup_stage_bytes", "gauge", "Bytes processed by each stage in the last run.");
+        for (size_t s = 0; s < StageCount; ++s) {
+            out << "backup_stage_bytes{" << labels << ",stage=\"" << stage_key(s) << "\"} " << totals(s).bytes << "\n";
+        }
+        metric("backup_stage_seconds", "gauge", "Wall-clock duration of each stage in the last run.");
+        for (size_t s = 0; s < StageCount; ++s) {
+            out << "backup_stage_seconds{" << labels << ",stage=\"" << stage_key(s) << "\"} " << totals(s).seconds
+                << "\n";
+        }
+        metric("backup_run_seconds", "gauge", "Wall-clock duration of the last run.");
+        out << "backup_run_seconds{" << labels << "} " << elapsed() << "\n";
+        metric("backup_run_success", "gauge", "Whether the last run succeeded.");
+        out << "backup_run_success{" << labels << "} " << (ok ? 1 : 0) << "\n";
+        metric("backup_run_timestamp_seconds", "gauge", "Unix time at which the last run finished.");
+        out << "backup_run_timestamp_seconds{" << labels << "} " << timestamp << "\n";
+    }
+
+    Clock::time_point origin_;
+    std::array<Slot, StageCount> slots_;
+    std::atomic<size_t> active_{Scan};
+};
+
+// 后台线程定时把进度行写到终端(标准错误输出)，同一行原地刷新，停止时清除
+class ProgressReporter {
+public:
+    ProgressReporter(const RunMetrics& metrics, bool enabled) : metrics_(metrics) {
+        if (enabled) thread_ = std::thread([this] { loop(); });
+    }
+
+    ~ProgressReporter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_one();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    ProgressReporter(const ProgressReporter&) = delete;
+    ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+    // 标准错误输出是终端时默认显示进度
+    static bool terminal() {
+#ifndef _WIN32
+        return ::isatty(STDERR_FILENO) == 1;
+#else
+        return false;
+#endif
+    }
+
+private:
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        bool shown = false;
+        while (!wake_.wait_for(lock, std::chrono::milliseconds(500), [this] { return stop_; })) {
+            std::cerr << "\r" << metrics_.progress_line() << "\033[K" << std::flush;
+            shown = true;
+        }
+        if (shown) std::cerr << "\r\033[K" << std::flush;
+    }
+
+    const RunMetrics& metrics_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+class BackupApp {
+public:
+    // 快照内容的存储方式。数值写入清单，只能追加不能修改
+    enum class StorageMode : uint8_t {
+        Files = 0,      // 目录树，每个文件一份副本
+        Chunks = 1,     // 共享块仓库
+        Archive = 2,    // 压缩归档段
+    };
+
+    static const char* storage_mode_name(StorageMode mode) {
+        switch (mode) {
+            case StorageMode::Files: return "目录树";
+            case StorageMode::Chunks: return "块仓库";
+            case StorageMode::Archive: return "归档";
+        }
+        return "未知";
+    }
+
+    // 快照保留策略，全为 0 时不清理
+    struct Retention {
+        unsigned last = 0;      // 最新的 N 个快照
+        unsigned daily = 0;     // 最近 N 天中每天最新的一个
+        unsigned weekly = 0;    // 最近 N 周中每周最新的一个
+        unsigned monthly = 0;   // 最近 N 个月中每月最新的一个
+
+        bool empty() const { return !last && !daily && !weekly && !monthly; }
+    };
+
+    // 运行选项(由命令行参数设置)
+    struct Options {
+        bool paranoid = false;  // 忽略元数据快速路径，每个文件都重新计算摘要
+        unsigned jobs = available_cpus();   // 哈希线程数
+        unsigned io_jobs = std::max(4u, available_cpus());  // 复制线程数
+        bool single_pass = false;   // 对必然要复制的文件边复制边计算摘要，源文件只读一遍
+        HashAlgorithm hash_algorithm = HashAlgorithm::MD5;  // 新计算的摘要使用的算法
+        StorageMode storage = StorageMode::Files;
+        Codec codec = FrameCodec::preferred();  // 归档模式的压缩方式
+        int compress_level = 3;
+        ReadMode read_mode = ReadMode::Buffered;   // 计算摘要和单遍复制时读取源文件的方式
+        size_t read_buffer_size = FileReader::DEFAULT_BUFFER_SIZE;
+        bool io_uring = false;      // Linux 下用 io_uring 批量读取和单遍复制
+        unsigned uring_depth = 32;  // 每个线程同时在途的文件数
+        unsigned walk_jobs = 4;     // 为并行列举目录预留的调度器线程数
+        unsigned workers = 0;       // 共享调度器的线程数，0 表示按 jobs、walk_jobs 和 io_jobs 推算
+        bool delta = false;         // 修改过的大文件只写入与上一版本不同的块(需要 reflink)
+        size_t delta_block = 64 * 1024;     // 增量传输的块大小
+        fs::path catalog_path = default_catalog_path();     // 备份编目文件
+        bool progress = ProgressReporter::terminal();       // 运行中显示进度行
+        fs::path metrics_path;      // 非空时在每次运行结束后导出指标(.prom 为 Prometheus textfile，否则为 JSON 行)
+        Throttle::Limits limits;    // 读写带宽和 I/O 次数上限，所有工作线程共享
+        bool idle_io = false;       // I/O 优先级设为 idle，磁盘空闲时才得到服务
+        int nice = 0;               // 调高 nice 值降低 CPU 优先级
+        unsigned checkpoint_seconds = 10;   // 断点日志检查点间隔(另外每完成 JOURNAL_BATCH 个文件一次)
+        double verify_sample = 100.0;   // 校验时随机抽取的百分比
+        uint64_t verify_seed = 0;       // 抽样的随机种子，0 表示每次不同
+        Retention retention;        // prune 命令的保留策略
+        bool dry_run = false;       // prune 只列出要删除的快照
+        std::string s3_endpoint;    // 对象存储地址，为空时取 BACKUP_S3_ENDPOINT 或 AWS 的区域地址
+        size_t part_size = 16 << 20;    // 分片上传的分片大小
+        unsigned upload_jobs = 8;       // 并发上传的分片数
+        fs::path remote_cache;      // 对象存储目标的本地缓存目录(清单和断点日志)
+    };
+
+    // 共享调度器的线程数：遍历期间哈希任务和列举任务同时运行，复制期间只有复制任务
+    static unsigned scheduler_threads(const Options& options) {
+        if (options.workers) return options.workers;
+        return std::max(options.jobs + options.walk_jobs, options.io_jobs);
+    }
+
+    // 默认的备份编目位置：环境变量 BACKUP_CATALOG，否则为用户主目录下的 .backup_catalog.bin
+    static fs::path default_catalog_path() {
+        if (const char* path = std::getenv("BACKUP_CATALOG")) return path;
+        for (const char* home : {"HOME", "USERPROFILE"}) {
+            if (const char* dir = std::getenv(home)) return fs::path(dir) / ".backup_catalog.bin";
+        }
+        return "backup_catalog.bin";
+    }
+
+    Options options;
+    std::mutex log_mutex;   // 多线程输出错误信息时保证整行输出
+    RunMetrics metrics;     // 当前这次运行的分阶段统计
+    Throttle throttle;      // 按 options.limits 限速，在 measured 中配置，同时受进程的总限额约束
+
+    // 执行一次备份或恢复：运行中显示进度行，结束后输出阶段统计，设置了 metrics_path 时导出指标
+    template <typename Body>
+    bool measured(const std::string& command, const fs::path& source, const fs::path& target, Body&& body) {
+        throttle.configure_job(options.limits);
+        apply_priority();
+        metrics.reset();
+        bool ok = false;
+        {
+            ProgressReporter progress(metrics, options.progress);
+            try {
+                ok = body();
+            } catch (...) {
+                export_metrics(command, source, target, false);
+                throw;
+            }
+        }
+        metrics.report(std::cout);
+        export_metrics(command, source, target, ok);
+        return ok;
+    }
+
+    // 降低当前线程和共享调度器各工作线程的 I/O 和 CPU 优先级(Linux 下这两种优先级都按线程设置)。
+    // 调度器在整个进程内共享，降低后对同时运行的其他作业同样生效。
+    // idle 类只约束直接发往块设备的读取，页缓存回写不受影响，需要限制写入时配合 --limit-write
+    void apply_priority() {
+        if (!options.idle_io && options.nice <= 0) return;
+        std::vector<int> threads{0};
+#ifdef __linux__
+        for (pid_t tid : TaskScheduler::shared().thread_ids()) threads.push_back(tid);
+#endif
+        for (int thread : threads) {
+            (void)thread;
+#if defined(__linux__) && defined(SYS_ioprio_set)
+            if (options.idle_io) {
+                constexpr int IOPRIO_CLASS_IDLE = 3, IOPRIO_CLASS_SHIFT = 13, IOPRIO_WHO_PROCESS = 1;
+                if (::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, thread, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0) {
+                    std::cerr << "无法设置 I/O 优先级: " << std::strerror(errno) << std::endl;
+                    break;
+                }
+            }
+#endif
+#ifndef _WIN32
+            if (options.nice > 0) {
+                errno = 0;
+                int current = ::getpriority(PRIO_PROCESS, thread);
+                if (errno == 0 && current < options.nice && ::setpriority(PRIO_PROCESS, thread, options.nice) != 0) {
+                    std::cerr << "无法设置 nice 值: " << std::strerror(errno) << std::endl;
+                    break;
+                }
+            }
+#endif
+        }
+    }
+
+    void export_metrics(const std::string& command, const fs::path& source, const fs::path& target, bool ok) {
+        if (options.metrics_path.empty()) return;
+        if (!metrics.export_to(options.metrics_path, command, source, target, ok)) {
+            std::cerr << "无法写入指标文件: " << options.metrics_path << std::endl;
+        }
+    }
+
+    // 清单文件：每个备份目录下记录 相对路径/大小/修改时间/摘要，
+    // 下一次增量备份直接读取清单而不必重新扫描并哈希整个旧备份
+    static constexpr const char* MANIFEST_NAME = "manifest.bin";
+    // 已清理的快照：清单改为这个名字，目录中只剩仍被其他快照引用的归档段
+    static constexpr const char* PRUNED_NAME = "manifest.pruned";
+    static constexpr char MANIFEST_MAGIC[4] = {'B', 'K', 'M', 'F'};
+    static constexpr uint32_t MANIFEST_VERSION = 7;
+
+    struct Manifest {
+        int64_t scan_time = 0;  // 扫描开始时刻(file_clock 计数)，用于识别"同一时刻修改"的歧义文件
+        FileIndex files;
+        StorageMode storage = StorageMode::Files;
+        ChunkLists chunks;      // 仓库模式：与 files 按编号对应
+        ArchiveIndex archive;   // 归档模式：段表和每个文件的位置
+    };
+
+    using Id = FileIndex::Id;
+
+    template <typename T>
+    static void write_pod(std::ostream& out, const T& value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static bool read_pod(std::istream& in, T& value) {
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+    }
+
+    static void write_string(std::ostream& out, std::string_view str) {
+        write_pod(out, static_cast<uint32_t>(str.size()));
+        out.write(str.data(), str.size());
+    }
+
+    static bool read_string(std::istream& in, std::string& str) {
+        uint32_t len;
+        if (!read_pod(in, len)) return false;
+        str.resize(len);
+        return static_cast<bool>(in.read(str.data(), len));
+    }
+
+    static uint32_t fnv1a(const char* data, size_t len) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; ++i) {
+            h = (h ^ static_cast<uint8_t>(data[i])) * 16777619u;
+        }
+        return h;
+    }
+
+    // 编目和断点日志共用的记录格式：魔数 + 长度 + 内容 + 校验和
+    static std::string frame_record(const char (&magic)[4], const std::string& body) {
+        std::string record(magic, 4);
+        uint32_t len = static_cast<uint32_t>(body.size());
+        uint32_t checksum = fnv1a(body.data(), body.size());
+        record.append(reinterpret_cast<const char*>(&len), sizeof(len));
+        record += body;
+        record.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+        return record;
+    }
+
+    // 备份编目中的一条快照记录
+    struct CatalogEntry {
+        std::string snapshot;       // 快照目录名，如 backup_20240101_120000
+        std::string parent;         // 增量备份的基准快照名，完整备份为空
+        std::string backup_dir;     // 备份目录的绝对路径(generic 格式)
+        std::string source_dir;
+        int64_t created = 0;        // 创建时刻(Unix 秒)
+        StorageMode storage = StorageMode::Files;
+        bool incremental = false;
+        uint64_t file_count = 0;    // 快照包含的文件数
+        uint64_t copied_files = 0;  // 本次实际写入的文件数
+        uint64_t bytes = 0;         // 快照中文件的总大小
+        std::string manifest;       // 清单相对备份目录的路径
+    };
+
+    // 备份编目：所有备份目录共用的只追加二进制日志，每条记录为 魔数 + 长度 + 内容 + 校验和。
+    // 首次使用时整体读入内存并按备份目录建立索引，之后只读入文件末尾新追加的记录，
+    // 所以其他进程(作业模式、监视进程)写入的记录也能看到。写到一半的记录校验失败后跳过
+    class Catalog {
+    public:
+        static constexpr char RECORD_MAGIC[4] = {'B', 'K', 'C', 'R'};
+        static constexpr uint32_t RECORD_VERSION = 1;
+
+        explicit Catalog(fs::path path) : path_(std::move(path)) {}
+
+        const fs::path& path() const { return path_; }
+        const std::vector<CatalogEntry>& entries() const { return entries_; }
+
+        static std::string key_of(const fs::path& backup_dir) {
+            std::error_code ec;
+            fs::path absolute = fs::absolute(backup_dir, ec);
+            fs::path canonical = fs::weakly_canonical(absolute, ec);
+            return (ec ? absolute : canonical).lexically_normal().generic_string();
+        }
+
+        // 读入上次之后追加的记录
+        void refresh() {
+            std::error_code ec;
+            uint64_t size = fs::file_size(path_, ec);
+            if (ec || size <= offset_) return;
+            std::ifstream in(path_, std::ios::binary);
+            if (!in || !in.seekg(static_cast<std::streamoff>(offset_))) return;
+            std::string data(size - offset_, '\0');
+            in.read(data.data(), static_cast<std::streamsize>(data.size()));
+            data.resize(static_cast<size_t>(in.gcount()));
+
+            size_t pos = 0;
+            while (pos + 12 <= data.size()) {
+                uint32_t len;
+                std::memcpy(&len, data.data() + pos + 4, sizeof(len));
+                bool magic = std::memcmp(data.data() + pos, RECORD_MAGIC, 4) == 0;
+                if (magic && pos + 12 + len > data.size()) {
+                    // 记录不完整：可能正在被写入，下次再读；后面还有记录时说明写入中断过，跳过
+                    if (data.find(std::string_view(RECORD_MAGIC, 4), pos + 1) == std::string::npos) break;
+                    magic = false;
+                }
+                uint32_t checksum = 0;
+                if (magic) std::memcpy(&checksum, data.data() + pos + 8 + len, sizeof(checksum));
+                CatalogEntry entry;
+                if (!magic || checksum != fnv1a(data.data() + pos + 8, len) ||
+                    !parse(std::string(data, pos + 8, len), entry)) {
+                    pos++;
+                    continue;
+                }
+                by_dir_[entry.backup_dir].push_back(entries_.size());
+                entries_.push_back(std::move(entry));
+                pos += 12 + len;
+            }
+            offset_ += pos;
+        }
+
+        bool append(const CatalogEntry& entry) {
+            std::ostringstream payload;
+            write_pod(payload, RECORD_VERSION);
+            write_string(payload, entry.snapshot);
+            write_string(payload, entry.parent);
+            write_string(payload, entry.backup_dir);
+            write_string(payload, entry.source_dir);
+            write_pod(payload, entry.created);
+            write_pod(payload, static_cast<uint8_t>(entry.storage));
+            write_pod(payload, static_cast<uint8_t>(entry.incremental));
+            write_pod(payload, entry.file_count);
+            write_pod(payload, entry.copied_files);
+            write_pod(payload, entry.bytes);
+            write_string(payload, entry.manifest);
+
+            // 整条记录一次写出，多个进程同时追加时不会交错
+            std::string record = frame_record(RECORD_MAGIC, payload.str());
+
+            std::error_code ec;
+            if (path_.has_parent_path()) fs::create_directories(path_.parent_path(), ec);
+            std::ofstream out(path_, std::ios::binary | std::ios::app);
+            if (!out || !out.write(record.data(), static_cast<std::streamsize>(record.size())) || !out.flush()) {
+                return false;
+            }
+            out.close();
+            refresh();
+            return true;
+        }
+
+        // 备份目录中最新的、快照目录仍然存在的记录
+        const CatalogEntry* latest(const fs::path& backup_dir) {
+            refresh();
+            auto it = by_dir_.find(key_of(backup_dir));
+            if (it == by_dir_.end()) return nullptr;
+            for (auto id = it->second.rbegin(); id != it->second.rend(); ++id) {
+                const CatalogEntry& entry = entries_[*id];
+                std::error_code ec;
+                fs::path snapshot = fs::path(entry.backup_dir) / entry.snapshot;
+                if (fs::is_directory(snapshot, ec) && !fs::exists(snapshot / PRUNED_NAME, ec)) return &entry;
+            }
+            return nullptr;
+        }
+
+    private:
+        static bool parse(const std::string& body, CatalogEntry& entry) {
+            std::istringstream in(body);
+            uint32_t version;
+            uint8_t storage, incremental;
+            if (!read_pod(in, version) || version != RECORD_VERSION || !read_string(in, entry.snapshot) ||
+                !read_string(in, entry.parent) || !read_string(in, entry.backup_dir) ||
+                !read_string(in, entry.source_dir) || !read_pod(in, entry.created) || !read_pod(in, storage) ||
+                !read_pod(in, incremental) || !read_pod(in, entry.file_count) ||
+                !read_pod(in, entry.copied_files) || !read_pod(in, entry.bytes) ||
+                !read_string(in, entry.manifest) || storage > static_cast<uint8_t>(StorageMode::Archive)) {
+                return false;
+            }
+            entry.storage = static_cast<StorageMode>(storage);
+            entry.incremental = incremental != 0;
+            return true;
+        }
+
+        fs::path path_;
+        uint64_t offset_ = 0;   // 已读入的字节数
+        std::vector<CatalogEntry> entries_;
+        std::unordered_map<std::string, std::vector<size_t>> by_dir_;   // 备份目录 -> 记录编号(按时间顺序)
+    };
+
+    std::unique_ptr<Catalog> catalog_;
+
+    // 按 options.catalog_path 打开编目，已读入的部分保留在内存中
+    Catalog& catalog() {
+        if (!catalog_ || catalog_->path() != options.catalog_path) {
+            catalog_ = std::make_unique<Catalog>(options.catalog_path);
+        }
+        catalog_->refresh();
+        return *catalog_;
+    }
+
+    // 快照完成后写入编目
+    void record_snapshot(const fs::path& backup_dir, const fs::path& snapshot_dir, const fs::path& source_dir,
+                         const std::string& parent, const Manifest& manifest, size_t copied_files) {
+        CatalogEntry entry;
+        entry.snapshot = snapshot_dir.filename().string();
+        entry.parent = parent;
+        entry.backup_dir = Catalog::key_of(backup_dir);
+        entry.source_dir = Catalog::key_of(source_dir);
+        entry.created = static_cast<int64_t>(std::time(nullptr));
+        entry.storage = manifest.storage;
+        entry.incremental = !parent.empty();
+        entry.file_count = manifest.files.file_count();
+        entry.copied_files = copied_files;
+        for (uint64_t size : manifest.files.sizes) entry.bytes += size;
+        entry.manifest = (fs::path(entry.snapshot) / MANIFEST_NAME).generic_string();
+        if (!catalog().append(entry)) {
+            std::cerr << "无法写入备份编目: " << options.catalog_path << std::endl;
+        }
+    }
+
+    // 将备份内容写入清单(先写临时文件再重命名，避免留下半个清单)。
+    // 版本 5 起与内存中的索引结构一致：先写目录表，文件只记录目录编号和文件名
+    bool write_manifest(const fs::path& backup_path, const Manifest& manifest) {
+        const FileIndex& files = manifest.files;
+        fs::path manifest_path = backup_path / MANIFEST_NAME;
+        fs::path tmp_path = manifest_path;
+        tmp_path += ".tmp";
+
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                std::cerr << "无法写入清单文件: " << tmp_path << std::endl;
+                return false;
+            }
+
+            out.write(MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+            write_pod(out, MANIFEST_VERSION);
+            write_pod(out, manifest.scan_time);
+            write_pod(out, static_cast<uint64_t>(files.directory_count()));
+            for (Id d = 1; d < files.directory_count(); ++d) {
+                write_pod(out, files.dir_parent(d));
+                write_string(out, files.dir_name(d));
+            }
+            write_pod(out, static_cast<uint64_t>(files.file_count()));
+            for (Id f = 0; f < files.file_count(); ++f) {
+                const Digest& digest = files.digests[f];
+                write_pod(out, files.file_dir(f));
+                write_string(out, files.file_name(f));
+                write_pod(out, files.sizes[f]);
+                write_pod(out, files.mtimes[f]);
+                write_pod(out, files.inodes[f]);
+                write_pod(out, static_cast<uint8_t>(digest.type));
+                write_pod(out, digest.length);
+                out.write(reinterpret_cast<const char*>(digest.bytes.data()), digest.length);
+            }
+
+            // 版本 6 起文件表后是存储方式：仓库模式附带每个文件的块列表，
+            // 版本 7 起归档模式附带段表和每个文件的位置
+            write_pod(out, static_cast<uint8_t>(manifest.storage));
+            if (manifest.storage == StorageMode::Chunks) {
+                const ChunkLists& chunks = manifest.chunks;
+                for (Id f = 0; f < files.file_count(); ++f) {
+                    write_pod(out, static_cast<uint32_t>(chunks.count(f)));
+                    const ChunkRef* refs = chunks.chunks(f);
+                    for (size_t c = 0; c < chunks.count(f); ++c) {
+                        write_pod(out, static_cast<uint8_t>(refs[c].id.type));
+                        write_pod(out, refs[c].id.length);
+                        out.write(reinterpret_cast<const char*>(refs[c].id.bytes.data()), refs[c].id.length);
+                        write_pod(out, refs[c].length);
+                    }
+                }
+            } else if (manifest.storage == StorageMode::Archive) {
+                const ArchiveIndex& archive = manifest.archive;
+                write_pod(out, static_cast<uint32_t>(archive.segments.size()));
+                for (const auto& segment : archive.segments) {
+                    write_string(out, segment);
+                }
+                for (Id f = 0; f < files.file_count(); ++f) {
+                    write_pod(out, archive.locations[f].segment);
+                    write_pod(out, archive.locations[f].offset);
+                    write_pod(out, archive.locations[f].stored);
+                }
+            }
+
+            if (!out.flush()) {
+                std::cerr << "无法写入清单文件: " << tmp_path << std::endl;
+                return false;
+            }
+        }
+
+        std::error_code ec;
+        fs::rename(tmp_path, manifest_path, ec);
+        if (ec) {
+            std::cerr << "无法保存清单文件 " << manifest_path << ": " << ec.message() << std::endl;
+            fs::remove(tmp_path, ec);
+            return false;
+        }
+        return true;
+    }
+
+    // 读取一个文件条目的摘要部分
+    static bool read_digest(std::istream& in, uint32_t version, Digest& digest) {
+        uint8_t digest_type = static_cast<uint8_t>(HashAlgorithm::MD5);    // 版本 3 之前只有 MD5
+        if (version >= 3 && !read_pod(in, digest_type)) return false;
+        if (version >= 4) {
+            // 版本 4 起摘要为二进制
+            digest.type = static_cast<HashAlgorithm>(digest_type);
+            return read_pod(in, digest.length) && digest.length <= MAX_DIGEST_LENGTH &&
+                   in.read(reinterpret_cast<char*>(digest.bytes.data()), digest.length);
+        }
+        std::string hex;
+        if (!read_string(in, hex)) return false;
+        digest = Digest::from_hex(hex, static_cast<HashAlgorithm>(digest_type));
+        return true;
+    }
+
+    // 读取备份清单。清单不存在或已损坏时返回 false，由调用方回退到扫描目录
+    bool load_manifest(const fs::path& backup_path, Manifest& manifest, const char* name = MANIFEST_NAME) {
+        std::ifstream in(backup_path / name, std::ios::binary);
+        if (!in) return false;
+
+        char magic[sizeof(MANIFEST_MAGIC)];
+        uint32_t version;
+        if (!in.read(magic, sizeof(magic)) ||
+            !std::equal(magic, magic + sizeof(magic), MANIFEST_MAGIC) ||
+            !read_pod(in, version) || version == 0 || version > MANIFEST_VERSION) {
+            std::cerr << "清单文件格式无效: " << backup_path / name << std::endl;
+            return false;
+        }
+
+        // 版本 1 没有扫描时间和 inode，扫描时间记为 0 时所有条目都视为歧义
+        int64_t scan_time = 0;
+        if (version >= 2 && !read_pod(in, scan_time)) {
+            std::cerr << "清单文件格式无效: " << backup_path / name << std::endl;
+            return false;
+        }
+
+        Manifest loaded;
+        loaded.scan_time = scan_time;
+        uint8_t storage = static_cast<uint8_t>(StorageMode::Files);
+        bool ok = version >= 5 ? read_index_entries(in, version, loaded.files)
+                               : read_path_entries(in, version, loaded.files);
+        if (ok && version >= 6) ok = read_pod(in, storage);
+        loaded.storage = static_cast<StorageMode>(storage);
+        if (ok && loaded.storage == StorageMode::Chunks) {
+            ok = read_chunk_lists(in, loaded.files.file_count(), loaded.chunks);
+        } else if (ok && loaded.storage == StorageMode::Archive) {
+            ok = read_archive_index(in, loaded.files.file_count(), loaded.archive);
+        } else if (ok && loaded.storage != StorageMode::Files) {
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << "清单文件已损坏: " << backup_path / name << std::endl;
+            return false;
+        }
+
+        manifest = std::move(loaded);
+        return true;
+    }
+
+    static bool read_chunk_lists(std::istream& in, size_t file_count, ChunkLists& chunks) {
+        std::vector<ChunkRef> refs;
+        for (size_t f = 0; f < file_count; ++f) {
+            uint32_t count;
+            if (!read_pod(in, count)) return false;
+            refs.resize(count);
+            for (auto& ref : refs) {
+                uint8_t type;
+                if (!read_pod(in, type) || !read_pod(in, ref.id.length) || ref.id.length > MAX_DIGEST_LENGTH ||
+                    !in.read(reinterpret_cast<char*>(ref.id.bytes.data()), ref.id.length) ||
+                    !read_pod(in, ref.length)) {
+                    return false;
+                }
+                ref.id.type = static_cast<HashAlgorithm>(type);
+            }
+            chunks.add_file(refs.data(), refs.size());
+        }
+        return true;
+    }
+
+    static bool read_archive_index(std::istream& in, size_t file_count, ArchiveIndex& archive) {
+        uint32_t segment_count;
+        if (!read_pod(in, segment_count)) return false;
+        archive.segments.resize(segment_count);
+        for (auto& segment : archive.segments) {
+            if (!read_string(in, segment)) return false;
+        }
+        archive.locations.resize(file_count);
+        for (auto& location : archive.locations) {
+            if (!read_pod(in, location.segment) || !read_pod(in, location.offset) ||
+                !read_pod(in, location.stored) || location.segment >= segment_count) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // 版本 5 及以后：目录表 + 文件表
+    static bool read_index_entries(std::istream& in, uint32_t version, FileIndex& index) {
+        uint64_t dir_count, file_count;
+        if (!read_pod(in, dir_count) || dir_count == 0) return false;
+        std::string name;
+        for (uint64_t d = 1; d < dir_count; ++d) {
+            Id parent;
+            if (!read_pod(in, parent) || parent >= d || !read_string(in, name) ||
+                index.add_directory(parent, name) != d) {
+                return false;
+            }
+        }
+        if (!read_pod(in, file_count)) return false;
+        for (uint64_t f = 0; f < file_count; ++f) {
+            Id dir;
+            uint64_t size, inode;
+            int64_t mtime;
+            Digest digest;
+            if (!read_pod(in, dir) || dir >= dir_count || !read_string(in, name) || !read_pod(in, size) ||
+                !read_pod(in, mtime) || !read_pod(in, inode) || !read_digest(in, version, digest)) {
+                return false;
+            }
+            Id id = index.add_file(dir, name, size, mtime, inode);
+            index.digests[id] = digest;
+        }
+        return true;
+    }
+
+    // 版本 1-4：每个文件一条完整相对路径
+    static bool read_path_entries(std::istream& in, uint32_t version, FileIndex& index) {
+        uint64_t count;
+        if (!read_pod(in, count)) return false;
+        std::string relative_path;
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t size, inode = 0;
+            int64_t mtime;
+            Digest digest;
+            if (!read_string(in, relative_path) || !read_pod(in, size) || !read_pod(in, mtime) ||
+                (version >= 2 && !read_pod(in, inode)) || !read_digest(in, version, digest)) {
+                return false;
+            }
+            Id id = index.add_path(relative_path, size, mtime, inode);
+            index.digests[id] = digest;
+        }
+        return true;
+    }
+
+    static int64_t file_clock_now() {
+        return fs::file_time_type::clock::now().time_since_epoch().count();
+    }
+
+    static uint64_t file_inode(const fs::path& path) {
+#ifndef _WIN32
+        struct stat st;
+        if (::stat(path.c_str(), &st) == 0) {
+            return static_cast<uint64_t>(st.st_ino);
+        }
+#else
+        (void)path;
+#endif
+        return 0;
+    }
+
+    // 元数据快速路径：大小、修改时间(以及 inode)都与上次清单一致时直接沿用旧摘要。
+    // 修改时间不早于上次扫描开始时刻的文件可能在扫描期间被改写，视为歧义并重新哈希
+    static bool metadata_unchanged(const FileIndex& previous, Id prev, uint64_t size, int64_t mtime,
+                                   uint64_t inode, int64_t previous_scan_time) {
+        if (previous.digests[prev].empty() || previous.sizes[prev] != size || previous.mtimes[prev] != mtime) {
+            return false;
+        }
+        if (previous.inodes[prev] != 0 && inode != 0 && previous.inodes[prev] != inode) {
+            return false;
+        }
+        return mtime < previous_scan_time;
+    }
+
+    // 源文件与上次备份中的同名文件内容是否一致。
+    // 两边摘要算法不同时只能依靠扫描阶段的比对结果
+    static bool same_content(const FileIndex& source, Id file, const FileIndex& backup, Id prev) {
+        if (source.flags[file] & FileIndex::MatchesPrevious) return true;
+        return !source.digests[file].empty() && source.digests[file] == backup.digests[prev];
+    }
+
+    // 读取一遍文件，同时计算多种算法的摘要(切换算法后与旧清单比对时使用)
+    std::vector<Digest> calculate_digests(const fs::path& filepath,
+                                               const std::vector<HashAlgorithm>& algorithms) {
+        std::vector<std::unique_ptr<Hasher>> hashers;
+        for (auto algorithm : algorithms) {
+            hashers.push_back(Hasher::create(algorithm));
+        }
+
+        RunMetrics::Streaming streaming(metrics, RunMetrics::Hash);
+        FileReader(options.read_mode, options.read_buffer_size).read(filepath, [&](const uint8_t* data, size_t len) {
+            throttle.read(len);
+            for (auto& hasher : hashers) {
+                hasher->update(data, len);
+            }
+            streaming.add(len);
+        });
+
+        std::vector<Digest> digests;
+        for (size_t i = 0; i < hashers.size(); ++i) {
+            digests.push_back(hashers[i]->finish_digest(algorithms[i]));
+        }
+        return digests;
+    }
+
+    // 计算文件摘要
+    Digest calculate_digest(const fs::path& filepath, HashAlgorithm algorithm) {
+        return calculate_digests(filepath, {algorithm}).front();
+    }
+
+    // 单遍模式：复制文件的同时用写出的同一批数据计算摘要，
+    // 既省去一次源文件读取，也保证摘要与备份内容一致
+    Digest copy_file_hashed(const fs::path& source, const fs::path& dest) {
+        SparseWriter out(dest, false);
+        auto hasher = Hasher::create(options.hash_algorithm);
+        auto update = [&](const uint8_t* data, size_t len) { hasher->update(data, len); };
+        RunMetrics::Streaming streaming(metrics, RunMetrics::Copy);
+        FileReader(options.read_mode, options.read_buffer_size).read(
+            source,
+            [&](const uint8_t* data, size_t len) {
+                throttle.read(len);
+                update(data, len);
+                throttle.write(len);
+                out.write(data, len);
+                streaming.add(len);
+            },
+            [&](uint64_t len) {
+                FileReader::feed_zeros(update, len);
+                out.hole(len);
+            });
+        out.finish();
+        fs::permissions(dest, fs::status(source).permissions());
+
+        return hasher->finish_digest(options.hash_algorithm);
+    }
+
+    // 监视进程记录的脏目录：相对路径 -> 是否连同整个子树都要重新列举
+    using DirtySet = std::unordered_map<std::string, bool>;
+
+    struct ScanOptions {
+        const FileIndex* previous = nullptr;    // 上次备份的清单
+        int64_t previous_scan_time = 0;
+        bool reuse_unchanged = false;   // 元数据未变的文件沿用 previous 中的摘要
+        bool defer_changed = false;     // 新增或大小变化的文件必然要复制，摘要留空，复制时再计算
+        bool hash = true;               // false 时只收集元数据，摘要全部留空
+        const DirtySet* dirty = nullptr;    // 非空时只重新列举这些目录，其余目录沿用 previous
+        const FileIndex* resume = nullptr;  // 断点日志中已完成的文件，元数据未变时沿用其摘要并标记 Resumed
+        int64_t resume_scan_time = 0;
+    };
+
+    // 扫描目录并返回文件索引。
+    // 设置 reuse_unchanged 时对元数据未变的文件沿用上次清单中的摘要，只哈希有变化或有歧义的文件。
+    // 当前线程负责遍历目录并把元数据写入索引，通过有界队列把文件交给 options.jobs 个
+    // 工作线程计算摘要；索引顺序就是遍历顺序，与线程数无关
+    FileIndex scan_directory(const fs::path& dir_path) {
+        return scan_directory(dir_path, ScanOptions());
+    }
+
+    // 是否使用 io_uring。请求了但内核不支持时提示一次，之后使用普通读取
+    bool use_io_uring() {
+#ifdef BACKUP_HAVE_IO_URING
+        if (options.io_uring && IoUring::supported()) return true;
+#endif
+        if (options.io_uring) {
+            std::cout << "当前系统不支持 io_uring，使用普通读取" << std::endl;
+            options.io_uring = false;
+        }
+        return false;
+    }
+
+#ifdef BACKUP_HAVE_IO_URING
+    // 扫描线程的 io_uring 版本：从队列取任务，需要读取内容的文件交给 UringPipeline，
+    // 同时有 options.uring_depth 个文件的 openat/read/close 在途
+    template <typename Queue, typename Result, typename Plan, typename Finish>
+    void scan_worker_uring(Queue& queue, Result& result, Plan& plan, Finish& finish) {
+        using Outcome = typename decltype(result.done)::value_type;
+        UringPipeline pipeline(options.uring_depth, options.read_buffer_size);
+        pipeline.run([&](bool wait) -> std::optional<UringPipeline::Job> {
+            while (auto task = wait ? queue.pop() : queue.try_pop()) {
+                metrics.queued--;
+                Outcome outcome{task->id, Digest(), 0};
+                auto algorithms = plan(*task, outcome, result);
+                if (algorithms.empty()) {
+                    result.done.push_back(outcome);
+                    continue;
+                }
+
+                auto hashers = std::make_shared<std::vector<std::unique_ptr<Hasher>>>();
+                for (auto algorithm : algorithms) {
+                    hashers->push_back(Hasher::create(algorithm));
+                }
+                UringPipeline::Job job;
+                job.source = task->path.string();
+                job.consume = [this, hashers](const uint8_t* data, size_t len) {
+                    throttle.read(len);
+                    for (auto& hasher : *hashers) hasher->update(data, len);
+                };
+                job.done = [&, hashers, algorithms, outcome, task = std::move(*task),
+                            start = RunMetrics::Clock::now()](int error) mutable {
+                    if (error) {
+                        result.failed.push_back(task.id);
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cerr << "无法处理文件 " << task.path << ": " << std::strerror(error) << std::endl;
+                        return;
+                    }
+                    std::vector<Digest> digests;
+                    for (size_t i = 0; i < algorithms.size(); ++i) {
+                        digests.push_back((*hashers)[i]->finish_digest(algorithms[i]));
+                    }
+                    finish(task, outcome, digests);
+                    result.done.push_back(outcome);
+                    metrics.record(RunMetrics::Hash, 1, task.size, start);
+                };
+                return job;
+            }
+            return std::nullopt;
+        });
+    }
+#endif
+
+    // 按深度优先先序遍历目录树，与 recursive_directory_iterator 的顺序一致：
+    // 目录调用 add_dir(depth, name) 后立即进入，普通文件调用 add_file(depth, name, path, size, mtime, inode)
+    template <typename AddDir, typename AddFile>
+    void walk_tree_portable(const fs::path& root, AddDir& add_dir, AddFile& add_file) {
+        for (auto it = fs::recursive_directory_iterator(root); it != fs::recursive_directory_iterator(); ++it) {
+            const auto& entry = *it;
+            size_t depth = static_cast<size_t>(it.depth());
+            std::string name = entry.path().filename().string();
+            if (entry.is_directory() && !entry.is_symlink()) {
+                add_dir(depth, name);
+            } else if (entry.is_regular_file()) {
+                try {
+                    add_file(depth, name, entry.path(), entry.file_size(),
+                             fs::last_write_time(entry.path()).time_since_epoch().count(), file_inode(entry.path()));
+                } catch (const std::exception& e) {
+                    std::lock_guard<std::mutex> lock(log_mutex);
+                    std::cerr << "无法处理文件 " << entry.path() << ": " << e.what() << std::endl;
+                }
+            }
+        }
+    }
+
+#ifdef BACKUP_HAVE_STATX
+    // 与 walk_tree_portable 的访问顺序相同，但目录作为调度器任务用 DirectoryLister 提前列举：
+    // 拿到一个目录的列表后立即提交它所有子目录的列举，兄弟子树由空闲的工作线程并行读取，
+    // 调用线程只按顺序消费结果，轮到的目录还没被取走时自己列举。
+    // 无法读取的子目录报错后跳过。不支持 statx 时返回 false，由调用方改用 walk_tree_portable
+    template <typename AddDir, typename AddFile>
+    bool walk_tree_fast(const fs::path& root, AddDir& add_dir, AddFile& add_file) {
+        std::optional<int64_t> offset = DirectoryLister::mtime_offset(root);
+        if (!offset) return false;
+        const int64_t mtime_offset = *offset;
+
+        using Listing = DirectoryLister::Listing;
+        struct Pending {
+            size_t task;
+            std::shared_ptr<Listing> listing;
+        };
+        TaskGroup listers;
+        auto submit = [&](fs::path dir) {
+            auto listing = std::make_shared<Listing>();
+            size_t task = listers.run([listing, dir = std::move(dir), mtime_offset] {
+                *listing = DirectoryLister::list(dir, mtime_offset);
+            });
+            return Pending{task, std::move(listing)};
+        };
+        auto take = [&](Pending& pending) {
+            listers.wait(pending.task);
+            return std::move(*pending.listing);
+        };
+
+        std::function<void(const fs::path&, Listing, size_t)> visit = [&](const fs::path& dir, Listing listing,
+                                                                           size_t depth) {
+            std::vector<Pending> subdirs;
+            for (const auto& entry : listing.entries) {
+                if (entry.directory) subdirs.push_back(submit(dir / entry.name));
+            }
+            size_t next_subdir = 0;
+            for (auto& entry : listing.entries) {
+                fs::path path = dir / entry.name;
+                if (!entry.directory) {
+                    add_file(depth, entry.name, std::move(path), entry.size, entry.mtime, entry.inode);
+                    continue;
+                }
+                add_dir(depth, entry.name);
+                Listing sub = take(subdirs[next_subdir++]);
+                if (sub.error) {
+                    std::lock_guard<std::mutex> lock(log_mutex);
+                    std::cerr << "无法读取目录 " << path << ": " << std::strerror(sub.error) << std::endl;
+                    continue;
+                }
+                visit(path, std::move(sub), depth + 1);
+            }
+        };
+
+        Pending root_listing = submit(root);
+        Listing top = take(root_listing);
+        if (top.error) {
+            throw fs::filesystem_error("无法读取目录", root, std::error_code(top.error, std::generic_category()));
+        }
+        visit(root, std::move(top), 0);
+        return true;
+    }
+#endif
+
+#ifdef BACKUP_HAVE_STATX
+    // 按监视记录遍历：脏目录从磁盘重新列举(递归脏目录的整个子树都重新列举)，
+    // 其余目录的文件和子目录直接取自上次的清单，不产生任何系统调用
+    template <typename AddDir, typename AddFile>
+    void walk_tree_dirty(const fs::path& root, const FileIndex& previous, const DirtySet& dirty,
+                         AddDir& add_dir, AddFile& add_file) {
+        std::optional<int64_t> offset = DirectoryLister::mtime_offset(root);
+        if (!offset) {
+            throw fs::filesystem_error("无法读取目录", root, std::error_code(errno, std::generic_category()));
+        }
+
+        std::vector<std::vector<Id>> subdirs(previous.directory_count());
+        std::vector<std::vector<Id>> files(previous.directory_count());
+        for (Id d = 1; d < previous.directory_count(); ++d) {
+            subdirs[previous.dir_parent(d)].push_back(d);
+        }
+        for (Id f = 0; f < previous.file_count(); ++f) {
+            files[previous.file_dir(f)].push_back(f);
+        }
+
+        std::function<void(Id, const std::string&, size_t, bool)> visit = [&](Id prev, const std::string& relative,
+                                                                               size_t depth, bool forced) {
+            const std::string prefix = relative.empty() ? relative : relative + "/";
+            auto it = dirty.find(relative);
+            if (!forced && prev != FileIndex::npos && it == dirty.end()) {
+                for (Id f : files[prev]) {
+                    std::string name(previous.file_name(f));
+                    add_file(depth, name, root / (prefix + name), previous.sizes[f], previous.mtimes[f],
+                             previous.inodes[f]);
+                }
+                for (Id d : subdirs[prev]) {
+                    std::string name(previous.dir_name(d));
+                    add_dir(depth, name);
+                    visit(d, prefix + name, depth + 1, false);
+                }
+                return;
+            }
+
+            bool recursive = forced || prev == FileIndex::npos || (it != dirty.end() && it->second);
+            DirectoryLister::Listing listing = DirectoryLister::list(root / relative, *offset);
+            if (listing.error) {
+                if (relative.empty()) {
+                    throw fs::filesystem_error("无法读取目录", root, std::error_code(listing.error, std::generic_category()));
+                }
+                // 记录之后被删除的目录
+                if (listing.error != ENOENT) {
+                    std::lock_guard<std::mutex> lock(log_mutex);
+                    std::cerr << "无法读取目录 " << root / relative << ": " << std::strerror(listing.error) << std::endl;
+                }
+                return;
+            }
+            for (const auto& entry : listing.entries) {
+                if (!entry.directory) {
+                    add_file(depth, entry.name, root / (prefix + entry.name), entry.size, entry.mtime, entry.inode);
+                    continue;
+                }
+                add_dir(depth, entry.name);
+                Id child = prev == FileIndex::npos ? FileIndex::npos : previous.find_directory(prev, entry.name);
+                visit(child, prefix + entry.name, depth + 1, recursive);
+            }
+        };
+        visit(FileIndex::root, "", 0, false);
+    }
+#endif
+
+    FileIndex scan_directory(const fs::path& dir_path, const ScanOptions& scan) {
+        const FileIndex* previous = scan.previous;
+        struct ScanTask {
+            Id id;
+            Id prev;            // 上次清单中的同名文件，没有则为 npos
+            Id resumed;         // scan.resume 中的同名文件，没有则为 npos
+            fs::path path;
+            uint64_t size;
+            int64_t mtime;
+            uint64_t inode;
+        };
+        struct ScanOutcome {
+            Id id;
+            Digest digest;
+            uint8_t flags;
+        };
+        struct WorkerResult {
+            std::vector<ScanOutcome> done;
+            std::vector<Id> failed;
+            size_t reused = 0;
+            size_t deferred = 0;
+        };
+
+        unsigned jobs = std::max(1u, options.jobs);
+        BoundedQueue<ScanTask> queue(jobs * 64);
+        std::vector<WorkerResult> results(jobs);
+        TaskGroup workers;
+
+        // 决定一个文件是否需要读取内容：不需要时直接填好 outcome，需要时返回要计算的算法
+        auto plan = [&](const ScanTask& task, ScanOutcome& outcome, WorkerResult& result) {
+            const Id prev = task.prev;
+            std::vector<HashAlgorithm> algorithms;
+            if (task.resumed != FileIndex::npos &&
+                metadata_unchanged(*scan.resume, task.resumed, task.size, task.mtime, task.inode,
+                                   scan.resume_scan_time)) {
+                outcome.digest = scan.resume->digests[task.resumed];
+                outcome.flags |= FileIndex::Resumed;
+                if (prev != FileIndex::npos && previous->digests[prev] == outcome.digest) {
+                    outcome.flags |= FileIndex::MatchesPrevious;
+                }
+                result.reused++;
+            } else if (!scan.hash) {
+                result.deferred++;
+            } else if (scan.reuse_unchanged && prev != FileIndex::npos &&
+                       metadata_unchanged(*previous, prev, task.size, task.mtime, task.inode,
+                                          scan.previous_scan_time)) {
+                // 沿用旧摘要时连同其算法一起沿用
+                outcome.digest = previous->digests[prev];
+                outcome.flags |= FileIndex::MatchesPrevious;
+                result.reused++;
+            } else if (scan.defer_changed && previous &&
+                       (prev == FileIndex::npos || previous->sizes[prev] != task.size)) {
+                result.deferred++;
+            } else if (prev != FileIndex::npos && !previous->digests[prev].empty() &&
+                       previous->digests[prev].type != options.hash_algorithm) {
+                // 上次清单用的是另一种算法：一次读取同时算出两种摘要，用旧算法的结果比对
+                algorithms = {options.hash_algorithm, previous->digests[prev].type};
+            } else {
+                algorithms = {options.hash_algorithm};
+            }
+            return algorithms;
+        };
+        auto finish = [&](const ScanTask& task, ScanOutcome& outcome, const std::vector<Digest>& digests) {
+            outcome.digest = digests[0];
+            if (digests.size() > 1 && digests[1] == previous->digests[task.prev]) {
+                outcome.flags |= FileIndex::MatchesPrevious;
+            }
+        };
+
+        const bool uring = use_io_uring();
+        (void)uring;
+        for (unsigned w = 0; w < jobs; ++w) {
+            workers.run([&, w] {
+                WorkerResult& result = results[w];
+#ifdef BACKUP_HAVE_IO_URING
+                if (uring) {
+                    scan_worker_uring(queue, result, plan, finish);
+                    return;
+                }
+#endif
+                while (auto task = queue.pop()) {
+                    metrics.queued--;
+                    ScanOutcome outcome{task->id, Digest(), 0};
+                    try {
+                        auto algorithms = plan(*task, outcome, result);
+                        if (!algorithms.empty()) {
+                            auto start = RunMetrics::Clock::now();
+                            finish(*task, outcome, calculate_digests(task->path, algorithms));
+                            metrics.record(RunMetrics::Hash, 1, task->size, start);
+                        }
+                        result.done.push_back(outcome);
+                    } catch (const std::exception& e) {
+                        result.failed.push_back(task->id);
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cerr << "无法处理文件 " << task->path << ": " << e.what() << std::endl;
+                    }
+                }
+            });
+        }
+
+        FileIndex index;
+        // dir_stack[d] 是深度为 d 的条目所在目录在新索引中的编号，prev_stack 为其在旧清单中的编号
+        std::vector<Id> dir_stack{FileIndex::root};
+        std::vector<Id> prev_stack{previous ? FileIndex::root : FileIndex::npos};
+        std::vector<Id> resume_stack{scan.resume ? FileIndex::root : FileIndex::npos};
+        auto add_dir = [&](size_t depth, const std::string& name) {
+            dir_stack.resize(depth + 2);
+            prev_stack.resize(depth + 2);
+            resume_stack.resize(depth + 2);
+            dir_stack[depth + 1] = index.add_directory(dir_stack[depth], name);
+            prev_stack[depth + 1] = previous ? previous->find_directory(prev_stack[depth], name) : FileIndex::npos;
+            resume_stack[depth + 1] =
+                scan.resume ? scan.resume->find_directory(resume_stack[depth], name) : FileIndex::npos;
+        };
+        // 元数据在遍历时取得，之后才哈希，哈希期间的改写会体现在下次看到的修改时间上
+        auto add_file = [&](size_t depth, const std::string& name, fs::path path, uint64_t size, int64_t mtime,
+                            uint64_t inode) {
+            ScanTask task;
+            task.path = std::move(path);
+            task.size = size;
+            task.mtime = mtime;
+            task.inode = inode;
+            task.prev = previous ? previous->find_file(prev_stack[depth], name) : FileIndex::npos;
+            task.resumed = scan.resume ? scan.resume->find_file(resume_stack[depth], name) : FileIndex::npos;
+            task.id = index.add_file(dir_stack[depth], name, size, mtime, inode);
+            metrics.add(RunMetrics::Scan, 1, 0);
+            metrics.queued++;
+            queue.push(std::move(task));
+        };
+        metrics.begin(RunMetrics::Scan);
+        auto walk_start = RunMetrics::Clock::now();
+        try {
+            bool walked = false;
+#ifdef BACKUP_HAVE_STATX
+            if (scan.dirty && previous) {
+                walk_tree_dirty(dir_path, *previous, *scan.dirty, add_dir, add_file);
+                walked = true;
+            } else {
+                walked = walk_tree_fast(dir_path, add_dir, add_file);
+            }
+#endif
+            if (!walked) walk_tree_portable(dir_path, add_dir, add_file);
+            metrics.record(RunMetrics::Scan, 0, 0, walk_start);
+        } catch (...) {
+            // 遍历失败时也要让哈希任务退出，再把异常交给调用方
+            queue.close();
+            workers.wait();
+            throw;
+        }
+        queue.close();
+        workers.wait();
+
+        // 把各线程的结果写回索引，去掉无法读取的文件
+        size_t reused = 0;
+        size_t deferred = 0;
+        std::vector<char> failed(index.file_count(), 0);
+        bool any_failed = false;
+        for (auto& result : results) {
+            reused += result.reused;
+            deferred += result.deferred;
+            for (const auto& outcome : result.done) {
+                index.digests[outcome.id] = outcome.digest;
+                index.flags[outcome.id] = outcome.flags;
+            }
+            for (Id id : result.failed) {
+                failed[id] = 1;
+                any_failed = true;
+            }
+        }
+        if (any_failed) index.erase_files(failed);
+
+        if (scan.reuse_unchanged) {
+            std::cout << "元数据未变化，沿用摘要: " << reused << " 个文件，重新计算: "
+                      << index.file_count() - reused - deferred << " 个文件" << std::endl;
+        }
+        if (scan.hash && deferred) {
+            std::cout << "新增或大小变化的文件将在复制时计算摘要: " << deferred << " 个" << std::endl;
+        }
+        
+        return index;
+    }
+
+    // 文件复制方式，零拷贝方式按优先级排列，SinglePass 为边复制边计算摘要
+    enum class CopyMethod { Reflink, CopyFileRange, Sendfile, Portable, SinglePass, Delta, Sparse, Count };
+
+    static const char* copy_method_name(CopyMethod method) {
+        switch (method) {
+            case CopyMethod::Reflink: return "reflink";
+            case CopyMethod::CopyFileRange: return "copy_file_range";
+            case CopyMethod::Sendfile: return "sendfile";
+            case CopyMethod::SinglePass: return "单遍复制";
+            case CopyMethod::Delta: return "增量传输";
+            case CopyMethod::Sparse: return "保留空洞";
+            default: return "标准复制";
+        }
+    }
+
+    // 一次运行内各复制方式是否仍然可用；某种方式在该文件系统组合上不受支持后不再尝试
+    struct CopySupport {
+        std::atomic<bool> reflink{true};
+        std::atomic<bool> copy_file_range{true};
+        std::atomic<bool> sendfile{true};
+    };
+
+    struct CopyResult {
+        size_t copied = 0;
+        std::vector<char> succeeded;    // 与输入一一对应
+        std::array<size_t, static_cast<size_t>(CopyMethod::Count)> methods{};
+        std::vector<Digest> digests;    // 复制时计算出的摘要(仅对输入摘要为空的文件)
+        uint64_t delta_written = 0;     // 增量传输实际写入的字节数
+        uint64_t delta_reused = 0;      // 增量传输沿用旧版本的字节数
+    };
+
+    // 增量传输的基准：上一快照的索引和目录，previous_of 给出每个文件在其中的编号
+    struct DeltaBase {
+        const FileIndex* files = nullptr;
+        const std::vector<Id>* previous_of = nullptr;
+        fs::path root;
+    };
+
+    // 小于此大小的文件直接完整复制，签名和比较的开销不值得
+    static constexpr uint64_t DELTA_MIN_SIZE = 1024 * 1024;
+
+    struct DeltaStats {
+        uint64_t written = 0;
+        uint64_t reused = 0;
+    };
+
+#ifdef __linux__
+    // 表示"该方式在此处不可用，应尝试下一种"的错误码
+    static bool is_unsupported_errno(int err) {
+        return err == EXDEV || err == EOPNOTSUPP || err == ENOTSUP || err == ENOSYS ||
+               err == EINVAL || err == ENOTTY || err == EBADF || err == EPERM;
+    }
+#endif
+
+#ifdef __linux__
+    // 只复制稀疏文件的数据区(优先 copy_file_range，否则 pread/pwrite)，空洞跳过，
+    // 最后把目标文件截到原大小。文件系统不支持 SEEK_DATA 时返回 false
+    bool copy_sparse(int in, int out, off_t size, CopySupport& support, const fs::path& dest) {
+        std::vector<uint8_t> buffer;
+        for (off_t offset = 0; offset < size;) {
+            off_t data = ::lseek(in, offset, SEEK_DATA);
+            if (data < 0 && errno == ENXIO) break;
+            if (data < 0) {
+                if (offset == 0 && (errno == EINVAL || errno == ENOTSUP)) return false;
+                throw std::system_error(errno, std::generic_category(), "lseek " + dest.string());
+            }
+            off_t hole = ::lseek(in, data, SEEK_HOLE);
+            if (hole < 0) throw std::system_error(errno, std::generic_category(), "lseek " + dest.string());
+            hole = std::min(hole, size);
+            offset = data;
+            while (offset < hole && support.copy_file_range) {
+                off_t src = offset, dst = offset;
+                ssize_t n = ::copy_file_range(in, &src, out, &dst,
+                                              std::min(static_cast<size_t>(hole - offset), throttle.step(COPY_STEP)), 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n > 0) {
+                    offset += n;
+                    throttle.read(static_cast<uint64_t>(n));
+                    throttle.write(static_cast<uint64_t>(n));
+                } else if (n < 0 && is_unsupported_errno(errno)) {
+                    support.copy_file_range = false;
+                } else {
+                    throw std::system_error(n < 0 ? errno : EIO, std::generic_category(),
+                                            "copy_file_range " + dest.string());
+                }
+            }
+            if (offset < hole) {
+                buffer.resize(FileReader::DEFAULT_BUFFER_SIZE);
+                while (offset < hole) {
+                    size_t want = static_cast<size_t>(std::min<off_t>(static_cast<off_t>(buffer.size()), hole - offset));
+                    ssize_t n = ::pread(in, buffer.data(), want, offset);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) throw std::system_error(n < 0 ? errno : EIO, std::generic_category(), "read " + dest.string());
+                    throttle.read(static_cast<uint64_t>(n));
+                    throttle.write(static_cast<uint64_t>(n));
+                    pwrite_full(out, buffer.data(), static_cast<size_t>(n), static_cast<uint64_t>(offset), dest);
+                    offset += n;
+                }
+            }
+        }
+        if (::ftruncate(out, size) != 0) {
+            throw std::system_error(errno, std::generic_category(), "ftruncate " + dest.string());
+        }
+        return true;
+    }
+#endif
+
+    // 一次 copy_file_range / sendfile 调用最多复制的字节数
+    static constexpr size_t COPY_STEP = 64 << 20;
+
+    // 剩余部分至少这么大时拆成区间任务并行复制
+    static constexpr uint64_t RANGE_COPY_MIN = 4 * static_cast<uint64_t>(COPY_STEP);
+
+#ifdef __linux__
+    // 大文件 [begin, end) 部分按 COPY_STEP 拆成区间任务，用带偏移的 copy_file_range 写入目标的同一位置。
+    // 区间任务压入当前工作线程的队列，空闲的线程窃取过去并行复制，一个超大文件不会只占住一个线程
+    void copy_ranges(int in, int out, off_t begin, off_t end, const fs::path& dest) {
+        TaskGroup ranges;
+        for (off_t offset = begin; offset < end; offset += static_cast<off_t>(COPY_STEP)) {
+            off_t range_end = std::min(end, offset + static_cast<off_t>(COPY_STEP));
+            ranges.run([this, in, out, offset, range_end, &dest] {
+                RunMetrics::Streaming streaming(metrics, RunMetrics::Copy);
+                const size_t step = throttle.step(COPY_STEP);
+                for (off_t src = offset, dst = offset; src < range_end;) {
+                    ssize_t n = ::copy_file_range(in, &src, out, &dst,
+                                                  std::min(static_cast<size_t>(range_end - src), step), 0);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) {
+                        throw std::system_error(n < 0 ? errno : EIO, std::generic_category(),
+                                                "copy_file_range " + dest.string());
+                    }
+                    streaming.add(static_cast<uint64_t>(n));
+                    throttle.read(static_cast<uint64_t>(n));
+                    throttle.write(static_cast<uint64_t>(n));
+                }
+            });
+        }
+        ranges.wait();
+    }
+#endif
+
+    // 零拷贝复制：依次尝试 FICLONE reflink、copy_file_range、sendfile，稀疏文件 reflink 失败后
+    // 只复制数据区，都不可用时退回 fs::copy_file。失败时抛出异常，成功时返回实际使用的方式
+    CopyMethod copy_file_native(const fs::path& source, const fs::path& dest, CopySupport& support) {
+#ifdef __linux__
+        UniqueFd in(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!in) throw std::system_error(errno, std::generic_category(), "open " + source.string());
+        struct stat st;
+        if (::fstat(in.get(), &st) != 0) {
+            throw std::system_error(errno, std::generic_category(), "fstat " + source.string());
+        }
+        UniqueFd out(::open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777));
+        if (!out) throw std::system_error(errno, std::generic_category(), "open " + dest.string());
+
+        if (support.reflink && ::ioctl(out.get(), FICLONE, in.get()) == 0) {
+            return CopyMethod::Reflink;
+        } else if (support.reflink && is_unsupported_errno(errno)) {
+            support.reflink = false;
+        }
+
+        if (FileReader::is_sparse(st) && copy_sparse(in.get(), out.get(), st.st_size, support, dest)) {
+            return CopyMethod::Sparse;
+        }
+
+        // 每次系统调用最多复制 COPY_STEP 字节，大文件复制期间进度行也能更新
+        const off_t total = st.st_size;
+        const size_t copy_step = throttle.step(COPY_STEP);
+        RunMetrics::Streaming streaming(metrics, RunMetrics::Copy);
+        if (support.copy_file_range) {
+            off_t done = 0;
+            while (done < total) {
+                ssize_t n = ::copy_file_range(in.get(), nullptr, out.get(), nullptr,
+                                              std::min(static_cast<size_t>(total - done), copy_step), 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                done += n;
+                streaming.add(static_cast<uint64_t>(n));
+                throttle.read(static_cast<uint64_t>(n));
+                throttle.write(static_cast<uint64_t>(n));
+                // 第一次调用成功说明这对文件支持 copy_file_range，剩余部分足够大时并行复制
+                if (static_cast<uint64_t>(total - done) >= RANGE_COPY_MIN) {
+                    copy_ranges(in.get(), out.get(), done, total, dest);
+                    done = total;
+                }
+            }
+            if (done >= total) return CopyMethod::CopyFileRange;
+            if (done > 0 || !is_unsupported_errno(errno)) {
+                throw std::system_error(errno, std::generic_category(), "copy_file_range " + dest.string());
+            }
+            support.copy_file_range = false;
+        }
+
+        if (support.sendfile) {
+            off_t offset = 0;
+            while (offset < total) {
+                ssize_t n = ::sendfile(out.get(), in.get(), &offset,
+                                       std::min(static_cast<size_t>(total - offset), copy_step));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                streaming.add(static_cast<uint64_t>(n));
+                throttle.read(static_cast<uint64_t>(n));
+                throttle.write(static_cast<uint64_t>(n));
+            }
+            if (offset >= total) return CopyMethod::Sendfile;
+            if (offset > 0 || !is_unsupported_errno(errno)) {
+                throw std::system_error(errno, std::generic_category(), "sendfile " + dest.string());
+            }
+            support.sendfile = false;
+        }
+
+        out.reset();
+#else
+        (void)support;
+#endif
+        fs::copy_file(source, dest, fs::copy_options::overwrite_existing);
+        return CopyMethod::Portable;
+    }
+
+#ifdef __linux__
+    static void pread_full(int fd, uint8_t* data, size_t len, uint64_t offset, const fs::path& path) {
+        while (len > 0) {
+            ssize_t n = ::pread(fd, data, len, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw std::system_error(n < 0 ? errno : EIO, std::generic_category(), "read " + path.string());
+            data += n;
+            len -= static_cast<size_t>(n);
+            offset += static_cast<uint64_t>(n);
+        }
+    }
+
+    static void pwrite_full(int fd, const uint8_t* data, size_t len, uint64_t offset, const fs::path& path) {
+        while (len > 0) {
+            ssize_t n = ::pwrite(fd, data, len, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw std::system_error(n < 0 ? errno : EIO, std::generic_category(), "write " + path.string());
+            data += n;
+            len -= static_cast<size_t>(n);
+            offset += static_cast<uint64_t>(n);
+        }
+    }
+#endif
+
+    // 增量传输(rsync 算法)：dest 先 reflink 为旧版本 base 的副本，再按 base 的块签名
+    // (弱校验和 + 强摘要)在新文件上逐字节滚动查找相同的块。原位未变的块不写，
+    // 移动过的块和找不到匹配的区域按 4K 页与 base 同一位置比较后只写入不同的页。
+    // 返回新文件的摘要；文件系统不支持 reflink 时返回 nullopt，由调用方改为完整复制
+    std::optional<Digest> delta_copy_file(const fs::path& source, const fs::path& base, const fs::path& dest,
+                                          CopySupport& support, DeltaStats& stats) {
+#ifdef __linux__
+        UniqueFd old_fd(::open(base.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!old_fd) return std::nullopt;
+        UniqueFd in(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!in) throw std::system_error(errno, std::generic_category(), "open " + source.string());
+        struct stat st, old_st;
+        if (::fstat(in.get(), &st) != 0 || ::fstat(old_fd.get(), &old_st) != 0) {
+            throw std::system_error(errno, std::generic_category(), "fstat " + source.string());
+        }
+        UniqueFd out(::open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777));
+        if (!out) throw std::system_error(errno, std::generic_category(), "open " + dest.string());
+        if (::ioctl(out.get(), FICLONE, old_fd.get()) != 0) {
+            if (!is_unsupported_errno(errno)) {
+                throw std::system_error(errno, std::generic_category(), "FICLONE " + dest.string());
+            }
+            support.reflink = false;
+            return std::nullopt;
+        }
+
+        // 旧版本每个完整块的签名，弱校验和相同的块编号放在同一个桶里
+        const size_t block = options.delta_block;
+        const uint64_t old_size = static_cast<uint64_t>(old_st.st_size);
+        std::vector<uint8_t> buffer(block * 4);
+        std::vector<Digest> strong;
+        std::unordered_map<uint32_t, std::vector<uint32_t>> blocks;
+        RollingChecksum rolling;
+        auto hasher = Hasher::create(options.hash_algorithm);
+        auto block_digest = [&](const uint8_t* data) {
+            hasher->reset();
+            hasher->update(data, block);
+            return hasher->finish_digest(options.hash_algorithm);
+        };
+        for (uint64_t offset = 0; offset + block <= old_size; offset += block) {
+            throttle.read(block);
+            pread_full(old_fd.get(), buffer.data(), block, offset, base);
+            rolling.reset(buffer.data(), block);
+            blocks[rolling.value()].push_back(static_cast<uint32_t>(strong.size()));
+            strong.push_back(block_digest(buffer.data()));
+        }
+
+        // 把新文件中 [from, to) 写到同一偏移，与 base 原位内容相同的页跳过
+        std::vector<uint8_t> existing(4096);
+        auto write_range = [&](const uint8_t* data, size_t len, uint64_t offset) {
+            uint64_t written = stats.written;
+            if (len) throttle.read(len);
+            for (size_t done = 0; done < len;) {
+                size_t n = std::min<size_t>(existing.size(), len - done);
+                uint64_t at = offset + done;
+                bool same = false;
+                if (at + n <= old_size) {
+                    pread_full(old_fd.get(), existing.data(), n, at, base);
+                    same = std::memcmp(existing.data(), data + done, n) == 0;
+                }
+                if (same) {
+                    stats.reused += n;
+                } else {
+                    pwrite_full(out.get(), data + done, n, at, dest);
+                    stats.written += n;
+                }
+                done += n;
+            }
+            if (stats.written > written) throttle.write(stats.written - written);
+        };
+
+        auto file_hasher = Hasher::create(options.hash_algorithm);
+        uint64_t buffer_offset = 0;     // buffer[0] 在新文件中的偏移
+        size_t start = 0, end = 0, literal = 0;     // 窗口起点、数据末尾、未匹配区域起点
+        bool eof = false, have_checksum = false;
+        while (true) {
+            // 窗口之后至少还要有一个字节才能滚动，不足时先写出未匹配区域再补充数据
+            if (!eof && end - start <= block) {
+                write_range(buffer.data() + literal, start - literal, buffer_offset + literal);
+                std::memmove(buffer.data(), buffer.data() + start, end - start);
+                buffer_offset += start;
+                end -= start;
+                start = literal = 0;
+                while (!eof && end < buffer.size()) {
+                    ssize_t n = ::read(in.get(), buffer.data() + end, buffer.size() - end);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n < 0) throw std::system_error(errno, std::generic_category(), "read " + source.string());
+                    if (n == 0) eof = true;
+                    file_hasher->update(buffer.data() + end, static_cast<size_t>(n));
+                    end += static_cast<size_t>(n);
+                }
+            }
+            if (end - start < block) break;
+
+            if (!have_checksum) {
+                rolling.reset(buffer.data() + start, block);
+                have_checksum = true;
+            }
+            const uint64_t position = buffer_offset + start;
+            std::optional<uint32_t> match;
+            auto candidates = blocks.find(rolling.value());
+            if (candidates != blocks.end()) {
+                Digest digest = block_digest(buffer.data() + start);
+                for (uint32_t k : candidates->second) {
+                    if (strong[k] == digest && (!match || uint64_t(k) * block == position)) match = k;
+                }
+            }
+            if (match) {
+                write_range(buffer.data() + literal, start - literal, buffer_offset + literal);
+                if (uint64_t(*match) * block == position) {
+                    stats.reused += block;
+                } else {
+                    write_range(buffer.data() + start, block, position);
+                }
+                start += block;
+                literal = start;
+                have_checksum = false;
+            } else if (start + block < end) {
+                rolling.roll(buffer[start], buffer[start + block]);
+                ++start;
+            } else {
+                break;
+            }
+        }
+        write_range(buffer.data() + literal, end - literal, buffer_offset + literal);
+        if (::ftruncate(out.get(), st.st_size) != 0) {
+            throw std::system_error(errno, std::generic_category(), "ftruncate " + dest.string());
+        }
+        return file_hasher->finish_digest(options.hash_algorithm);
+#else
+        (void)source, (void)base, (void)dest, (void)support, (void)stats;
+        return std::nullopt;
+#endif
+    }
+
+    // 有上一版本且足够大的文件才值得增量传输
+    bool delta_candidate(const FileIndex& index, Id file, const DeltaBase* delta) const {
+        if (!delta || !options.delta) return false;
+        Id prev = (*delta->previous_of)[file];
+        return prev != FileIndex::npos && index.sizes[file] >= DELTA_MIN_SIZE &&
+               delta->files->sizes[prev] >= options.delta_block;
+    }
+
+    static void print_copy_methods(const CopyResult& result) {
+        std::cout << "复制方式:";
+        for (size_t m = 0; m < result.methods.size(); ++m) {
+            if (result.methods[m]) {
+                std::cout << " " << copy_method_name(static_cast<CopyMethod>(m)) << " " << result.methods[m];
+            }
+        }
+        std::cout << std::endl;
+        if (result.methods[static_cast<size_t>(CopyMethod::Delta)]) {
+            std::cout << "增量传输: 写入 " << result.delta_written << " 字节，沿用旧版本 " << result.delta_reused
+                      << " 字节" << std::endl;
+        }
+    }
+
+    static uint64_t total_size(const FileIndex& index, const std::vector<Id>& files) {
+        uint64_t bytes = 0;
+        for (Id f : files) bytes += index.sizes[f];
+        return bytes;
+    }
+
+    // 在 dest_root 下创建指定文件所在的全部目录。目录编号总是大于其父目录，
+    // 先标记需要的目录及其祖先，再按编号顺序每个目录只调用一次 mkdir
+    static void create_parent_directories(const FileIndex& index, const std::vector<Id>& files,
+                                          const fs::path& dest_root) {
+        std::vector<char> needed(index.directory_count(), 0);
+        for (Id file : files) {
+            for (Id d = index.file_dir(file); d != FileIndex::root && !needed[d]; d = index.dir_parent(d)) {
+                needed[d] = 1;
+            }
+        }
+        std::vector<char> failed(index.directory_count(), 0);
+        std::error_code root_ec;
+        fs::create_directories(dest_root, root_ec);
+        for (Id d = 1; d < index.directory_count(); ++d) {
+            if (!needed[d]) continue;
+            if (failed[index.dir_parent(d)]) {
+                failed[d] = 1;
+                continue;
+            }
+            std::error_code ec;
+            fs::path dest_dir = dest_root / index.directory_path(d);
+            fs::create_directory(dest_dir, ec);
+            if (ec) {
+                failed[d] = 1;
+                std::cerr << "无法创建目录 " << dest_dir << ": " << ec.message() << std::endl;
+            }
+        }
+    }
+
+    // 把索引中的指定文件从 source_root 复制到 dest_root 下的同名相对路径。
+    // 先一次性创建所有目标目录，再由 options.io_jobs 个调度器任务并行复制。
+    // 摘要尚未计算的文件走单遍复制，摘要写入 result.digests
+    // 给出 delta 时，有上一版本的大文件尝试增量传输
+    CopyResult copy_files(const FileIndex& index, const std::vector<Id>& files,
+                          const fs::path& source_root, const fs::path& dest_root,
+                          const DeltaBase* delta = nullptr) {
+        CopyResult result;
+        result.succeeded.assign(files.size(), 0);
+        result.digests.resize(files.size());
+
+        create_parent_directories(index, files, dest_root);
+        metrics.begin(RunMetrics::Copy, files.size(), total_size(index, files));
+
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> copied{0};
+        CopySupport support;
+        std::mutex methods_mutex;
+        const bool uring = use_io_uring();
+        (void)uring;
+        // 续传的暂存目录里可能留有上次中断前链接好的文件，与已提交的快照共用 inode。
+        // 各复制路径都以 O_TRUNC 打开目标，先删掉它才会写进新文件而不是改写旧快照
+        const bool replace_staged = staging_ && staging_->resumed;
+        auto unlink_staged = [&](const fs::path& dest) {
+            std::error_code ec;
+            if (replace_staged) fs::remove(dest, ec);
+        };
+        unsigned workers_count = std::max(1u, std::min<unsigned>(options.io_jobs, files.size()));
+        TaskGroup workers;
+        for (unsigned w = 0; w < workers_count; ++w) {
+            workers.run([&] {
+                std::array<size_t, static_cast<size_t>(CopyMethod::Count)> methods{};
+                DeltaStats delta_stats;
+                auto copy_one = [&](size_t i) {
+                    Id file = files[i];
+                    std::string relative_path = index.relative_path(file);
+                    auto start = RunMetrics::Clock::now();
+                    try {
+                        fs::path source = source_root / relative_path;
+                        fs::path dest = dest_root / relative_path;
+                        unlink_staged(dest);
+                        std::optional<Digest> delta_digest;
+                        if (support.reflink && delta_candidate(index, file, delta)) {
+                            fs::path base = delta->root / delta->files->relative_path((*delta->previous_of)[file]);
+                            delta_digest = delta_copy_file(source, base, dest, support, delta_stats);
+                        }
+                        if (delta_digest) {
+                            if (index.digests[file].empty()) result.digests[i] = *delta_digest;
+                            methods[static_cast<size_t>(CopyMethod::Delta)]++;
+                        } else if (index.digests[file].empty()) {
+                            result.digests[i] = copy_file_hashed(source, dest);
+                            methods[static_cast<size_t>(CopyMethod::SinglePass)]++;
+                        } else {
+                            CopyMethod method = copy_file_native(source, dest, support);
+                            methods[static_cast<size_t>(method)]++;
+                        }
+                        result.succeeded[i] = 1;
+                        copied++;
+                        journal_file(index, file, result.digests[i], relative_path);
+                        metrics.record(RunMetrics::Copy, 1, index.sizes[file], start);
+                    } catch (const std::exception& e) {
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cerr << "无法复制文件 " << relative_path << ": " << e.what() << std::endl;
+                    }
+                };
+#ifdef BACKUP_HAVE_IO_URING
+                // 单遍复制的文件经 io_uring 批量读写，其余文件仍走零拷贝
+                if (uring) {
+                    UringPipeline pipeline(options.uring_depth, options.read_buffer_size);
+                    pipeline.run([&](bool) -> std::optional<UringPipeline::Job> {
+                        for (size_t i = next++; i < files.size(); i = next++) {
+                            Id file = files[i];
+                            if (!index.digests[file].empty() || (support.reflink && delta_candidate(index, file, delta))) {
+                                copy_one(i);
+                                continue;
+                            }
+                            std::string relative_path = index.relative_path(file);
+                            std::shared_ptr<Hasher> hasher = Hasher::create(options.hash_algorithm);
+                            UringPipeline::Job job;
+                            job.source = (source_root / relative_path).string();
+                            job.dest = (dest_root / relative_path).string();
+                            unlink_staged(job.dest);
+                            job.consume = [this, hasher](const uint8_t* data, size_t len) {
+                                throttle.read(len);
+                                throttle.write(len);
+                                hasher->update(data, len);
+                            };
+                            job.done = [&, hasher, i, relative_path, start = RunMetrics::Clock::now()](int error) {
+                                if (error == UringPipeline::SPARSE) {
+                                    copy_one(i);
+                                    return;
+                                }
+                                if (error) {
+                                    std::lock_guard<std::mutex> lock(log_mutex);
+                                    std::cerr << "无法复制文件 " << relative_path << ": " << std::strerror(error)
+                                              << std::endl;
+                                    return;
+                                }
+                                result.digests[i] = hasher->finish_digest(options.hash_algorithm);
+                                methods[static_cast<size_t>(CopyMethod::SinglePass)]++;
+                                result.succeeded[i] = 1;
+                                copied++;
+                                journal_file(index, files[i], result.digests[i], relative_path);
+                                metrics.record(RunMetrics::Copy, 1, index.sizes[files[i]], start);
+                            };
+                            return job;
+                        }
+                        return std::nullopt;
+                    });
+                }
+#endif
+                for (size_t i = next++; i < files.size(); i = next++) {
+                    copy_one(i);
+                }
+                std::lock_guard<std::mutex> lock(methods_mutex);
+                for (size_t m = 0; m < methods.size(); ++m) result.methods[m] += methods[m];
+                result.delta_written += delta_stats.written;
+                result.delta_reused += delta_stats.reused;
+            });
+        }
+        workers.wait();
+
+        result.copied = copied;
+        return result;
+    }
+
+    struct LinkResult {
+        size_t linked = 0;
+        size_t copied = 0;              // 无法建立硬链接而改为复制的文件
+        uint64_t avoided_bytes = 0;     // 因硬链接而无需复制的数据量
+        std::vector<char> succeeded;    // 与输入一一对应
+    };
+
+    // 硬链接农场：未修改的文件在新快照中只是指向上一快照同一 inode 的硬链接，
+    // 每个文件一次 link() 调用，不读写任何数据。previous_of 给出文件在 previous_root
+    // 中的编号。跨文件系统或链接数达到上限时改为复制，上一快照缺少该文件时从源目录复制
+    LinkResult link_files(const FileIndex& index, const std::vector<Id>& files, const FileIndex& previous,
+                          const std::vector<Id>& previous_of, const fs::path& previous_root,
+                          const fs::path& source_root, const fs::path& dest_root) {
+        LinkResult result;
+        result.succeeded.assign(files.size(), 0);
+        create_parent_directories(index, files, dest_root);
+        metrics.begin(RunMetrics::Link, files.size());
+
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> linked{0};
+        std::atomic<size_t> copied{0};
+        std::atomic<uint64_t> avoided{0};
+        CopySupport support;
+        unsigned workers_count = std::max(1u, std::min<unsigned>(options.io_jobs, files.size()));
+        TaskGroup workers;
+        for (unsigned w = 0; w < workers_count; ++w) {
+            workers.run([&] {
+                for (size_t i = next++; i < files.size(); i = next++) {
+                    Id file = files[i];
+                    auto start = RunMetrics::Clock::now();
+                    fs::path existing = previous_root / previous.relative_path(previous_of[file]);
+                    fs::path dest = dest_root / index.relative_path(file);
+                    std::error_code ec;
+                    fs::create_hard_link(existing, dest, ec);
+                    if (ec == std::errc::file_exists) {
+                        // 续传的暂存目录里可能已有上次链接好的文件，替换后重新链接
+                        std::error_code remove_ec;
+                        fs::remove(dest, remove_ec);
+                        ec.clear();
+                        fs::create_hard_link(existing, dest, ec);
+                    }
+                    if (!ec) {
+                        avoided += index.sizes[file];
+                        linked++;
+                        result.succeeded[i] = 1;
+                        metrics.record(RunMetrics::Link, 1, 0, start);
+                        continue;
+                    }
+                    try {
+                        std::error_code exists_ec;
+                        fs::path source = fs::exists(existing, exists_ec) ? existing
+                                                                          : source_root / index.relative_path(file);
+                        copy_file_native(source, dest, support);
+                        copied++;
+                        result.succeeded[i] = 1;
+                        metrics.record(RunMetrics::Link, 1, index.sizes[file], start);
+                    } catch (const std::exception& e) {
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cerr << "无法链接或复制文件 " << index.relative_path(file) << ": " << e.what()
+                                  << std::endl;
+                    }
+                }
+            });
+        }
+        workers.wait();
+
+        result.linked = linked;
+        result.copied = copied;
+        result.avoided_bytes = avoided;
+        return result;
+    }
+
+    static void print_link_stats(const LinkResult& result) {
+        std::cout << "硬链接: " << result.linked << " 个文件，避免复制 " << result.avoided_bytes << " 字节";
+        if (result.copied) std::cout << "，无法链接改为复制: " << result.copied << " 个";
+        std::cout << std::endl;
+    }
+
+    struct ChunkResult {
+        size_t stored = 0;
+        std::vector<char> succeeded;                // 与输入一一对应
+        std::vector<Digest> digests;                // 存入时计算的文件摘要
+        std::vector<std::vector<ChunkRef>> chunks;  // 每个输入文件的块列表
+        std::atomic<uint64_t> new_chunks{0};
+        std::atomic<uint64_t> new_bytes{0};
+        std::atomic<uint64_t> dedup_chunks{0};
+        std::atomic<uint64_t> dedup_bytes{0};
+    };
+
+    // 把文件按内容切块存入仓库，同时用同一批数据计算整个文件的摘要。
+    // 经 FileReader 读取，遵循 --read-mode / --read-buffer
+    Digest store_file_chunks(const fs::path& source, ChunkStore& store, std::vector<ChunkRef>& chunks,
+                             ChunkResult& stats) {
+        auto file_hasher = Hasher::create(options.hash_algorithm);
+        RunMetrics::Streaming streaming(metrics, RunMetrics::Copy);
+
+        auto chunk_hasher = Hasher::create(ChunkStore::algorithm());
+        auto store_chunk = [&](const uint8_t* data, size_t len) {
+            chunk_hasher->reset();
+            chunk_hasher->update(data, len);
+            Digest id = chunk_hasher->finish_digest(ChunkStore::algorithm());
+            file_hasher->update(data, len);
+
+            if (store.put(id, data, len)) {
+                throttle.write(len);
+                stats.new_chunks++;
+                stats.new_bytes += len;
+            } else {
+                stats.dedup_chunks++;
+                stats.dedup_bytes += len;
+            }
+            chunks.push_back({id, static_cast<uint32_t>(len)});
+        };
+        // 只切出后面还有至少一个最大块数据的块(文件末尾除外)，块边界才与读取方式无关。返回用掉的字节数
+        auto cut_chunks = [&](const uint8_t* data, size_t len, bool eof) {
+            size_t used = 0;
+            while (used < len && (eof || len - used >= Chunker::MAX_SIZE)) {
+                size_t n = Chunker::cut(data + used, len - used);
+                store_chunk(data + used, n);
+                used += n;
+            }
+            return used;
+        };
+
+        // 读到的数据尽量原地切块，凑不满一个最大块的尾部留在 pending 中与下一段拼接
+        std::vector<uint8_t> pending;
+        FileReader(options.read_mode, options.read_buffer_size).read(source, [&](const uint8_t* data, size_t len) {
+            streaming.add(len);
+            throttle.read(len);
+            while (len > 0) {
+                if (pending.empty()) {
+                    size_t used = cut_chunks(data, len, false);
+                    pending.assign(data + used, data + len);
+                    break;
+                }
+                size_t take = std::min(len, Chunker::MAX_SIZE * 2 - pending.size());
+                pending.insert(pending.end(), data, data + take);
+                data += take;
+                len -= take;
+                pending.erase(pending.begin(),
+                              pending.begin() + static_cast<std::ptrdiff_t>(cut_chunks(pending.data(), pending.size(), false)));
+            }
+        });
+        cut_chunks(pending.data(), pending.size(), true);
+
+        return file_hasher->finish_digest(options.hash_algorithm);
+    }
+
+    // 仓库模式下的"复制"：由 options.io_jobs 个调度器任务并行切块写入仓库
+    void store_files_chunked(const FileIndex& index, const std::vector<Id>& files,
+                             const fs::path& source_root, ChunkStore& store, ChunkResult& result) {
+        result.succeeded.assign(files.size(), 0);
+        result.digests.resize(files.size());
+        result.chunks.resize(files.size());
+        metrics.begin(RunMetrics::Copy, files.size(), total_size(index, files));
+
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> stored{0};
+        unsigned workers_count = std::max(1u, std::min<unsigned>(options.io_jobs, files.size()));
+        TaskGroup workers;
+        for (unsigned w = 0; w < workers_count; ++w) {
+            workers.run([&] {
+                for (size_t i = next++; i < files.size(); i = next++) {
+                    std::string relative_path = index.relative_path(files[i]);
+                    auto start = RunMetrics::Clock::now();
+                    try {
+                        result.digests[i] = store_file_chunks(source_root / relative_path, store,
+                                                              result.chunks[i], result);
+                        result.succeeded[i] = 1;
+                        stored++;
+                        journal_file(index, files[i], result.digests[i], relative_path, &result.chunks[i]);
+                        metrics.record(RunMetrics::Copy, 1, index.sizes[files[i]], start);
+                    } catch (const std::exception& e) {
+                        result.chunks[i].clear();
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cerr << "无法保存文件 " << relative_path << ": " << e.what() << std::endl;
+                    }
+                }
+            });
+        }
+        workers.wait();
+
+        result.stored = stored;
+    }
+
+    static void print_chunk_stats(const ChunkResult& result) {
+        std::cout << "新写入块: " << result.new_chunks << " 个 (" << result.new_bytes << " 字节)，"
+                  << "去重块: " << result.dedup_chunks << " 个 (" << result.dedup_bytes << " 字节)" << std::endl;
+    }
+
+    struct ArchiveResult {
+        size_t stored = 0;
+        std::vector<char> succeeded;                // 与输入一一对应
+        std::vector<Digest> digests;
+        std::vector<ArchiveLocation> locations;
+        std::atomic<uint64_t> raw_bytes{0};
+        std::atomic<uint64_t> stored_bytes{0};
+    };
+
+    // 编码后不超过这个大小的文件在工作线程里整个编码好再一次性追加；更大的文件边读边编码，
+    // 每攒够这么多帧追加一批，内存占用有上限
+    static constexpr size_t ARCHIVE_INLINE_LIMIT = 4 * FrameCodec::FRAME_SIZE;
+
+    // 把一个文件编码成帧写入归档，同时计算摘要。经 FileReader 读取，遵循 --read-mode / --read-buffer
+    Digest archive_file(const fs::path& source, ArchiveWriter& writer, ArchiveLocation& location,
+                        ArchiveResult& stats) {
+        auto hasher = Hasher::create(options.hash_algorithm);
+        std::vector<uint8_t> buffer;
+        std::vector<uint8_t> frames;
+        uint64_t raw = 0;
+        RunMetrics::Streaming streaming(metrics, RunMetrics::Copy);
+        // 编码后的帧超过 ARCHIVE_INLINE_LIMIT 时才借用通道分批追加。读取、编码和限速都不持有任何锁，
+        // 只在追加一批帧时短暂持有通道锁
+        std::optional<ArchiveWriter::File> file;
+
+        auto encode = [&](const uint8_t* data, size_t n) {
+            hasher->update(data, n);
+            FrameCodec::encode(options.codec, options.compress_level, data, n, frames);
+            raw += n;
+            if (frames.size() >= ARCHIVE_INLINE_LIMIT) {
+                if (!file) file.emplace(writer);
+                throttle.write(frames.size());
+                file->write(frames);
+                frames.clear();
+            }
+        };
+
+        // 每帧固定 FRAME_SIZE 字节原始数据：整帧直接从读到的数据编码，零头攒在 buffer 中
+        FileReader(options.read_mode, options.read_buffer_size).read(source, [&](const uint8_t* data, size_t len) {
+            streaming.add(len);
+            throttle.read(len);
+            while (len > 0) {
+                if (buffer.empty() && len >= FrameCodec::FRAME_SIZE) {
+                    encode(data, FrameCodec::FRAME_SIZE);
+                    data += FrameCodec::FRAME_SIZE;
+                    len -= FrameCodec::FRAME_SIZE;
+                    continue;
+                }
+                size_t take = std::min(len, FrameCodec::FRAME_SIZE - buffer.size());
+                buffer.insert(buffer.end(), data, data + take);
+                data += take;
+                len -= take;
+                if (buffer.size() == FrameCodec::FRAME_SIZE) {
+                    encode(buffer.data(), buffer.size());
+                    buffer.clear();
+                }
+            }
+        });
+        if (!buffer.empty()) encode(buffer.data(), buffer.size());
+
+        if (file) {
+            if (!frames.empty()) {
+                throttle.write(frames.size());
+                file->write(frames);
+            }
+            location = file->finish();
+        } else {
+            throttle.write(frames.size());
+            location = writer.append(frames);
+        }
+
+        stats.raw_bytes += raw;
+        stats.stored_bytes += location.stored;
+        return hasher->finish_digest(options.hash_algorithm);
+    }
+
+    // 归档模式下的"复制"：options.io_jobs 个调度器任务并行读取和压缩，各自经 ArchiveWriter 的通道顺序大块写入段
+    void archive_files(const FileIndex& index, const std::vector<Id>& files, const fs::path& source_root,
+                       ArchiveWriter& writer, ArchiveResult& result) {
+        result.succeeded.assign(files.size(), 0);
+        result.digests.resize(files.size());
+        result.locations.resize(files.size());
+        metrics.begin(RunMetrics::Copy, files.size(), total_size(index, files));
+
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> stored{0};
+        unsigned workers_count = std::max(1u, std::min<unsigned>(options.io_jobs, files.size()));
+        TaskGroup workers;
+        for (unsigned w = 0; w < workers_count; ++w) {
+            workers.run([&] {
+                for (size_t i = next++; i < files.size(); i = next++) {
+                    std::string relative_path = index.relative_path(files[i]);
+                    auto start = RunMetrics::Clock::now();
+                    try {
+                        result.digests[i] = archive_file(source_root / relative_path, writer,
+                                                         result.locations[i], result);
+                        result.succeeded[i] = 1;
+                        stored++;
+                        std::string segment = writer.segment_name(result.locations[i].segment);
+                        journal_file(index, files[i], result.digests[i], relative_path, nullptr, &segment,
+                                     &result.locations[i]);
+                        metrics.record(RunMetrics::Copy, 1, index.sizes[files[i]], start);
+                    } catch (const std::exception& e) {
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cerr << "无法归档文件 " << relative_path << ": " << e.what() << std::endl;
+                    }
+                }
+            });
+        }
+        workers.wait();
+
+        if (!writer.close()) {
+            std::cerr << "写入归档段失败" << std::endl;
+            result.succeeded.assign(files.size(), 0);
+            stored = 0;
+        }
+        result.stored = stored;
+    }
+
+    void print_archive_stats(const ArchiveResult& result) const {
+        std::cout << "归档压缩(" << FrameCodec::name(options.codec) << "): " << result.raw_bytes
+                  << " 字节 -> " << result.stored_bytes << " 字节" << std::endl;
+    }
+
+    // 获取当前时间戳
+    std::string current_timestamp() {
+        auto now = std::chrono::system_clock::now();
+        auto in_time_t = std::chrono::system_clock::to_time_t(now);
+
+        std::tm tm_buf;
+        localtime_r(&in_time_t, &tm_buf);
+        std::stringstream ss;
+        ss << std::put_time(&tm_buf, "%Y%m%d_%H%M%S");
+        return ss.str();
+    }
+
+    // 断点续传：快照先写入备份目录下的暂存目录 partial_backup_<时间戳>，全部完成后再整体改名为
+    // backup_<时间戳>，中途崩溃留下的暂存目录不会被当作最新备份。暂存目录中的日志定期记录已完成的文件，
+    // 再次执行同一备份时沿用暂存目录，日志中元数据未变的文件既不重新哈希也不重新复制
+    static constexpr const char* STAGING_PREFIX = "partial_";
+    static constexpr const char* JOURNAL_NAME = "journal.bin";
+    static constexpr size_t JOURNAL_BATCH = 4096;  // 积攒这么多条记录也触发检查点
+
+    // 日志头部：描述这次备份，只有完全一致时才沿用暂存目录
+    struct JournalHeader {
+        std::string source;     // 规范化后的源目录
+        std::string base;       // 增量备份的基准快照名，完整备份为空
+        StorageMode storage = StorageMode::Files;
+        int64_t scan_time = 0;  // 第一次运行的扫描时刻，用于判断已完成的文件之后是否又被修改
+    };
+
+    // 日志中的一个已完成文件
+    struct JournalEntry {
+        std::string path;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        uint64_t inode = 0;
+        Digest digest;
+        std::vector<ChunkRef> chunks;   // 仓库模式的块列表
+        std::string segment;            // 归档模式：段文件路径(相对备份目录)及文件在段内的位置
+        ArchiveLocation location;
+    };
+
+    // 把数据落盘：Linux 上只同步暂存目录所在的文件系统
+    static void sync_filesystem(const fs::path& dir) {
+#ifdef __linux__
+        UniqueFd fd(::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (fd) ::syncfs(fd.get());
+#elif !defined(_WIN32)
+        (void)dir;
+        ::sync();
+#else
+        (void)dir;
+#endif
+    }
+
+    // 暂存目录中的只追加日志，记录格式与编目相同(魔数 + 长度 + 内容 + 校验和)。
+    // 工作线程每完成一个文件调用 add；每隔 options.checkpoint_seconds 秒或积攒 JOURNAL_BATCH 条记录时
+    // 做一次检查点：先把已写出的文件数据落盘，再追加这批记录，日志里出现的文件因此一定已经完整写入
+    class Journal {
+    public:
+        static constexpr char RECORD_MAGIC[4] = {'B', 'K', 'J', 'R'};
+        static constexpr uint32_t RECORD_VERSION = 1;
+
+        Journal(fs::path path, unsigned interval_seconds)
+            : path_(std::move(path)), interval_(std::chrono::seconds(interval_seconds)) {}
+
+        // 检查点落盘之前调用，归档模式用它把写缓冲交给内核。返回 false 表示已写出的数据不完整，
+        // 之后不再写入任何记录
+        std::function<bool()> before_sync;
+
+        // 读取日志。遇到不完整或校验失败的记录(崩溃时写到一半)即停止，valid 为之前的字节数
+        static bool load(const fs::path& path, JournalHeader& header, std::vector<JournalEntry>& entries,
+                         uint64_t& valid) {
+            std::ifstream in(path, std::ios::binary);
+            std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            size_t pos = 0;
+            bool have_header = false;
+            while (pos + 12 <= data.size()) {
+                uint32_t len, checksum;
+                std::memcpy(&len, data.data() + pos + 4, sizeof(len));
+                if (std::memcmp(data.data() + pos, RECORD_MAGIC, 4) != 0 || pos + 12 + len > data.size()) break;
+                std::memcpy(&checksum, data.data() + pos + 8 + len, sizeof(checksum));
+                if (checksum != fnv1a(data.data() + pos + 8, len)) break;
+                std::istringstream body(std::string(data, pos + 8, len));
+                if (!have_header) {
+                    if (!parse_header(body, header)) return false;
+                    have_header = true;
+                } else {
+                    JournalEntry entry;
+                    if (!parse_entry(body, entry)) break;
+                    entries.push_back(std::move(entry));
+                }
+                pos += 12 + len;
+            }
+            valid = pos;
+            return have_header;
+        }
+
+        // 新建日志写入头部，或打开已有日志截掉不完整的尾部后继续追加。
+        // 持有日志文件的排他锁直到对象销毁，另一个进程同时在写的暂存目录不会被沿用或清理
+        bool open(const JournalHeader* header, uint64_t valid) {
+#ifndef _WIN32
+            lock_.reset(::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+            if (!lock_ || ::flock(lock_.get(), LOCK_EX | LOCK_NB) != 0) return false;
+#endif
+            std::error_code ec;
+            if (header) {
+                fs::resize_file(path_, 0, ec);
+            } else if (fs::file_size(path_, ec) != valid) {
+                fs::resize_file(path_, valid, ec);
+            }
+            if (ec) return false;
+            out_.open(path_, std::ios::binary | std::ios::app);
+            if (!out_) return false;
+            if (header) {
+                std::ostringstream body;
+                write_pod(body, RECORD_VERSION);
+                write_string(body, header->source);
+                write_string(body, header->base);
+                write_pod(body, static_cast<uint8_t>(header->storage));
+                write_pod(body, header->scan_time);
+                std::string record = frame_record(RECORD_MAGIC, body.str());
+                if (!out_.write(record.data(), static_cast<std::streamsize>(record.size())) || !out_.flush()) {
+                    return false;
+                }
+                sync_filesystem(path_.parent_path());
+            }
+            last_ = std::chrono::steady_clock::now();
+            return true;
+        }
+
+        // 另一个进程是否正持有这个日志
+        static bool in_use(const fs::path& path) {
+#ifndef _WIN32
+            UniqueFd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+            return fd && ::flock(fd.get(), LOCK_SH | LOCK_NB) != 0;
+#else
+            (void)path;
+            return false;
+#endif
+        }
+
+        void add(const JournalEntry& entry) {
+            std::ostringstream body;
+            write_string(body, entry.path);
+            write_pod(body, entry.size);
+            write_pod(body, entry.mtime);
+            write_pod(body, entry.inode);
+            write_pod(body, static_cast<uint8_t>(entry.digest.type));
+            write_pod(body, entry.digest.length);
+            body.write(reinterpret_cast<const char*>(entry.digest.bytes.data()), entry.digest.length);
+            write_pod(body, static_cast<uint32_t>(entry.chunks.size()));
+            for (const ChunkRef& ref : entry.chunks) {
+                write_pod(body, static_cast<uint8_t>(ref.id.type));
+                write_pod(body, ref.id.length);
+                body.write(reinterpret_cast<const char*>(ref.id.bytes.data()), ref.id.length);
+                write_pod(body, ref.length);
+            }
+            write_string(body, entry.segment);
+            write_pod(body, entry.location.offset);
+            write_pod(body, entry.location.stored);
+            std::string record = frame_record(RECORD_MAGIC, body.str());
+
+            bool due;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_ += record;
+                due = ++pending_count_ >= JOURNAL_BATCH || std::chrono::steady_clock::now() - last_ >= interval_;
+            }
+            if (due) checkpoint();
+        }
+
+        // 已有其他线程在做检查点时直接返回，这批记录留给下一次
+        void checkpoint() {
+            std::unique_lock<std::mutex> flush_lock(flush_mutex_, std::try_to_lock);
+            if (!flush_lock) return;
+            std::string batch;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                batch.swap(pending_);
+                pending_count_ = 0;
+                last_ = std::chrono::steady_clock::now();
+            }
+            if (batch.empty() || failed_) return;
+            if (before_sync && !before_sync()) {
+                failed_ = true;
+                std::cerr << "归档段写入失败，本次备份中断后将无法续传" << std::endl;
+                return;
+            }
+            sync_filesystem(path_.parent_path());
+            if (!out_.write(batch.data(), static_cast<std::streamsize>(batch.size())) || !out_.flush()) {
+                failed_ = true;
+                std::cerr << "无法写入断点日志 " << path_ << "，本次备份中断后将无法续传" << std::endl;
+                return;
+            }
+            sync_filesystem(path_.parent_path());
+        }
+
+    private:
+        static bool parse_header(std::istream& in, JournalHeader& header) {
+            uint32_t version;
+            uint8_t storage;
+            if (!read_pod(in, version) || version != RECORD_VERSION || !read_string(in, header.source) ||
+                !read_string(in, header.base) || !read_pod(in, storage) || !read_pod(in, header.scan_time) ||
+                storage > static_cast<uint8_t>(StorageMode::Archive)) {
+                return false;
+            }
+            header.storage = static_cast<StorageMode>(storage);
+            return true;
+        }
+
+        static bool parse_entry(std::istream& in, JournalEntry& entry) {
+            uint32_t chunk_count;
+            if (!read_string(in, entry.path) || !read_pod(in, entry.size) || !read_pod(in, entry.mtime) ||
+                !read_pod(in, entry.inode) || !read_digest(in, MANIFEST_VERSION, entry.digest) ||
+                !read_pod(in, chunk_count)) {
+                return false;
+            }
+            entry.chunks.resize(chunk_count);
+            for (ChunkRef& ref : entry.chunks) {
+                if (!read_digest(in, MANIFEST_VERSION, ref.id) || !read_pod(in, ref.length)) return false;
+            }
+            return read_string(in, entry.segment) && read_pod(in, entry.location.offset) &&
+                   read_pod(in, entry.location.stored);
+        }
+
+        fs::path path_;
+        std::chrono::steady_clock::duration interval_;
+#ifndef _WIN32
+        UniqueFd lock_;
+#endif
+        std::ofstream out_;
+        std::mutex mutex_;          // 保护 pending_
+        std::mutex flush_mutex_;    // 同一时刻只有一个线程做检查点
+        std::string pending_;
+        size_t pending_count_ = 0;
+        std::chrono::steady_clock::time_point last_;
+        bool failed_ = false;
+    };
+
+    // 一次备份使用的暂存目录。done 为日志中已完成的文件，编号与 entries 一一对应
+    struct Staging {
+        fs::path dir;
+        std::string snapshot;           // 完成后的快照目录名
+        JournalHeader header;
+        std::vector<JournalEntry> entries;
+        FileIndex done;
+        bool resumed = false;
+        std::unique_ptr<Journal> journal;
+    };
+
+    // 当前正在写日志的暂存目录，工作线程每完成一个文件经由 journal_file 登记
+    Staging* staging_ = nullptr;
+
+    // 备份到对象存储时归档段写到这里，否则写入快照目录
+    std::shared_ptr<SegmentStore> remote_segments_;
+
+    std::shared_ptr<SegmentStore> segment_store(const fs::path& dir) {
+        if (remote_segments_) return remote_segments_;
+        return std::make_shared<LocalSegmentStore>(dir);
+    }
+
+    // 为这次备份准备暂存目录：沿用头部一致、没有被其他进程持有的暂存目录；
+    // 同一源目录的其他中断遗留(基准快照或存储模式已不同)和无法读取的暂存目录删除
+    bool open_staging(const fs::path& backup_dir, const fs::path& source_dir, const std::string& base,
+                      int64_t scan_time, Staging& staging) {
+        staging.header.source = Catalog::key_of(source_dir);
+        staging.header.base = base;
+        staging.header.storage = options.storage;
+        staging.header.scan_time = scan_time;
+
+        std::vector<fs::path> candidates;
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(backup_dir, ec)) {
+            if (entry.is_directory() && entry.path().filename().string().rfind(STAGING_PREFIX, 0) == 0) {
+                candidates.push_back(entry.path());
+            }
+        }
+        std::sort(candidates.rbegin(), candidates.rend());
+        for (const fs::path& dir : candidates) {
+            fs::path journal_path = dir / JOURNAL_NAME;
+            if (Journal::in_use(journal_path)) continue;
+            JournalHeader header;
+            std::vector<JournalEntry> entries;
+            uint64_t valid = 0;
+            bool loaded = Journal::load(journal_path, header, entries, valid);
+            // 同一备份目录下其他源目录的暂存目录留给它们自己续传
+            if (loaded && header.source != staging.header.source) continue;
+            if (loaded && !staging.resumed && header.base == base && header.storage == options.storage) {
+                auto journal = std::make_unique<Journal>(journal_path, options.checkpoint_seconds);
+                if (journal->open(nullptr, valid)) {
+                    staging.dir = dir;
+                    staging.header = header;
+                    staging.entries = std::move(entries);
+                    staging.journal = std::move(journal);
+                    staging.resumed = true;
+                    continue;
+                }
+            }
+            std::cout << "清理中断的暂存目录: " << dir << std::endl;
+            fs::remove_all(dir, ec);
+        }
+
+        if (staging.resumed) {
+            for (Id e = 0; e < staging.entries.size(); ++e) {
+                const JournalEntry& entry = staging.entries[e];
+                Id id = staging.done.add_path(entry.path, entry.size, entry.mtime, entry.inode);
+                staging.done.digests[id] = entry.digest;
+            }
+            staging.snapshot = staging.dir.filename().string().substr(std::strlen(STAGING_PREFIX));
+            std::cout << "从中断的备份继续: " << staging.dir << "，已完成 " << staging.entries.size() << " 个文件"
+                      << std::endl;
+            return true;
+        }
+
+        staging.snapshot = "backup_" + current_timestamp();
+        staging.dir = backup_dir / (STAGING_PREFIX + staging.snapshot);
+        fs::create_directories(staging.dir);
+        staging.journal = std::make_unique<Journal>(staging.dir / JOURNAL_NAME, options.checkpoint_seconds);
+        if (!staging.journal->open(&staging.header, 0)) {
+            std::cerr << "无法创建断点日志，本次备份中断后将无法续传" << std::endl;
+            staging.journal.reset();
+        }
+        return true;
+    }
+
+    // 工作线程登记一个已完成的文件
+    void journal_file(const FileIndex& index, Id file, const Digest& digest, const std::string& relative_path,
+                      const std::vector<ChunkRef>* chunks = nullptr, const std::string* segment = nullptr,
+                      const ArchiveLocation* location = nullptr) {
+        if (!staging_ || !staging_->journal) return;
+        JournalEntry entry;
+        entry.path = relative_path;
+        entry.size = index.sizes[file];
+        entry.mtime = index.mtimes[file];
+        entry.inode = index.inodes[file];
+        entry.digest = index.digests[file].empty() ? digest : index.digests[file];
+        if (chunks) entry.chunks = *chunks;
+        if (segment) entry.segment = *segment;
+        if (location) entry.location = *location;
+        staging_->journal->add(entry);
+    }
+
+    // 在 staging_ 指向 staging 期间执行 body，结束(包括异常)时恢复
+    template <typename Body>
+    auto with_journal(Staging& staging, Body&& body) {
+        struct Reset {
+            Staging*& target;
+            ~Reset() { target = nullptr; }
+        } reset{staging_};
+        staging_ = &staging;
+        return body();
+    }
+
+    // 扫描结果中已在日志里完成的文件在 staging.entries 中的编号，未完成的为 npos
+    static std::vector<Id> resumed_entries(const FileIndex& files, const Staging& staging) {
+        std::vector<Id> entry_of(files.file_count(), FileIndex::npos);
+        if (!staging.resumed) return entry_of;
+        for (Id f = 0; f < files.file_count(); ++f) {
+            if (files.flags[f] & FileIndex::Resumed) entry_of[f] = staging.done.find_path(files.relative_path(f));
+        }
+        return entry_of;
+    }
+
+    // 清单写入暂存目录并落盘后改名为正式快照目录，成功后快照才对增量备份和编目可见
+    std::optional<fs::path> commit_staging(const fs::path& backup_dir, Staging& staging, const Manifest& manifest) {
+        if (!write_manifest(staging.dir, manifest)) return std::nullopt;
+        if (remote_segments_) {
+            std::ifstream in(staging.dir / MANIFEST_NAME, std::ios::binary);
+            std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            try {
+                remote_segments_->publish(staging.snapshot + "/" + MANIFEST_NAME, data);
+            } catch (const std::exception& e) {
+                std::cerr << "无法上传清单: " << e.what() << std::endl;
+                return std::nullopt;
+            }
+        }
+        staging.journal.reset();
+        std::error_code ec;
+        fs::remove(staging.dir / JOURNAL_NAME, ec);
+        sync_filesystem(staging.dir);
+        fs::path final_dir = backup_dir / staging.snapshot;
+        fs::rename(staging.dir, final_dir, ec);
+        if (ec) {
+            std::cerr << "无法完成快照 " << staging.dir << " -> " << final_dir << ": " << ec.message() << std::endl;
+            return std::nullopt;
+        }
+        sync_filesystem(backup_dir);
+        return final_dir;
+    }
+
+    // 续传时把日志中已完成文件所在的段登记到段表(按段名排序，与编号顺序一致)，返回段名到编号的映射
+    static std::unordered_map<std::string, uint32_t> register_segments(const Staging& staging,
+                                                                       ArchiveIndex& archive) {
+        std::vector<std::string> names;
+        for (const JournalEntry& entry : staging.entries) names.push_back(entry.segment);
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        std::unordered_map<std::string, uint32_t> segment_of;
+        for (uint32_t s = 0; s < archive.segments.size(); ++s) segment_of[archive.segments[s]] = s;
+        for (const std::string& name : names) {
+            if (segment_of.count(name)) continue;
+            segment_of[name] = static_cast<uint32_t>(archive.segments.size());
+            archive.segments.push_back(name);
+        }
+        return segment_of;
+    }
+
+    static ArchiveLocation resumed_location(const JournalEntry& entry,
+                                            const std::unordered_map<std::string, uint32_t>& segment_of) {
+        ArchiveLocation location = entry.location;
+        location.segment = segment_of.at(entry.segment);
+        return location;
+    }
+
+    // 续传时新段的起始编号：接在暂存目录中已有的段文件和日志引用的段之后
+    // (对象存储上的段不在本地，只能从日志得知)
+    static uint32_t first_segment(const Staging& staging) {
+        uint32_t next = 0;
+        auto consider = [&](const std::string& name) {
+            if (name.rfind("pack-", 0) == 0 && fs::path(name).extension() == ".seg") {
+                next = std::max(next, static_cast<uint32_t>(std::strtoul(name.c_str() + 5, nullptr, 10)) + 1);
+            }
+        };
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(staging.dir, ec)) consider(entry.path().filename().string());
+        std::string own = staging.snapshot + "/";
+        for (const JournalEntry& entry : staging.entries) {
+            if (entry.segment.rfind(own, 0) == 0) consider(entry.segment.substr(own.size()));
+        }
+        return next;
+    }
+
+    // 没有需要写入的内容时删除新建的暂存目录；从日志恢复的暂存目录保留到下次
+    static void discard_staging(Staging& staging) {
+        if (staging.resumed) return;
+        staging.journal.reset();
+        std::error_code ec;
+        fs::remove_all(staging.dir, ec);
+    }
+
+    // 创建完整备份
+    bool create_backup(const fs::path& source_dir, const fs::path& backup_dir) {
+        if (auto remote = parse_remote(backup_dir.string())) return remote_backup(source_dir, *remote, false);
+        if (!fs::exists(source_dir)) {
+            std::cerr << "错误：源目录不存在!" << std::endl;
+            return false;
+        }
+
+        // 在暂存目录中创建备份，中断后再次执行时从断点继续
+        fs::create_directories(backup_dir);
+        std::optional<ChunkStore::Lock> store_lock;
+        if (options.storage == StorageMode::Chunks) store_lock.emplace(backup_dir, false);
+        int64_t scan_time = file_clock_now();
+        Staging staging;
+        open_staging(backup_dir, source_dir, "", scan_time, staging);
+        const fs::path& current_backup_dir = staging.dir;
+
+        std::cout << "正在扫描源目录: " << source_dir << std::endl;
+        ScanOptions scan;
+        // 单遍模式、仓库模式和归档模式都在读取文件内容时顺带计算摘要
+        scan.hash = !options.single_pass && options.storage == StorageMode::Files;
+        if (staging.resumed) {
+            scan.resume = &staging.done;
+            scan.resume_scan_time = staging.header.scan_time;
+        }
+        FileIndex source_files = scan_directory(source_dir, scan);
+        const size_t file_count = source_files.file_count();
+
+        // 断点日志中已完成的文件不再写入
+        std::vector<Id> entry_of = resumed_entries(source_files, staging);
+        std::vector<Id> to_copy;
+        std::vector<size_t> input_of(file_count, 0);
+        for (Id f = 0; f < file_count; ++f) {
+            if (entry_of[f] != FileIndex::npos) continue;
+            input_of[f] = to_copy.size();
+            to_copy.push_back(f);
+        }
+        const size_t resumed = file_count - to_copy.size();
+
+        // 清单只记录保存成功的文件
+        std::vector<char> failed(file_count, 0);
+        size_t copied_files = 0;
+        Manifest manifest;
+        manifest.scan_time = scan_time;
+        manifest.storage = options.storage;
+        if (options.storage == StorageMode::Chunks) {
+            std::cout << "正在写入块仓库..." << std::endl;
+            ChunkStore store(backup_dir);
+            ChunkResult chunk_result;
+            with_journal(staging, [&] { store_files_chunked(source_files, to_copy, source_dir, store, chunk_result); });
+            copied_files = chunk_result.stored;
+            print_chunk_stats(chunk_result);
+
+            for (Id f = 0; f < file_count; ++f) {
+                if (entry_of[f] != FileIndex::npos) {
+                    const auto& chunks = staging.entries[entry_of[f]].chunks;
+                    manifest.chunks.add_file(chunks.data(), chunks.size());
+                    continue;
+                }
+                size_t i = input_of[f];
+                if (!chunk_result.succeeded[i]) {
+                    failed[f] = 1;
+                    continue;
+                }
+                if (source_files.digests[f].empty()) source_files.digests[f] = chunk_result.digests[i];
+                manifest.chunks.add_file(chunk_result.chunks[i].data(), chunk_result.chunks[i].size());
+            }
+        } else if (options.storage == StorageMode::Archive) {
+            std::cout << "正在写入归档..." << std::endl;
+            auto segment_of = register_segments(staging, manifest.archive);
+            ArchiveWriter writer(segment_store(current_backup_dir), staging.snapshot, manifest.archive,
+                                 first_segment(staging));
+            ArchiveResult archive_result;
+            if (staging.journal) staging.journal->before_sync = [&] { return writer.flush(); };
+            with_journal(staging, [&] { archive_files(source_files, to_copy, source_dir, writer, archive_result); });
+            if (staging.journal) staging.journal->before_sync = nullptr;
+            copied_files = archive_result.stored;
+            print_archive_stats(archive_result);
+
+            for (Id f = 0; f < file_count; ++f) {
+                if (entry_of[f] != FileIndex::npos) {
+                    manifest.archive.locations.push_back(resumed_location(staging.entries[entry_of[f]], segment_of));
+                    continue;
+                }
+                size_t i = input_of[f];
+                if (!archive_result.succeeded[i]) {
+                    failed[f] = 1;
+                    continue;
+                }
+                if (source_files.digests[f].empty()) source_files.digests[f] = archive_result.digests[i];
+                manifest.archive.locations.push_back(archive_result.locations[i]);
+            }
+        } else {
+            std::cout << "正在复制文件..." << std::endl;
+            CopyResult copy_result =
+                with_journal(staging, [&] { return copy_files(source_files, to_copy, source_dir, current_backup_dir); });
+            copied_files = copy_result.copied;
+            print_copy_methods(copy_result);
+
+            for (size_t i = 0; i < to_copy.size(); ++i) {
+                Id f = to_copy[i];
+                if (!copy_result.succeeded[i]) {
+                    failed[f] = 1;
+                } else if (source_files.digests[f].empty()) {
+                    source_files.digests[f] = copy_result.digests[i];
+                }
+            }
+        }
+        copied_files += resumed;
+        if (copied_files != file_count) source_files.erase_files(failed);
+
+        manifest.files = std::move(source_files);
+        std::optional<fs::path> snapshot = commit_staging(backup_dir, staging, manifest);
+        if (!snapshot) return false;
+
+        record_snapshot(backup_dir, *snapshot, source_dir, "", manifest, copied_files);
+
+        std::cout << "\n备份完成! 保存到: " << *snapshot << std::endl;
+        std::cout << "共处理 " << copied_files << "/" << file_count << " 个文件" << std::endl;
+        if (resumed) std::cout << "其中 " << resumed << " 个文件沿用中断前已完成的结果" << std::endl;
+        return true;
+    }
+
+    // 找出需要备份的文件(新增或修改的)，previous_of 给出每个文件在上次备份中的编号。
+    // 目录编号先整体映射一次，之后每个文件按(目录, 文件名)在哈希表中查找，整体为线性复杂度。
+    // 摘要为空的文件是单遍模式下确定要复制的文件
+    static std::vector<Id> find_changed_files(const FileIndex& source_files, const FileIndex& backup_files,
+                                              std::vector<Id>& previous_of) {
+        const size_t file_count = source_files.file_count();
+        std::vector<Id> source_to_backup_dir = source_files.match_directories(backup_files);
+        std::vector<Id> changed;
+        previous_of.assign(file_count, FileIndex::npos);
+        for (Id f = 0; f < file_count; ++f) {
+            Id prev = backup_files.find_file(source_to_backup_dir[source_files.file_dir(f)], source_files.file_name(f));
+            previous_of[f] = prev;
+            if (source_files.digests[f].empty() || prev == FileIndex::npos ||
+                !same_content(source_files, f, backup_files, prev)) {
+                changed.push_back(f);
+            }
+        }
+        return changed;
+    }
+
+    // 优先查编目；编目中没有这个备份目录(如旧版本创建的备份)时扫描目录，
+    // 备份目录名中的时间戳可以按字典序排序，最大的即最新备份
+    std::optional<fs::path> find_latest_backup(const fs::path& backup_dir) {
+        if (const CatalogEntry* entry = catalog().latest(backup_dir)) {
+            return fs::path(entry->backup_dir) / entry->snapshot;
+        }
+        std::optional<fs::path> latest;
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(backup_dir, ec)) {
+            if (entry.is_directory() && entry.path().filename().string().find("backup_") == 0 &&
+                !fs::exists(entry.path() / PRUNED_NAME) && (!latest || *latest < entry.path())) {
+                latest = entry.path();
+            }
+        }
+        return latest;
+    }
+
+    // s3://bucket/prefix 形式的备份目标或快照
+    struct RemoteTarget {
+        std::string bucket;
+        std::string prefix;     // 不含首尾的 '/'
+    };
+
+    static std::optional<RemoteTarget> parse_remote(const std::string& url) {
+        if (url.rfind("s3://", 0) != 0) return std::nullopt;
+        RemoteTarget remote;
+        std::string rest = url.substr(5);
+        size_t slash = rest.find('/');
+        remote.bucket = rest.substr(0, slash);
+        if (slash != std::string::npos) remote.prefix = rest.substr(slash + 1);
+        while (!remote.prefix.empty() && remote.prefix.back() == '/') remote.prefix.pop_back();
+        if (remote.bucket.empty()) return std::nullopt;
+        return remote;
+    }
+
+    // 对象存储目标的本地缓存目录，代替备份目录保存各快照的清单、断点日志和暂存目录
+    fs::path remote_cache_dir(const RemoteTarget& remote) const {
+        if (!options.remote_cache.empty()) return options.remote_cache;
+        fs::path root = "backup_remote";
+        for (const char* home : {"HOME", "USERPROFILE"}) {
+            if (const char* dir = std::getenv(home)) {
+                root = fs::path(dir) / ".backup_remote";
+                break;
+            }
+        }
+        fs::path dir = root / remote.bucket;
+        if (!remote.prefix.empty()) dir /= remote.prefix;
+        return dir;
+    }
+
+    std::unique_ptr<S3Client> connect_remote(const RemoteTarget& remote) {
+        std::string error;
+        auto config = S3Client::from_environment(options.s3_endpoint, error);
+        if (!config) {
+            std::cerr << "错误：" << error << std::endl;
+            return nullptr;
+        }
+        try {
+            return std::make_unique<S3Client>(*config, remote.bucket);
+        } catch (const std::exception& e) {
+            std::cerr << "错误：" << e.what() << std::endl;
+            return nullptr;
+        }
+    }
+
+    // 备份到对象存储：快照按归档方式保存，小文件打包进段，大文件的段分片并发上传。
+    // 增量比对使用本地缓存中上一快照的清单，不需要列举或读回对象存储中的任何内容；
+    // 缓存目录不存在(如换了机器)时执行完整备份
+    bool remote_backup(const fs::path& source_dir, const RemoteTarget& remote, bool incremental) {
+        std::unique_ptr<S3Client> client = connect_remote(remote);
+        if (!client) return false;
+        if (options.storage != StorageMode::Archive) {
+            std::cout << "对象存储目标按归档方式保存" << std::endl;
+        }
+        fs::path cache = remote_cache_dir(remote);
+        std::cout << "本地缓存目录: " << cache << std::endl;
+
+        struct Restore {
+            BackupApp& app;
+            StorageMode storage;
+            ~Restore() {
+                app.options.storage = storage;
+                app.remote_segments_.reset();
+            }
+        } restore{*this, options.storage};
+        options.storage = StorageMode::Archive;
+        remote_segments_ = std::make_shared<S3SegmentStore>(*client, remote.prefix, options.part_size, options.upload_jobs);
+        return incremental ? incremental_backup(source_dir, cache) : create_backup(source_dir, cache);
+    }
+
+    // 对象存储上快照的清单：先找本地缓存，没有时下载一次存入缓存。返回缓存中的快照目录
+    std::optional<fs::path> fetch_remote_manifest(S3Client& client, const RemoteTarget& snapshot) {
+        RemoteTarget parent = snapshot;
+        size_t slash = parent.prefix.rfind('/');
+        std::string name = slash == std::string::npos ? parent.prefix : parent.prefix.substr(slash + 1);
+        parent.prefix = slash == std::string::npos ? "" : parent.prefix.substr(0, slash);
+        fs::path dir = remote_cache_dir(parent) / name;
+        if (fs::exists(dir / MANIFEST_NAME)) return dir;
+
+        std::string key = (parent.prefix.empty() ? "" : parent.prefix + "/") + name + "/" + MANIFEST_NAME;
+        try {
+            std::string data = client.get_object(key);
+            fs::create_directories(dir);
+            fs::path tmp_path = dir / (std::string(MANIFEST_NAME) + ".tmp");
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            if (!out.write(data.data(), static_cast<std::streamsize>(data.size())) || !out.flush()) {
+                std::cerr << "无法写入清单缓存: " << tmp_path << std::endl;
+                return std::nullopt;
+            }
+            out.close();
+            fs::rename(tmp_path, dir / MANIFEST_NAME);
+        } catch (const std::exception& e) {
+            std::cerr << "无法读取快照清单: " << e.what() << std::endl;
+            return std::nullopt;
+        }
+        return dir;
+    }
+
+    // 创建增量备份
+    bool incremental_backup(const fs::path& source_dir, const fs::path& backup_dir) {
+        if (auto remote = parse_remote(backup_dir.string())) return remote_backup(source_dir, *remote, true);
+        if (!fs::exists(source_dir)) {
+            std::cerr << "错误：源目录不存在!" << std::endl;
+            return false;
+        }
+
+        // 仓库模式沿用上一快照的块列表，读取它的清单之前就要持有仓库锁
+        std::optional<ChunkStore::Lock> store_lock;
+        if (options.storage == StorageMode::Chunks) store_lock.emplace(backup_dir, false);
+
+        // 获取最新备份
+        std::optional<fs::path> latest = find_latest_backup(backup_dir);
+        if (!latest) {
+            std::cout << "没有找到之前的备份，将执行完整备份" << std::endl;
+            return create_backup(source_dir, backup_dir);
+        }
+        fs::path latest_backup = *latest;
+        std::cout << "找到最新备份: " << latest_backup << std::endl;
+
+        // 读取最新备份的清单(没有清单时退回扫描备份目录)，再扫描源目录
+        Manifest previous;
+        bool have_manifest = load_manifest(latest_backup, previous);
+        if (!have_manifest) {
+            std::cout << "未找到可用清单，正在扫描最新备份..." << std::endl;
+            previous.files = scan_directory(latest_backup);
+        }
+        const FileIndex& backup_files = previous.files;
+
+        // 存储模式与最新备份不同时无法复用旧快照的内容
+        if (have_manifest && previous.storage != options.storage) {
+            std::cout << "最新备份的存储模式与当前设置不同，将执行完整备份" << std::endl;
+            return create_backup(source_dir, backup_dir);
+        }
+
+        // 在暂存目录中创建增量备份，中断后基准快照不变时从断点继续
+        int64_t scan_time = file_clock_now();
+        Staging staging;
+        open_staging(backup_dir, source_dir, latest_backup.filename().string(), scan_time, staging);
+
+        std::cout << "正在扫描文件变更..." << std::endl;
+        ScanOptions scan;
+        scan.previous = &backup_files;
+        scan.previous_scan_time = previous.scan_time;
+        scan.reuse_unchanged = have_manifest && !options.paranoid;
+        scan.defer_changed = options.single_pass;
+        if (staging.resumed) {
+            scan.resume = &staging.done;
+            scan.resume_scan_time = staging.header.scan_time;
+        }
+        // 有监视进程时只重新列举它记录的变更目录
+        std::optional<DirtySet> dirty;
+        if (scan.reuse_unchanged) dirty = request_dirty_set(source_dir, backup_dir, previous.scan_time);
+        if (dirty) {
+            std::cout << "根据监视记录只重新列举 " << dirty->size() << " 个变更目录" << std::endl;
+            scan.dirty = &*dirty;
+        }
+        FileIndex source_files = scan_directory(source_dir, scan);
+        const size_t file_count = source_files.file_count();
+
+        std::vector<Id> previous_of;
+        metrics.begin(RunMetrics::Compare, file_count);
+        auto compare_start = RunMetrics::Clock::now();
+        std::vector<Id> files_to_backup = find_changed_files(source_files, backup_files, previous_of);
+        metrics.record(RunMetrics::Compare, file_count, 0, compare_start);
+
+        // 没有变更也算成功，命令行和作业模式据此返回退出码
+        if (files_to_backup.empty()) {
+            std::cout << "没有发现需要备份的文件变更!" << std::endl;
+            discard_staging(staging);
+            return true;
+        }
+
+        // 断点日志中已完成的变更文件不再写入
+        std::vector<Id> entry_of = resumed_entries(source_files, staging);
+        std::vector<Id> to_copy;
+        for (Id f : files_to_backup) {
+            if (entry_of[f] == FileIndex::npos) to_copy.push_back(f);
+        }
+        const size_t resumed = files_to_backup.size() - to_copy.size();
+        const fs::path& current_backup_dir = staging.dir;
+
+        std::cout << "正在备份 " << files_to_backup.size() << " 个变更文件..." << std::endl;
+        if (resumed) std::cout << "其中 " << resumed << " 个文件沿用中断前已完成的结果" << std::endl;
+        if (options.storage != StorageMode::Files) {
+            return finish_packed_incremental(source_dir, backup_dir, staging, latest_backup, previous, source_files,
+                                              files_to_backup, to_copy, entry_of, previous_of, scan_time);
+        }
+        DeltaBase delta{&backup_files, &previous_of, latest_backup};
+        CopyResult copy_result = with_journal(
+            staging, [&] { return copy_files(source_files, to_copy, source_dir, current_backup_dir, &delta); });
+        size_t copied_files = copy_result.copied + resumed;
+        print_copy_methods(copy_result);
+
+        std::vector<char> failed(file_count, 0);
+        std::vector<char> changed(file_count, 0);
+        for (Id f : files_to_backup) changed[f] = 1;
+        for (size_t i = 0; i < to_copy.size(); ++i) {
+            Id f = to_copy[i];
+            if (!copy_result.succeeded[i]) {
+                failed[f] = 1;
+            } else if (source_files.digests[f].empty()) {
+                source_files.digests[f] = copy_result.digests[i];
+            }
+        }
+
+        // 未修改的文件硬链接到最新备份中的同一文件，快照只消耗元数据操作
+        std::cout << "处理未修改的文件..." << std::endl;
+        std::vector<Id> unchanged;
+        unchanged.reserve(file_count - files_to_backup.size());
+        for (Id f = 0; f < file_count; ++f) {
+            if (!changed[f]) unchanged.push_back(f);
+        }
+        LinkResult link_result = link_files(source_files, unchanged, backup_files, previous_of, latest_backup,
+                                            source_dir, current_backup_dir);
+        print_link_stats(link_result);
+        for (size_t i = 0; i < unchanged.size(); ++i) {
+            if (!link_result.succeeded[i]) failed[unchanged[i]] = 1;
+        }
+
+        // 清单描述本次快照对应的源目录状态(复制失败的文件除外)
+        if (std::find(failed.begin(), failed.end(), 1) != failed.end()) {
+            source_files.erase_files(failed);
+        }
+        Manifest manifest;
+        manifest.scan_time = scan_time;
+        manifest.files = std::move(source_files);
+        std::optional<fs::path> snapshot = commit_staging(backup_dir, staging, manifest);
+        if (!snapshot) return false;
+
+        record_snapshot(backup_dir, *snapshot, source_dir, latest_backup.filename().string(), manifest,
+                        copied_files);
+
+        std::cout << "\n增量备份完成! 保存到: " << *snapshot << std::endl;
+        std::cout << "共处理 " << copied_files << " 个变更文件" << std::endl;
+        return true;
+    }
+
+    // 仓库模式和归档模式的增量备份：只把变更文件写入块仓库或新的归档段，
+    // 未变更的文件直接沿用旧清单中的块列表或归档位置，快照目录里不再出现文件副本。
+    // to_copy 为 files_to_backup 中断点日志里还没有完成的部分，entry_of 给出已完成文件的日志记录
+    bool finish_packed_incremental(const fs::path& source_dir, const fs::path& backup_dir, Staging& staging,
+                                   const fs::path& latest_backup, const Manifest& previous, FileIndex& source_files,
+                                   const std::vector<Id>& files_to_backup, const std::vector<Id>& to_copy,
+                                   const std::vector<Id>& entry_of, const std::vector<Id>& previous_of,
+                                   int64_t scan_time) {
+        const size_t file_count = source_files.file_count();
+        Manifest manifest;
+        manifest.scan_time = scan_time;
+        manifest.storage = options.storage;
+
+        std::vector<char> succeeded;
+        std::vector<Digest> digests;
+        size_t copied_files = 0;
+        ChunkResult chunk_result;
+        ArchiveResult archive_result;
+        std::unordered_map<std::string, uint32_t> segment_of;
+        if (options.storage == StorageMode::Chunks) {
+            ChunkStore store(backup_dir);
+            with_journal(staging, [&] { store_files_chunked(source_files, to_copy, source_dir, store, chunk_result); });
+            copied_files = chunk_result.stored;
+            succeeded = std::move(chunk_result.succeeded);
+            digests = std::move(chunk_result.digests);
+            print_chunk_stats(chunk_result);
+        } else {
+            // 新段追加在旧段表之后，旧位置中的段编号保持有效
+            manifest.archive.segments = previous.archive.segments;
+            segment_of = register_segments(staging, manifest.archive);
+            ArchiveWriter writer(segment_store(staging.dir), staging.snapshot, manifest.archive, first_segment(staging));
+            if (staging.journal) staging.journal->before_sync = [&] { return writer.flush(); };
+            with_journal(staging, [&] { archive_files(source_files, to_copy, source_dir, writer, archive_result); });
+            if (staging.journal) staging.journal->before_sync = nullptr;
+            copied_files = archive_result.stored;
+            succeeded = std::move(archive_result.succeeded);
+            digests = std::move(archive_result.digests);
+            print_archive_stats(archive_result);
+        }
+        const size_t resumed = files_to_backup.size() - to_copy.size();
+        copied_files += resumed;
+
+        constexpr size_t unchanged = std::numeric_limits<size_t>::max();
+        std::vector<size_t> input_of(file_count, unchanged);
+        std::vector<char> changed(file_count, 0);
+        for (Id f : files_to_backup) changed[f] = 1;
+        for (size_t i = 0; i < to_copy.size(); ++i) {
+            input_of[to_copy[i]] = i;
+        }
+
+        std::vector<char> failed(file_count, 0);
+        for (Id f = 0; f < file_count; ++f) {
+            if (changed[f] && entry_of[f] != FileIndex::npos) {
+                const JournalEntry& entry = staging.entries[entry_of[f]];
+                if (options.storage == StorageMode::Chunks) {
+                    manifest.chunks.add_file(entry.chunks.data(), entry.chunks.size());
+                } else {
+                    manifest.archive.locations.push_back(resumed_location(entry, segment_of));
+                }
+                continue;
+            }
+            size_t i = input_of[f];
+            if (i != unchanged && !succeeded[i]) {
+                failed[f] = 1;
+                continue;
+            }
+            if (i != unchanged && source_files.digests[f].empty()) {
+                source_files.digests[f] = digests[i];
+            }
+            if (options.storage == StorageMode::Chunks) {
+                if (i == unchanged) {
+                    Id prev = previous_of[f];
+                    manifest.chunks.add_file(previous.chunks.chunks(prev), previous.chunks.count(prev));
+                } else {
+                    manifest.chunks.add_file(chunk_result.chunks[i].data(), chunk_result.chunks[i].size());
+                }
+            } else {
+                manifest.archive.locations.push_back(i == unchanged ? previous.archive.locations[previous_of[f]]
+                                                                    : archive_result.locations[i]);
+            }
+        }
+        if (copied_files != files_to_backup.size()) source_files.erase_files(failed);
+        manifest.files = std::move(source_files);
+        std::optional<fs::path> snapshot = commit_staging(backup_dir, staging, manifest);
+        if (!snapshot) return false;
+
+        record_snapshot(backup_dir, *snapshot, source_dir, latest_backup.filename().string(), manifest,
+                        copied_files);
+
+        std::cout << "\n增量备份完成! 保存到: " << *snapshot << std::endl;
+        std::cout << "共处理 " << copied_files << " 个变更文件" << std::endl;
+        return true;
+    }
+
+    // 监视模式：守护进程把源目录的变更记录在备份目录下的状态文件里，增量备份据此只检查变更过的目录。
+    // 监视进程持有锁文件的排他锁，增量备份拿不到锁才说明监视进程仍在运行
+    static constexpr const char* WATCH_STATE_NAME = "watch_state.bin";
+    static constexpr const char* WATCH_LOCK_NAME = "watch.lock";
+    static constexpr char WATCH_MAGIC[4] = {'B', 'K', 'W', 'S'};
+    static constexpr uint32_t WATCH_VERSION = 1;
+    static constexpr int WATCH_FLUSH_INTERVAL_MS = 2000;
+
+    struct DirtyEntry {
+        std::string path;
+        bool recursive = false;
+        int64_t stamp = 0;
+    };
+
+    struct WatchState {
+        std::string source;         // 规范化后的源目录
+        uint32_t pid = 0;
+        uint64_t generation = 0;    // 每次写出加一，增量备份据此确认同步请求已完成
+        int64_t since = 0;          // 所有 watch 建立完成的时刻，此后的变更都有记录
+        // 最近一次丢失事件(队列溢出或 watch 数达到上限)的时刻。file_clock 计数可能为负，没有时取最小值
+        int64_t incomplete_at = std::numeric_limits<int64_t>::min();
+        std::vector<DirtyEntry> dirty;
+    };
+
+    bool write_watch_state(const fs::path& backup_dir, const WatchState& state) {
+        fs::path state_path = backup_dir / WATCH_STATE_NAME;
+        fs::path tmp_path = state_path;
+        tmp_path += ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            out.write(WATCH_MAGIC, sizeof(WATCH_MAGIC));
+            write_pod(out, WATCH_VERSION);
+            write_string(out, state.source);
+            write_pod(out, state.pid);
+            write_pod(out, state.generation);
+            write_pod(out, state.since);
+            write_pod(out, state.incomplete_at);
+            write_pod(out, static_cast<uint64_t>(state.dirty.size()));
+            for (const auto& entry : state.dirty) {
+                write_string(out, entry.path);
+                write_pod(out, static_cast<uint8_t>(entry.recursive));
+                write_pod(out, entry.stamp);
+            }
+            if (!out.flush()) {
+                std::cerr << "无法写入监视状态: " << tmp_path << std::endl;
+                return false;
+            }
+        }
+        std::error_code ec;
+        fs::rename(tmp_path, state_path, ec);
+        if (ec) {
+            std::cerr << "无法保存监视状态 " << state_path << ": " << ec.message() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    static bool load_watch_state(const fs::path& backup_dir, WatchState& state) {
+        std::ifstream in(backup_dir / WATCH_STATE_NAME, std::ios::binary);
+        char magic[sizeof(WATCH_MAGIC)];
+        uint32_t version;
+        uint64_t count;
+        if (!in || !in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), WATCH_MAGIC) ||
+            !read_pod(in, version) || version != WATCH_VERSION || !read_string(in, state.source) ||
+            !read_pod(in, state.pid) || !read_pod(in, state.generation) || !read_pod(in, state.since) ||
+            !read_pod(in, state.incomplete_at) || !read_pod(in, count)) {
+            return false;
+        }
+        state.dirty.clear();
+        for (uint64_t i = 0; i < count; ++i) {
+            DirtyEntry entry;
+            uint8_t recursive;
+            if (!read_string(in, entry.path) || !read_pod(in, recursive) || !read_pod(in, entry.stamp)) return false;
+            entry.recursive = recursive != 0;
+            state.dirty.push_back(std::move(entry));
+        }
+        return true;
+    }
+
+    // 只读取清单头部的扫描时间
+    static std::optional<int64_t> read_manifest_scan_time(const fs::path& backup_path) {
+        std::ifstream in(backup_path / MANIFEST_NAME, std::ios::binary);
+        char magic[sizeof(MANIFEST_MAGIC)];
+        uint32_t version;
+        int64_t scan_time;
+        if (!in || !in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), MANIFEST_MAGIC) ||
+            !read_pod(in, version) || version < 2 || version > MANIFEST_VERSION || !read_pod(in, scan_time)) {
+            return std::nullopt;
+        }
+        return scan_time;
+    }
+
+    // 守护模式：监视 source_dir，直到收到 SIGINT/SIGTERM。SIGUSR1 要求立即写出已收到的全部事件
+    bool watch_directory(const fs::path& source_dir, const fs::path& backup_dir) {
+#ifdef BACKUP_HAVE_STATX
+        std::error_code ec;
+        fs::path source = fs::canonical(source_dir, ec);
+        if (ec || !fs::is_directory(source)) {
+            std::cerr << "错误：源目录不存在!" << std::endl;
+            return false;
+        }
+        fs::create_directories(backup_dir, ec);
+        UniqueFd lock(::open((backup_dir / WATCH_LOCK_NAME).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+        if (!lock || ::flock(lock.get(), LOCK_EX | LOCK_NB) != 0) {
+            std::cerr << "错误：无法锁定 " << backup_dir / WATCH_LOCK_NAME << "，可能已有监视进程在运行" << std::endl;
+            return false;
+        }
+
+        // 信号改由 signalfd 在事件循环中处理
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        UniqueFd signal_fd(::signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC));
+
+        std::cout << "正在建立监视: " << source << std::endl;
+        DirectoryWatcher watcher(source);
+        WatchState state;
+        state.source = source.string();
+        state.pid = static_cast<uint32_t>(::getpid());
+        // 从所有 watch 建立完成时开始计算，在此之前的变更要由下一次完整遍历覆盖
+        state.since = file_clock_now();
+        if (watcher.take_overflow()) state.incomplete_at = state.since;
+
+        auto flush = [&] {
+            // 早于最新备份扫描时刻的记录已经被那次备份覆盖
+            int64_t covered = std::numeric_limits<int64_t>::min();
+            if (auto latest = find_latest_backup(backup_dir)) {
+                covered = read_manifest_scan_time(*latest).value_or(covered);
+            }
+            auto& dirty = watcher.dirty();
+            state.dirty.clear();
+            for (auto it = dirty.begin(); it != dirty.end();) {
+                if (it->second.stamp < covered) {
+                    it = dirty.erase(it);
+                    continue;
+                }
+                state.dirty.push_back({it->first, it->second.recursive, it->second.stamp});
+                ++it;
+            }
+            state.generation++;
+            write_watch_state(backup_dir, state);
+        };
+        flush();
+        std::cout << "已监视 " << watcher.watch_count() << " 个目录，变更记录保存在 "
+                  << backup_dir / WATCH_STATE_NAME << std::endl;
+
+        bool changed = false;
+        auto last_flush = std::chrono::steady_clock::now();
+        while (true) {
+            pollfd fds[2] = {{watcher.fd(), POLLIN, 0}, {signal_fd.get(), POLLIN, 0}};
+            if (::poll(fds, 2, WATCH_FLUSH_INTERVAL_MS) < 0 && errno != EINTR) {
+                std::cerr << "监视失败: " << std::strerror(errno) << std::endl;
+                break;
+            }
+
+            bool sync = false, stop = false;
+            signalfd_siginfo info;
+            while (::read(signal_fd.get(), &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info))) {
+                (info.ssi_signo == SIGUSR1 ? sync : stop) = true;
+            }
+            // 同步请求之前发生的变更都已经在 inotify 队列里，先取完再写出
+            changed |= watcher.drain(file_clock_now());
+            if (watcher.take_overflow()) {
+                std::cerr << "inotify 事件丢失，下一次增量备份将完整遍历" << std::endl;
+                state.incomplete_at = file_clock_now();
+                watcher.dirty().clear();
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (sync || stop ||
+                (changed && now - last_flush >= std::chrono::milliseconds(WATCH_FLUSH_INTERVAL_MS))) {
+                flush();
+                changed = false;
+                last_flush = now;
+            }
+            if (stop) break;
+        }
+
+        pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
+        std::cout << "监视已停止" << std::endl;
+        return true;
+#else
+        // Windows 的 USN 日志和 macOS 的 FSEvents 尚未实现，这些平台上增量备份总是完整遍历
+        (void)source_dir;
+        (void)backup_dir;
+        std::cerr << "当前平台不支持监视模式" << std::endl;
+        return false;
+#endif
+    }
+
+    // 向监视进程取得上次扫描以来的脏目录。没有监视进程、监视的不是这个目录或记录不完整时返回空，
+    // 由调用方完整遍历
+    std::optional<DirtySet> request_dirty_set(const fs::path& source_dir, const fs::path& backup_dir,
+                                              int64_t previous_scan_time) {
+#ifdef BACKUP_HAVE_STATX
+        WatchState state;
+        std::error_code ec;
+        fs::path source = fs::canonical(source_dir, ec);
+        if (ec || !load_watch_state(backup_dir, state) || state.source != source.string()) return std::nullopt;
+
+        UniqueFd lock(::open((backup_dir / WATCH_LOCK_NAME).c_str(), O_RDONLY | O_CLOEXEC));
+        if (!lock) return std::nullopt;
+        if (::flock(lock.get(), LOCK_SH | LOCK_NB) == 0) {
+            std::cout << "监视进程未在运行，将完整遍历源目录" << std::endl;
+            return std::nullopt;
+        }
+
+        // 请求监视进程写出已收到的事件，等待状态文件更新
+        uint64_t generation = state.generation;
+        if (::kill(static_cast<pid_t>(state.pid), SIGUSR1) != 0) return std::nullopt;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (!load_watch_state(backup_dir, state) || state.generation == generation) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                std::cout << "监视进程未响应，将完整遍历源目录" << std::endl;
+                return std::nullopt;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+
+        if (state.since > previous_scan_time || state.incomplete_at >= previous_scan_time) {
+            std::cout << "监视记录未覆盖上次备份以来的全部变更，将完整遍历源目录" << std::endl;
+            return std::nullopt;
+        }
+        DirtySet dirty;
+        for (const auto& entry : state.dirty) {
+            if (entry.stamp >= previous_scan_time) dirty[entry.path] |= entry.recursive;
+        }
+        return dirty;
+#else
+        (void)source_dir;
+        (void)backup_dir;
+        (void)previous_scan_time;
+        return std::nullopt;
+#endif
+    }
+
+    // 恢复时每个文件的内容来源
+    struct RestoreContext {
+        fs::path snapshot;
+        fs::path backup_root;
+        S3Client* remote = nullptr;     // 对象存储上的快照，段名相对于 remote_prefix
+        std::string remote_prefix;
+        const Manifest* manifest = nullptr;
+        std::vector<fs::path> chain;                // 目录树模式：更早的快照，从新到旧
+        std::vector<std::optional<Manifest>> chain_manifests;
+        std::unique_ptr<std::once_flag[]> chain_loaded;
+        CopySupport support;
+        std::atomic<size_t> restored{0};
+        std::atomic<size_t> skipped{0};
+        std::atomic<size_t> failed{0};
+        std::atomic<uint64_t> bytes{0};
+    };
+
+    // 从对象存储恢复时每批相邻文件的数据量上限，每批只发一次范围请求
+    static constexpr uint64_t REMOTE_BATCH_BYTES = 8ull << 20;
+
+    // 每个恢复线程各自保持最近打开的归档段，按位置顺序读取时不必反复打开
+    struct SegmentReader {
+        uint32_t segment = std::numeric_limits<uint32_t>::max();
+        std::ifstream in;
+        std::string fetched;          // 对象存储上的段：最近一次范围请求取回的数据
+        uint64_t fetched_offset = 0;  // fetched 在段内的起点
+        uint64_t prefetch_end = 0;    // 本批文件在段内的结束位置，取数据时一并取回
+        std::vector<uint8_t> payload;
+        std::vector<uint8_t> raw;
+    };
+
+    const Manifest* chain_manifest(RestoreContext& ctx, size_t k) {
+        std::call_once(ctx.chain_loaded[k], [&] {
+            Manifest manifest;
+            if (load_manifest(ctx.chain[k], manifest)) ctx.chain_manifests[k] = std::move(manifest);
+        });
+        return ctx.chain_manifests[k] ? &*ctx.chain_manifests[k] : nullptr;
+    }
+
+    // 目录树模式的增量快照可能缺少未变更文件，需要沿着更早的快照查找
+    static void find_chain(RestoreContext& ctx) {
+        std::string name = ctx.snapshot.filename().string();
+        for (const auto& entry : fs::directory_iterator(ctx.backup_root)) {
+            std::string other = entry.path().filename().string();
+            if (entry.is_directory() && other.find("backup_") == 0 && other < name &&
+                !fs::exists(entry.path() / PRUNED_NAME)) {
+                ctx.chain.push_back(entry.path());
+            }
+        }
+        std::sort(ctx.chain.rbegin(), ctx.chain.rend());
+        ctx.chain_manifests.resize(ctx.chain.size());
+        ctx.chain_loaded.reset(new std::once_flag[ctx.chain.size()]);
+    }
+
+    static bool has_file_of_size(const fs::path& path, uint64_t size) {
+        std::error_code ec;
+        return fs::is_regular_file(path, ec) && fs::file_size(path, ec) == size && !ec;
+    }
+
+    // 目录树模式下在增量链中查找文件内容：先找快照本身，再从新到旧查找更早快照中内容相同的副本
+    std::optional<fs::path> resolve_file_source(RestoreContext& ctx, Id f) {
+        const FileIndex& files = ctx.manifest->files;
+        std::string relative_path = files.relative_path(f);
+        fs::path own = ctx.snapshot / relative_path;
+        if (has_file_of_size(own, files.sizes[f])) return own;
+
+        for (size_t k = 0; k < ctx.chain.size(); ++k) {
+            fs::path candidate = ctx.chain[k] / relative_path;
+            if (!has_file_of_size(candidate, files.sizes[f])) continue;
+            const Manifest* older = chain_manifest(ctx, k);
+            if (!older) return candidate;   // 没有清单的旧快照只能按大小判断
+            Id prev = older->files.find_path(relative_path);
+            if (prev != FileIndex::npos && same_content(files, f, older->files, prev)) return candidate;
+        }
+        return std::nullopt;
+    }
+
+    // 目标位置已有相同内容时跳过：大小和修改时间一致直接跳过(--paranoid 时不信任元数据)，
+    // 仅大小一致时比较摘要
+    bool restore_target_matches(const FileIndex& files, Id f, const fs::path& dest) {
+        if (!has_file_of_size(dest, files.sizes[f])) return false;
+        std::error_code ec;
+        auto mtime = fs::last_write_time(dest, ec);
+        if (!ec && !options.paranoid && mtime.time_since_epoch().count() == files.mtimes[f]) return true;
+
+        const Digest& digest = files.digests[f];
+        if (digest.empty() || !Hasher::available(digest.type)) return false;
+        try {
+            return calculate_digest(dest, digest.type) == digest;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+
+    // 仓库模式：按块列表依次拼接
+    void restore_chunked(RestoreContext& ctx, Id f, const fs::path& dest, std::vector<uint8_t>& buffer) {
+        const ChunkLists& chunks = ctx.manifest->chunks;
+        SparseWriter out(dest, true);
+        const ChunkRef* refs = chunks.chunks(f);
+        for (size_t c = 0; c < chunks.count(f); ++c) {
+            fs::path chunk_path = ChunkStore::path_of(ctx.backup_root, refs[c].id);
+            std::ifstream in(chunk_path, std::ios::binary);
+            buffer.resize(refs[c].length);
+            if (!in || !in.read(reinterpret_cast<char*>(buffer.data()), refs[c].length)) {
+                throw std::runtime_error("数据块缺失或不完整: " + chunk_path.string());
+            }
+            throttle.read(refs[c].length);
+            throttle.write(refs[c].length);
+            out.write(buffer.data(), refs[c].length);
+        }
+        out.finish();
+    }
+
+    // 归档模式：定位到文件的第一个帧，逐帧解码后交给 sink(data, len)，返回解码出的总字节数
+    template <typename Sink>
+    uint64_t read_archived(RestoreContext& ctx, Id f, SegmentReader& reader, Sink&& sink) {
+        const ArchiveIndex& archive = ctx.manifest->archive;
+        const ArchiveLocation& location = archive.locations[f];
+        fs::path segment_path = ctx.backup_root / archive.segments[location.segment];
+        std::string key;
+        uint64_t position = location.offset;
+        if (ctx.remote) {
+            key = archive.segments[location.segment];
+            if (!ctx.remote_prefix.empty()) key = ctx.remote_prefix + "/" + key;
+            segment_path = "s3://" + key;
+            if (reader.segment != location.segment) {
+                reader.fetched.clear();
+                reader.segment = location.segment;
+            }
+        } else {
+            if (reader.segment != location.segment) {
+                reader.in.close();
+                reader.in.clear();
+                reader.in.open(segment_path, std::ios::binary);
+                reader.segment = location.segment;
+            }
+            if (!reader.in || !reader.in.seekg(static_cast<std::streamoff>(location.offset))) {
+                reader.segment = std::numeric_limits<uint32_t>::max();
+                throw std::runtime_error("无法读取归档段: " + segment_path.string());
+            }
+        }
+        auto read = [&](void* out, size_t len) -> bool {
+            if (!ctx.remote) return static_cast<bool>(reader.in.read(static_cast<char*>(out), len));
+            if (position < reader.fetched_offset || position + len > reader.fetched_offset + reader.fetched.size()) {
+                // 已取回的数据不含所需的帧时从当前位置重新请求，顺带取回本批后续文件的帧，
+                // 每次最多 REMOTE_BATCH_BYTES，大文件分多次取回
+                uint64_t end = std::max(location.offset + location.stored, reader.prefetch_end);
+                end = std::min(end, position + std::max<uint64_t>(len, REMOTE_BATCH_BYTES));
+                reader.fetched = ctx.remote->get_object(key, position, std::max<uint64_t>(end - position, len));
+                reader.fetched_offset = position;
+                if (reader.fetched.size() < len) return false;
+            }
+            std::memcpy(out, reader.fetched.data() + (position - reader.fetched_offset), len);
+            position += len;
+            return true;
+        };
+
+        uint64_t consumed = 0, raw_total = 0;
+        while (consumed < location.stored) {
+            uint8_t header[FrameCodec::HEADER_SIZE];
+            Codec codec;
+            uint32_t raw_len, stored_len;
+            if (!read(header, sizeof(header)) || !FrameCodec::parse_header(header, codec, raw_len, stored_len)) {
+                reader.segment = std::numeric_limits<uint32_t>::max();
+                throw std::runtime_error("归档帧头损坏: " + segment_path.string());
+            }
+            reader.payload.resize(stored_len);
+            reader.raw.resize(raw_len);
+            if (!read(reader.payload.data(), stored_len) ||
+                !FrameCodec::decode(codec, reader.payload.data(), stored_len, reader.raw.data(), raw_len)) {
+                reader.segment = std::numeric_limits<uint32_t>::max();
+                throw std::runtime_error(std::string("无法解码归档帧(") + FrameCodec::name(codec) + "): " +
+                                         segment_path.string());
+            }
+            throttle.read(stored_len);
+            sink(reader.raw.data(), raw_len);
+            consumed += FrameCodec::HEADER_SIZE + stored_len;
+            raw_total += raw_len;
+        }
+        return raw_total;
+    }
+
+    void restore_archived(RestoreContext& ctx, Id f, const fs::path& dest, SegmentReader& reader) {
+        SparseWriter out(dest, true);
+        uint64_t raw_total = read_archived(ctx, f, reader, [&](const uint8_t* data, size_t len) {
+            throttle.write(len);
+            out.write(data, len);
+        });
+        if (raw_total != ctx.manifest->files.sizes[f]) {
+            throw std::runtime_error("恢复的文件大小不一致: " + dest.string());
+        }
+        out.finish();
+    }
+
+    // 把快照恢复到 target_dir。目录一次性创建好，文件由 options.io_jobs 个线程并行恢复，
+    // 目标位置已经相同的文件跳过。恢复后的文件修改时间与备份时一致，再次恢复时可以直接跳过
+    bool restore_backup(const fs::path& source, const fs::path& target_dir) {
+        // 对象存储上的快照：清单取自本地缓存，归档段按每个文件所在的字节范围读取
+        fs::path snapshot = source;
+        std::unique_ptr<S3Client> client;
+        std::optional<RemoteTarget> remote = parse_remote(source.string());
+        if (remote) {
+            client = connect_remote(*remote);
+            std::optional<fs::path> cached = client ? fetch_remote_manifest(*client, *remote) : std::nullopt;
+            if (!cached) return false;
+            snapshot = *cached;
+        }
+        if (!fs::is_directory(snapshot)) {
+            std::cerr << "错误：备份目录不存在!" << std::endl;
+            return false;
+        }
+
+        RestoreContext ctx;
+        ctx.snapshot = snapshot;
+        ctx.backup_root = snapshot.parent_path();
+        if (remote) {
+            ctx.remote = client.get();
+            size_t slash = remote->prefix.rfind('/');
+            ctx.remote_prefix = slash == std::string::npos ? "" : remote->prefix.substr(0, slash);
+        }
+        Manifest manifest;
+        if (!load_manifest(snapshot, manifest)) {
+            std::cout << "未找到可用清单，正在扫描备份目录..." << std::endl;
+            manifest.files = scan_directory(snapshot);
+        }
+        ctx.manifest = &manifest;
+        const FileIndex& files = manifest.files;
+
+        if (manifest.storage == StorageMode::Files) find_chain(ctx);
+
+        for (Id d = 0; d < files.directory_count(); ++d) {
+            std::error_code ec;
+            fs::path dir = target_dir / files.directory_path(d);
+            fs::create_directories(dir, ec);
+            if (ec) {
+                std::cerr << "无法创建目录 " << dir << ": " << ec.message() << std::endl;
+            }
+        }
+
+        // 归档模式按段内位置顺序恢复，读取基本是顺序的
+        std::vector<Id> order(files.file_count());
+        for (Id f = 0; f < files.file_count(); ++f) {
+            order[f] = f;
+        }
+        if (manifest.storage == StorageMode::Archive) {
+            const auto& locations = manifest.archive.locations;
+            std::sort(order.begin(), order.end(), [&](Id a, Id b) {
+                return std::tie(locations[a].segment, locations[a].offset) <
+                       std::tie(locations[b].segment, locations[b].offset);
+            });
+        }
+
+        // 对象存储上的归档把段内相邻的文件分批交给恢复线程，本地恢复每个文件单独一批
+        std::vector<size_t> batches;
+        for (size_t i = 0; i < order.size(); ++i) {
+            if (ctx.remote && manifest.storage == StorageMode::Archive && !batches.empty()) {
+                const auto& first = manifest.archive.locations[order[batches.back()]];
+                const auto& location = manifest.archive.locations[order[i]];
+                if (location.segment == first.segment &&
+                    location.offset + location.stored - first.offset <= REMOTE_BATCH_BYTES) {
+                    continue;
+                }
+            }
+            batches.push_back(i);
+        }
+
+        std::cout << "正在恢复 " << files.file_count() << " 个文件到: " << target_dir << std::endl;
+        metrics.begin(RunMetrics::Copy, order.size(), total_size(files, order));
+        std::atomic<size_t> next{0};
+        unsigned workers_count = std::max(1u, std::min<unsigned>(options.io_jobs, order.size()));
+        TaskGroup workers;
+        for (unsigned w = 0; w < workers_count; ++w) {
+            workers.run([&] {
+                SegmentReader reader;
+                std::vector<uint8_t> buffer;
+                for (size_t b = next++; b < batches.size(); b = next++) {
+                    size_t batch_end = b + 1 < batches.size() ? batches[b + 1] : order.size();
+                    if (ctx.remote && manifest.storage == StorageMode::Archive) {
+                        const auto& last = manifest.archive.locations[order[batch_end - 1]];
+                        reader.prefetch_end = last.offset + last.stored;
+                    }
+                    for (size_t i = batches[b]; i < batch_end; ++i) {
+                        Id f = order[i];
+                        std::string relative_path = files.relative_path(f);
+                        fs::path dest = target_dir / relative_path;
+                        auto start = RunMetrics::Clock::now();
+                        try {
+                            if (restore_target_matches(files, f, dest)) {
+                                ctx.skipped++;
+                                metrics.record(RunMetrics::Copy, 1, 0, start);
+                            } else {
+                                if (manifest.storage == StorageMode::Chunks) {
+                                    restore_chunked(ctx, f, dest, buffer);
+                                } else if (manifest.storage == StorageMode::Archive) {
+                                    restore_archived(ctx, f, dest, reader);
+                                } else {
+                                    auto source = resolve_file_source(ctx, f);
+                                    if (!source) {
+                                        throw std::runtime_error("备份链中找不到该文件的内容");
+                                    }
+                                    copy_file_native(*source, dest, ctx.support);
+                                }
+                                ctx.restored++;
+                                ctx.bytes += files.sizes[f];
+                                metrics.record(RunMetrics::Copy, 1, files.sizes[f], start);
+                            }
+                            std::error_code ec;
+                            fs::last_write_time(dest, fs::file_time_type(fs::file_time_type::duration(files.mtimes[f])), ec);
+                        } catch (const std::exception& e) {
+                            ctx.failed++;
+                            std::lock_guard<std::mutex> lock(log_mutex);
+                            std::cerr << "无法恢复文件 " << relative_path << ": " << e.what() << std::endl;
+                        }
+                    }
+                }
+            });
+        }
+        workers.wait();
+
+        std::cout << "\n恢复完成! 恢复 " << ctx.restored << " 个文件 (" << ctx.bytes << " 字节)，"
+                  << "已相同跳过 " << ctx.skipped << " 个，失败 " << ctx.failed << " 个" << std::endl;
+        return ctx.failed == 0;
+    }
+
+    // 校验的工作单元：目录树和归档模式为快照中的一个文件，仓库模式为一个块
+    struct VerifyUnit {
+        uint32_t target;
+        Id file;
+        const ChunkRef* chunk;  // 非空时校验该块
+    };
+
+    struct VerifyTarget {
+        Manifest manifest;
+        RestoreContext ctx;
+    };
+
+    struct VerifyResult {
+        std::atomic<size_t> checked{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<size_t> corrupt{0};     // 内容与摘要不一致
+        std::atomic<size_t> missing{0};     // 内容缺失或无法读取
+        std::atomic<size_t> shared{0};      // 与已校验的快照共享同一份内容，跳过
+        size_t unverifiable = 0;            // 没有摘要或摘要算法不可用
+    };
+
+    // 备份目录下所有带清单的 backup_ 快照(从旧到新)
+    static std::vector<fs::path> list_snapshots(const fs::path& backup_dir) {
+        std::vector<fs::path> snapshots;
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(backup_dir, ec)) {
+            if (entry.is_directory() && entry.path().filename().string().rfind("backup_", 0) == 0 &&
+                fs::exists(entry.path() / MANIFEST_NAME)) {
+                snapshots.push_back(entry.path());
+            }
+        }
+        std::sort(snapshots.begin(), snapshots.end());
+        return snapshots;
+    }
+
+    // 校验一个单元，返回是否通过(共享跳过也算通过)。seen 记录每个 inode 已按哪些清单摘要校验过
+    bool verify_unit(VerifyTarget& target, const VerifyUnit& unit, SegmentReader& reader, std::vector<uint8_t>& buffer,
+                     std::unordered_map<uint64_t, std::vector<Digest>>& seen, std::mutex& seen_mutex,
+                     VerifyResult& result, std::string& error) {
+        if (unit.chunk) {
+            const ChunkRef& ref = *unit.chunk;
+            fs::path chunk_path = ChunkStore::path_of(target.ctx.backup_root, ref.id);
+            std::ifstream in(chunk_path, std::ios::binary | std::ios::ate);
+            if (!in || static_cast<uint64_t>(in.tellg()) != ref.length) {
+                result.missing++;
+                error = "数据块缺失或大小不符: " + chunk_path.string();
+                return false;
+            }
+            buffer.resize(ref.length);
+            in.seekg(0);
+            if (!in.read(reinterpret_cast<char*>(buffer.data()), ref.length)) {
+                result.missing++;
+                error = "无法读取数据块: " + chunk_path.string();
+                return false;
+            }
+            throttle.read(ref.length);
+            auto hasher = Hasher::create(ref.id.type);
+            hasher->update(buffer.data(), ref.length);
+            result.bytes += ref.length;
+            if (hasher->finish_digest(ref.id.type) != ref.id) {
+                result.corrupt++;
+                error = "数据块内容与块 id 不一致: " + chunk_path.string();
+                return false;
+            }
+            return true;
+        }
+
+        const FileIndex& files = target.manifest.files;
+        const Digest& expected = files.digests[unit.file];
+        Digest actual;
+        if (target.manifest.storage == StorageMode::Archive) {
+            auto hasher = Hasher::create(expected.type);
+            uint64_t size = read_archived(target.ctx, unit.file, reader,
+                                          [&](const uint8_t* data, size_t len) { hasher->update(data, len); });
+            if (size != files.sizes[unit.file]) {
+                result.corrupt++;
+                error = "归档中的文件大小与清单不一致";
+                return false;
+            }
+            actual = hasher->finish_digest(expected.type);
+        } else {
+            auto source = resolve_file_source(target.ctx, unit.file);
+            if (!source) {
+                result.missing++;
+                error = "备份链中找不到该文件的内容";
+                return false;
+            }
+            // 硬链接农场中各快照的未变更文件是同一个 inode，清单摘要相同时只读一次。
+            // 摘要不同(例如 inode 被原地改写过)时各自重新计算，不让先校验的快照替后面的快照担保
+            if (uint64_t inode = file_inode(*source)) {
+                std::lock_guard<std::mutex> lock(seen_mutex);
+                std::vector<Digest>& digests = seen[inode];
+                if (std::find(digests.begin(), digests.end(), expected) != digests.end()) {
+                    result.shared++;
+                    return true;
+                }
+                digests.push_back(expected);
+            }
+            actual = calculate_digest(*source, expected.type);
+        }
+        result.bytes += files.sizes[unit.file];
+        if (actual != expected) {
+            result.corrupt++;
+            error = "内容与清单中的摘要不一致";
+            return false;
+        }
+        return true;
+    }
+
+    // 校验快照内容与清单中记录的摘要是否一致。path 为单个快照，或备份目录(校验其中所有快照)。
+    // 由 options.io_jobs 个线程并行读取，读取速率受 --limit-read 限制。--sample 每次只随机抽取一部分
+    // 文件(仓库模式为块)，多次运行逐步覆盖全部内容。多个快照共享的内容只校验一次：
+    // 仓库中的同一块、归档中同一段内的同一位置、目录树模式中硬链接到同一 inode 的文件
+    bool verify_backups(const fs::path& path) {
+        // path 本身是快照时只校验它，否则校验其中的所有快照
+        std::vector<fs::path> snapshots = fs::exists(path / MANIFEST_NAME) ? std::vector<fs::path>{path}
+                                                                           : list_snapshots(path);
+        if (snapshots.empty()) {
+            std::cerr << "错误：" << path << " 下没有可校验的快照!" << std::endl;
+            return false;
+        }
+
+        std::vector<std::unique_ptr<VerifyTarget>> targets;
+        std::vector<VerifyUnit> units;
+        std::unordered_set<Digest, DigestHash> seen_chunks;
+        std::unordered_set<std::string> seen_locations;
+        VerifyResult result;
+        size_t broken_snapshots = 0;
+        for (const fs::path& snapshot : snapshots) {
+            auto target = std::make_unique<VerifyTarget>();
+            if (!load_manifest(snapshot, target->manifest)) {
+                std::cerr << "快照没有可用清单，无法校验: " << snapshot << std::endl;
+                broken_snapshots++;
+                continue;
+            }
+            target->ctx.snapshot = snapshot;
+            target->ctx.backup_root = snapshot.parent_path();
+            target->ctx.manifest = &target->manifest;
+            const Manifest& manifest = target->manifest;
+            if (manifest.storage == StorageMode::Files) find_chain(target->ctx);
+
+            uint32_t t = static_cast<uint32_t>(targets.size());
+            const FileIndex& files = manifest.files;
+            for (Id f = 0; f < files.file_count(); ++f) {
+                if (manifest.storage == StorageMode::Chunks) {
+                    const ChunkRef* refs = manifest.chunks.chunks(f);
+                    for (size_t c = 0; c < manifest.chunks.count(f); ++c) {
+                        if (!Hasher::available(refs[c].id.type)) {
+                            result.unverifiable++;
+                        } else if (seen_chunks.insert(refs[c].id).second) {
+                            units.push_back(VerifyUnit{t, f, &refs[c]});
+                        } else {
+                            result.shared++;
+                        }
+                    }
+                    continue;
+                }
+                if (files.digests[f].empty() || !Hasher::available(files.digests[f].type)) {
+                    result.unverifiable++;
+                    continue;
+                }
+                if (manifest.storage == StorageMode::Archive) {
+                    const ArchiveLocation& location = manifest.archive.locations[f];
+                    std::string key = manifest.archive.segments[location.segment] + "@" +
+                                      std::to_string(location.offset);
+                    if (!seen_locations.insert(std::move(key)).second) {
+                        result.shared++;
+                        continue;
+                    }
+                }
+                units.push_back(VerifyUnit{t, f, nullptr});
+            }
+            targets.push_back(std::move(target));
+        }
+
+        // 抽样：打乱后取前 sample% 个，再按快照和段内位置排序，读取尽量顺序
+        if (options.verify_sample < 100.0) {
+            uint64_t seed = options.verify_seed ? options.verify_seed : std::random_device{}();
+            std::shuffle(units.begin(), units.end(), std::mt19937_64(seed));
+            auto keep = static_cast<size_t>(std::ceil(units.size() * options.verify_sample / 100.0));
+            units.resize(std::min(keep, units.size()));
+            std::sort(units.begin(), units.end(), [&](const VerifyUnit& a, const VerifyUnit& b) {
+                return std::tie(a.target, a.file, a.chunk) < std::tie(b.target, b.file, b.chunk);
+            });
+            std::cout << "抽样校验 " << options.verify_sample << "% (种子 " << seed << ")" << std::endl;
+        }
+        for (size_t begin = 0; begin < units.size();) {
+            size_t end = begin;
+            while (end < units.size() && units[end].target == units[begin].target) ++end;
+            const Manifest& manifest = targets[units[begin].target]->manifest;
+            if (manifest.storage == StorageMode::Archive) {
+                const auto& locations = manifest.archive.locations;
+                std::sort(units.begin() + begin, units.begin() + end, [&](const VerifyUnit& a, const VerifyUnit& b) {
+                    return std::tie(locations[a.file].segment, locations[a.file].offset) <
+                           std::tie(locations[b.file].segment, locations[b.file].offset);
+                });
+            }
+            begin = end;
+        }
+
+        std::cout << "正在校验 " << targets.size() << " 个快照中的 " << units.size() << " 个"
+                  << (units.empty() || !units.front().chunk ? "文件" : "数据块") << "..." << std::endl;
+        uint64_t planned_bytes = 0;
+        for (const VerifyUnit& unit : units) {
+            planned_bytes += unit.chunk ? unit.chunk->length : targets[unit.target]->manifest.files.sizes[unit.file];
+        }
+        metrics.begin(RunMetrics::Hash, units.size(), planned_bytes);
+
+        std::unordered_map<uint64_t, std::vector<Digest>> seen_inodes;
+        std::mutex seen_mutex;
+        std::atomic<size_t> next{0};
+        unsigned workers_count = std::max(1u, std::min<unsigned>(options.io_jobs, units.size()));
+        TaskGroup workers;
+        for (unsigned w = 0; w < workers_count; ++w) {
+            workers.run([&] {
+                SegmentReader reader;
+                std::vector<uint8_t> buffer;
+                for (size_t i = next++; i < units.size(); i = next++) {
+                    const VerifyUnit& unit = units[i];
+                    VerifyTarget& target = *targets[unit.target];
+                    auto start = RunMetrics::Clock::now();
+                    std::string error;
+                    bool ok;
+                    try {
+                        ok = verify_unit(target, unit, reader, buffer, seen_inodes, seen_mutex, result, error);
+                    } catch (const std::exception& e) {
+                        result.missing++;
+                        error = e.what();
+                        ok = false;
+                    }
+                    result.checked++;
+                    uint64_t size = unit.chunk ? unit.chunk->length : target.manifest.files.sizes[unit.file];
+                    metrics.record(RunMetrics::Hash, 1, ok ? size : 0, start);
+                    if (!ok) {
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cerr << "校验失败 " << target.ctx.snapshot.filename().string() << "/"
+                                  << target.manifest.files.relative_path(unit.file) << ": " << error << std::endl;
+                    }
+                }
+            });
+        }
+        workers.wait();
+
+        size_t bad = result.corrupt + result.missing;
+        std::cout << "\n校验完成! 检查 " << result.checked << " 项 (" << result.bytes << " 字节)，"
+                  << "损坏 " << result.corrupt << " 项，缺失 " << result.missing << " 项";
+        if (result.shared) std::cout << "，共享内容已校验过 " << result.shared << " 项";
+        if (result.unverifiable) std::cout << "，没有可用摘要 " << result.unverifiable << " 项";
+        std::cout << std::endl;
+        return bad == 0 && broken_snapshots == 0;
+    }
 
-    std::vector<BackupInfo> backup_history;
+    // 公历日期到 1970-01-01 起的天数
+    static int64_t days_from_civil(int year, unsigned month, unsigned day) {
+        year -= month <= 2;
+        const int era = (year >= 0 ? year : year - 399) / 400;
+        const unsigned yoe = static_cast<unsigned>(year - era * 400);
+        const unsigned doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+        const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return static_cast<int64_t>(era) * 146097 + static_cast<int64_t>(doe) - 719468;
+    }
 
-    // 计算文件的MD5哈希值
-    std::string calculate_md5(const fs::path& filepath) {
-        std::ifstream file(filepath, std::ios::binary);
-        if (!file) {
-            throw std::runtime_error("无法打开文件: " + filepath.string());
+    // 从快照名 backup_YYYYMMDD_HHMMSS 取出日期(本地时间，与创建时的命名一致)
+    static bool snapshot_date(const std::string& name, int& year, unsigned& month, unsigned& day) {
+        if (name.size() < 15 || name.compare(0, 7, "backup_") != 0 ||
+            !std::all_of(name.begin() + 7, name.begin() + 15, [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+            return false;
         }
+        year = std::stoi(name.substr(7, 4));
+        month = static_cast<unsigned>(std::stoi(name.substr(11, 2)));
+        day = static_cast<unsigned>(std::stoi(name.substr(13, 2)));
+        return month >= 1 && month <= 12 && day >= 1 && day <= 31;
+    }
 
-        MD5_CTX md5Context;
-        MD5_Init(&md5Context);
+    // 按保留策略决定每个快照的去留。snapshots 从旧到新，返回每个快照被保留的原因，空字符串表示删除。
+    // 每条规则从最新的快照往前数，每天(周、月)只保留其中最新的一个，直到凑够 N 个时间段；
+    // 无法从名字识别时间的快照始终保留
+    static std::vector<std::string> retention_reasons(const std::vector<fs::path>& snapshots,
+                                                      const Retention& policy) {
+        std::vector<std::string> reasons(snapshots.size());
+        auto keep = [&](size_t i, const char* why) {
+            if (!reasons[i].empty()) reasons[i] += ",";
+            reasons[i] += why;
+        };
 
-        char buffer[1024 * 16];
-        while (file.good()) {
-            file.read(buffer, sizeof(buffer));
-            MD5_Update(&md5Context, buffer, file.gcount());
+        std::vector<int64_t> days(snapshots.size(), std::numeric_limits<int64_t>::min());
+        std::vector<int64_t> months(snapshots.size(), std::numeric_limits<int64_t>::min());
+        for (size_t i = 0; i < snapshots.size(); ++i) {
+            int year;
+            unsigned month, day;
+            if (!snapshot_date(snapshots[i].filename().string(), year, month, day)) {
+                keep(i, "无法识别时间");
+                continue;
+            }
+            days[i] = days_from_civil(year, month, day);
+            months[i] = static_cast<int64_t>(year) * 12 + month - 1;
         }
 
-        unsigned char result[MD5_DIGEST_LENGTH];
-        MD5_Final(result, &md5Context);
+        for (size_t i = snapshots.size(), kept = 0; i-- > 0 && kept < policy.last; ++kept) keep(i, "最新");
 
-        std::ostringstream oss;
-        oss << std::hex << std::setfill('0');
-        for (auto c : result) {
-            oss << std::setw(2) << (int)c;
+        // 周从周一开始：1970-01-01 是周四
+        struct Rule {
+            unsigned count;
+            const char* name;
+            std::function<int64_t(size_t)> period;
+        };
+        const Rule rules[] = {
+            {policy.daily, "每日", [&](size_t i) { return days[i]; }},
+            {policy.weekly, "每周", [&](size_t i) { return (days[i] + 3) / 7; }},
+            {policy.monthly, "每月", [&](size_t i) { return months[i]; }},
+        };
+        for (const Rule& rule : rules) {
+            std::optional<int64_t> last_period;
+            unsigned kept = 0;
+            for (size_t i = snapshots.size(); i-- > 0 && kept < rule.count;) {
+                if (days[i] == std::numeric_limits<int64_t>::min()) continue;
+                int64_t period = rule.period(i);
+                if (last_period == period) continue;
+                last_period = period;
+                keep(i, rule.name);
+                kept++;
+            }
         }
-
-        return oss.str();
+        return reasons;
     }
 
-    // 扫描目录并返回文件信息
-    std::vector<FileInfo> scan_directory(const fs::path& dir_path) {
-        std::vector<FileInfo> files_info;
-        
-        for (const auto& entry : fs::recursive_directory_iterator(dir_path)) {
-            if (entry.is_regular_file()) {
-                try {
-                    FileInfo info;
-                    info.path = entry.path();
-                    info.md5 = calculate_md5(entry.path());
-                    info.size = entry.file_size();
-                    info.last_modified = fs::last_write_time(entry.path()).time_since_epoch().count();
-                    
-                    files_info.push_back(info);
-                } catch (const std::exception& e) {
-                    std::cerr << "无法处理文件 " << entry.path() << ": " << e.what() << std::endl;
+    // 按清单分批并行删除快照中的文件和目录，每个任务每次领取 PRUNE_BATCH 个文件。
+    // 每次删除计为一次 I/O，受 --limit-iops 限制。返回删除的文件数
+    size_t remove_listed_files(const fs::path& root, const FileIndex& files) {
+        constexpr size_t PRUNE_BATCH = 1024;
+        const size_t count = files.file_count();
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> removed{0};
+        unsigned workers_count = std::max<size_t>(1, std::min<size_t>(options.io_jobs, count / PRUNE_BATCH + 1));
+        TaskGroup workers;
+        for (unsigned w = 0; w < workers_count; ++w) {
+            workers.run([&] {
+                for (size_t begin = next.fetch_add(PRUNE_BATCH); begin < count; begin = next.fetch_add(PRUNE_BATCH)) {
+                    size_t end = std::min(count, begin + PRUNE_BATCH);
+                    for (Id f = begin; f < end; ++f) {
+                        throttle.write(0);
+                        std::error_code ec;
+                        if (fs::remove(root / files.relative_path(f), ec)) removed++;
+                    }
                 }
-            }
+            });
         }
-        
-        return files_info;
-    }
-
-    // 获取当前时间戳
-    std::string current_timestamp() {
-        auto now = std::chrono::system_clock::now();
-        auto in_time_t = std::chrono::system_clock::to_time_t(now);
+        workers.wait();
 
-        std::tm tm_buf;
-        localtime_r(&in_time_t, &tm_buf);
-        std::stringstream ss;
-        ss << std::put_time(&tm_buf, "%Y%m%d_%H%M%S");
-        return ss.str();
+        // 目录由深到浅删除，此时大多已经为空
+        std::vector<fs::path> directories;
+        for (Id d = 0; d < files.directory_count(); ++d) {
+            std::string path = files.directory_path(d);
+            if (!path.empty()) directories.push_back(root / path);
+        }
+        std::sort(directories.begin(), directories.end(), [](const fs::path& a, const fs::path& b) {
+            return std::distance(a.begin(), a.end()) > std::distance(b.begin(), b.end());
+        });
+        for (const fs::path& dir : directories) {
+            std::error_code ec;
+            fs::remove(dir, ec);
+        }
+        return removed;
     }
 
-    // 创建完整备份
-    bool create_backup(const fs::path& source_dir, const fs::path& backup_dir) {
-        if (!fs::exists(source_dir)) {
-            std::cerr << "错误：源目录不存在!" << std::endl;
-            return false;
+    // 删除一个已标记清理的快照目录。retained 为仍被保留快照引用的归档段("快照名/pack-NNNN.seg")，
+    // 这些段和清理标记留在原处，其余内容全部删除；没有需要留下的段时删除整个目录。返回是否删除了整个目录
+    bool remove_pruned(const fs::path& dir, const std::unordered_set<std::string>& retained, size_t& removed_files) {
+        Manifest manifest;
+        if (load_manifest(dir, manifest, PRUNED_NAME) && manifest.storage == StorageMode::Files) {
+            removed_files += remove_listed_files(dir, manifest.files);
         }
 
-        // 创建备份目录
-        std::string timestamp = current_timestamp();
-        fs::path current_backup_dir = backup_dir / ("backup_" + timestamp);
-        fs::create_directories(current_backup_dir);
-
-        std::cout << "正在扫描源目录: " << source_dir << std::endl;
-        auto source_files = scan_directory(source_dir);
-
-        std::cout << "正在复制文件..." << std::endl;
-        size_t copied_files = 0;
-        for (const auto& file_info : source_files) {
-            fs::path relative_path = fs::relative(file_info.path, source_dir);
-            fs::path dest_path = current_backup_dir / relative_path;
-            
-            fs::create_directories(dest_path.parent_path());
-            
-            try {
-                fs::copy_file(file_info.path, dest_path, fs::copy_options::overwrite_existing);
-                copied_files++;
-            } catch (const std::exception& e) {
-                std::cerr << "无法复制文件 " << relative_path << ": " << e.what() << std::endl;
+        std::string name = dir.filename().string();
+        bool holds_segments = false;
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(dir, ec)) {
+            std::string file = entry.path().filename().string();
+            if (file == PRUNED_NAME) continue;
+            if (retained.count(name + "/" + file)) {
+                holds_segments = true;
+                continue;
             }
+            std::error_code remove_ec;
+            removed_files += static_cast<size_t>(fs::remove_all(entry.path(), remove_ec));
         }
+        if (holds_segments) return false;
+        fs::remove_all(dir, ec);
+        return !ec;
+    }
 
-        // 记录备份历史
-        BackupInfo backup_info;
-        backup_info.timestamp = timestamp;
-        backup_info.backup_path = current_backup_dir;
-        backup_info.file_count = source_files.size();
-        backup_info.copied_files = copied_files;
-        backup_info.source_dir = source_dir;
-        backup_info.is_incremental = false;
-        backup_history.push_back(backup_info);
-
-        // 保存备份历史到文件
-        fs::path history_file = backup_dir / "backup_history.txt";
-        std::ofstream history(history_file, std::ios::app);
-        if (history) {
-            history << timestamp << ": 备份自 " << source_dir << " (共 " 
-                   << copied_files << "/" << source_files.size() << " 文件)\n";
+    // 块仓库的标记-清除回收：marked 为保留快照和未完成备份引用的块(十六进制 id)，
+    // 只列举仓库的 256 个子目录，不遍历任何快照目录。调用方须持有仓库的排他锁
+    void collect_chunks(const fs::path& backup_dir, const std::unordered_set<std::string>& marked) {
+        fs::path root = backup_dir / ChunkStore::DIR_NAME;
+        std::atomic<unsigned> next{0};
+        std::atomic<size_t> removed{0};
+        std::atomic<size_t> kept{0};
+        std::atomic<uint64_t> freed{0};
+        unsigned workers_count = std::max(1u, std::min(options.io_jobs, 256u));
+        TaskGroup workers;
+        for (unsigned w = 0; w < workers_count; ++w) {
+            workers.run([&] {
+                static constexpr char digits[] = "0123456789abcdef";
+                for (unsigned d = next++; d < 256; d = next++) {
+                    std::error_code ec;
+                    for (const auto& entry : fs::directory_iterator(root / std::string{digits[d >> 4], digits[d & 0x0f]}, ec)) {
+                        std::string name = entry.path().filename().string();
+                        // 写到一半的临时文件(持有排他锁时不会有正在进行的写入)同样删除
+                        if (name.find(".tmp") == std::string::npos && marked.count(name)) {
+                            kept++;
+                            continue;
+                        }
+                        std::error_code remove_ec;
+                        uint64_t size = fs::file_size(entry.path(), remove_ec);
+                        throttle.write(0);
+                        if (fs::remove(entry.path(), remove_ec)) {
+                            removed++;
+                            freed += remove_ec ? 0 : size;
+                        }
+                    }
+                }
+            });
         }
-
-        std::cout << "\n备份完成! 保存到: " << current_backup_dir << std::endl;
-        std::cout << "共处理 " << copied_files << "/" << source_files.size() << " 个文件" << std::endl;
-        return true;
+        workers.wait();
+        std::cout << "块仓库垃圾回收: 删除 " << removed << " 个未引用的块 (" << freed << " 字节)，保留 " << kept
+                  << " 个" << std::endl;
     }
 
-    // 创建增量备份
-    bool incremental_backup(const fs::path& source_dir, const fs::path& backup_dir) {
-        if (!fs::exists(source_dir)) {
-            std::cerr << "错误：源目录不存在!" << std::endl;
+    // 按 options.retention 清理 backup_dir 中的快照。先读取保留快照的清单(编目中记录为目录树模式的快照
+    // 不必读取)，标记出仍被引用的归档段和块；再把要删除的快照清单改名为 PRUNED_NAME，之后即使中断
+    // 也不会再被当作快照使用，下次清理时继续删除；最后按清单并行删除文件，并对块仓库做标记-清除。
+    // 目录树模式中未变更的文件是硬链接，删除旧快照只减少链接数，保留快照的内容不受影响
+    bool prune_backups(const fs::path& backup_dir) {
+        const Retention& policy = options.retention;
+        if (policy.empty()) {
+            std::cerr << "错误：没有指定保留策略 (--keep-last/--keep-daily/--keep-weekly/--keep-monthly)!" << std::endl;
+            return false;
+        }
+        if (!fs::is_directory(backup_dir)) {
+            std::cerr << "错误：备份目录不存在!" << std::endl;
             return false;
         }
 
-        // 获取最新备份
-        std::vector<fs::path> backups;
-        for (const auto& entry : fs::directory_iterator(backup_dir)) {
-            if (entry.is_directory() && entry.path().filename().string().find("backup_") == 0) {
-                backups.push_back(entry.path());
+        // 回收块仓库需要排他锁；有备份正在使用仓库时照常清理快照，块留到下次回收
+        std::optional<ChunkStore::Lock> store_lock;
+        if (fs::is_directory(backup_dir / ChunkStore::DIR_NAME)) {
+            store_lock.emplace(backup_dir, true);
+            if (!store_lock->held()) {
+                std::cout << "有备份正在使用块仓库，本次不回收数据块" << std::endl;
+                store_lock.reset();
             }
         }
 
-        if (backups.empty()) {
-            std::cout << "没有找到之前的备份，将执行完整备份" << std::endl;
-            return create_backup(source_dir, backup_dir);
+        std::vector<fs::path> snapshots = list_snapshots(backup_dir);
+        std::vector<std::string> reasons = retention_reasons(snapshots, policy);
+        std::vector<fs::path> doomed;
+        for (size_t i = 0; i < snapshots.size(); ++i) {
+            std::string name = snapshots[i].filename().string();
+            if (reasons[i].empty()) {
+                std::cout << "删除 " << name << std::endl;
+                doomed.push_back(snapshots[i]);
+            } else {
+                std::cout << "保留 " << name << " (" << reasons[i] << ")" << std::endl;
+            }
+        }
+        if (options.dry_run) {
+            std::cout << "试运行: 将删除 " << doomed.size() << "/" << snapshots.size() << " 个快照，未做任何修改"
+                      << std::endl;
+            return true;
         }
 
-        // 按时间排序找到最新备份
-        std::sort(backups.begin(), backups.end());
-        fs::path latest_backup = backups.back();
-        std::cout << "找到最新备份: " << latest_backup << std::endl;
-
-        // 扫描源目录和最新备份
-        std::cout << "正在扫描文件变更..." << std::endl;
-        auto source_files = scan_directory(source_dir);
-        auto backup_files = scan_directory(latest_backup);
-
-        // 找出需要备份的文件(新增或修改的)
-        std::vector<FileInfo> files_to_backup;
-        for (const auto& source_file : source_files) {
-            fs::path relative_path = fs::relative(source_file.path, source_dir);
-            
-            auto it = std::find_if(backup_files.begin(), backup_files.end(), 
-                [&relative_path](const FileInfo& info) {
-                    return fs::relative(info.path, info.path.parent_path().parent_path()) == relative_path;
-                });
-            
-            if (it == backup_files.end() || source_file.md5 != it->md5) {
-                files_to_backup.push_back(source_file);
+        // 标记：编目记录了存储方式的目录树快照不引用共享数据，其余快照读取清单
+        std::unordered_map<std::string, StorageMode> storage_of;
+        std::string key = Catalog::key_of(backup_dir);
+        for (const CatalogEntry& entry : catalog().entries()) {
+            if (entry.backup_dir == key) storage_of[entry.snapshot] = entry.storage;
+        }
+        std::unordered_set<std::string> segments;
+        std::unordered_set<std::string> chunks;
+        for (size_t i = 0; i < snapshots.size(); ++i) {
+            if (reasons[i].empty()) continue;
+            auto known = storage_of.find(snapshots[i].filename().string());
+            if (known != storage_of.end() && known->second == StorageMode::Files) continue;
+            Manifest manifest;
+            if (!load_manifest(snapshots[i], manifest)) {
+                std::cerr << "无法读取保留快照的清单，为安全起见不删除任何内容: " << snapshots[i] << std::endl;
+                return false;
             }
+            segments.insert(manifest.archive.segments.begin(), manifest.archive.segments.end());
+            for (const ChunkRef& ref : manifest.chunks.refs) chunks.insert(ref.id.hex());
         }
-
-        if (files_to_backup.empty()) {
-            std::cout << "没有发现需要备份的文件变更!" << std::endl;
-            return false;
+        // 中断的备份续传时还会用到断点日志里记录的块
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(backup_dir, ec)) {
+            if (entry.path().filename().string().rfind(STAGING_PREFIX, 0) != 0) continue;
+            JournalHeader header;
+            std::vector<JournalEntry> entries;
+            uint64_t valid = 0;
+            Journal::load(entry.path() / JOURNAL_NAME, header, entries, valid);
+            for (const JournalEntry& done : entries) {
+                for (const ChunkRef& ref : done.chunks) chunks.insert(ref.id.hex());
+            }
         }
 
-        // 创建增量备份
-        std::string timestamp = current_timestamp();
-        fs::path current_backup_dir = backup_dir / ("backup_" + timestamp);
-        fs::create_directories(current_backup_dir);
-
-        std::cout << "正在备份 " << files_to_backup.size() << " 个变更文件..." << std::endl;
-        size_t copied_files = 0;
-        for (const auto& file_info : files_to_backup) {
-            fs::path relative_path = fs::relative(file_info.path, source_dir);
-            fs::path dest_path = current_backup_dir / relative_path;
-            
-            fs::create_directories(dest_path.parent_path());
-            
-            try {
-                fs::copy_file(file_info.path, dest_path, fs::copy_options::overwrite_existing);
-                copied_files++;
-            } catch (const std::exception& e) {
-                std::cerr << "无法复制文件 " << relative_path << ": " << e.what() << std::endl;
+        for (const fs::path& snapshot : doomed) {
+            fs::rename(snapshot / MANIFEST_NAME, snapshot / PRUNED_NAME, ec);
+            if (ec) {
+                std::cerr << "无法标记快照 " << snapshot << ": " << ec.message() << std::endl;
+                return false;
             }
         }
+        sync_filesystem(backup_dir);
 
-        // 从旧备份复制未修改的文件(创建硬链接节省空间)
-        std::cout << "处理未修改的文件..." << std::endl;
-        for (const auto& backup_file : backup_files) {
-            fs::path relative_path = fs::relative(backup_file.path, latest_backup);
-            fs::path dest_path = current_backup_dir / relative_path;
-            
-            bool need_copy = true;
-            for (const auto& source_file : source_files) {
-                if (fs::relative(source_file.path, source_dir) == relative_path && 
-                    source_file.md5 == backup_file.md5) {
-                    need_copy = false;
-                    break;
-                }
+        // 删除所有已标记的快照，包括上次清理中断后留下的和只剩归档段的目录
+        size_t removed_dirs = 0, held_dirs = 0, removed_files = 0;
+        for (const auto& entry : fs::directory_iterator(backup_dir, ec)) {
+            if (!entry.is_directory() || entry.path().filename().string().rfind("backup_", 0) != 0 ||
+                !fs::exists(entry.path() / PRUNED_NAME)) {
+                continue;
             }
-            
-            if (need_copy) {
-                fs::create_directories(dest_path.parent_path());
-                try {
-                    // 尝试创建硬链接
-                    fs::create_hard_link(backup_file.path, dest_path);
-                } catch (...) {
-                    // 硬链接失败则复制文件
-                    try {
-                        fs::copy_file(backup_file.path, dest_path, fs::copy_options::overwrite_existing);
-                    } catch (const std::exception& e) {
-                        std::cerr << "无法复制文件 " << relative_path << ": " << e.what() << std::endl;
-                    }
-                }
+            if (remove_pruned(entry.path(), segments, removed_files)) {
+                removed_dirs++;
+            } else {
+                held_dirs++;
             }
         }
+        std::cout << "已删除 " << removed_dirs << " 个快照目录 (" << removed_files << " 个文件)";
+        if (held_dirs) std::cout << "，" << held_dirs << " 个目录只保留仍被引用的归档段";
+        std::cout << std::endl;
 
-        // 记录备份历史
-        BackupInfo backup_info;
-        backup_info.timestamp = timestamp;
-        backup_info.backup_path = current_backup_dir;
-        backup_info.file_count = source_files.size();
-        backup_info.copied_files = copied_files;
-        backup_info.source_dir = source_dir;
-        backup_info.is_incremental = true;
-        backup_info.based_on = latest_backup.filename().string();
-        backup_history.push_back(backup_info);
-
-        fs::path history_file = backup_dir / "backup_history.txt";
-        std::ofstream history(history_file, std::ios::app);
-        if (history) {
-            history << timestamp << ": 增量备份自 " << source_dir << " (共 " 
-                   << copied_files << "/" << files_to_backup.size() << " 变更文件)\n";
-        }
-
-        std::cout << "\n增量备份完成! 保存到: " << current_backup_dir << std::endl;
-        std::cout << "共处理 " << copied_files << " 个变更文件" << std::endl;
+        if (store_lock) collect_chunks(backup_dir, chunks);
         return true;
     }
 
     void show_backup_history() {
-        if (backup_history.empty()) {
+        const std::vector<CatalogEntry>& entries = catalog().entries();
+        if (entries.empty()) {
             std::cout << "没有备份历史记录" << std::endl;
             return;
         }
 
         std::cout << "\n=== 备份历史 ===" << std::endl;
-        for (const auto& backup : backup_history) {
-            std::cout << "时间: " << backup.timestamp << std::endl;
-            std::cout << "类型: " << (backup.is_incremental ? "增量备份" : "完整备份") << std::endl;
-            if (backup.is_incremental) {
-                std::cout << "基于: " << backup.based_on << std::endl;
+        for (const auto& backup : entries) {
+            std::cout << "时间: " << backup.snapshot.substr(std::min<size_t>(7, backup.snapshot.size())) << std::endl;
+            std::cout << "类型: " << (backup.incremental ? "增量备份" : "完整备份") << std::endl;
+            if (backup.incremental) {
+                std::cout << "基于: " << backup.parent << std::endl;
             }
             std::cout << "源目录: " << backup.source_dir << std::endl;
-            std::cout << "备份位置: " << backup.backup_path << std::endl;
-            std::cout << "文件数: " << backup.copied_files << "/" << backup.file_count << std::endl;
+            std::cout << "备份位置: " << (fs::path(backup.backup_dir) / backup.snapshot).string() << std::endl;
+            std::cout << "存储方式: " << storage_mode_name(backup.storage) << std::endl;
+            if (!fs::exists(fs::path(backup.backup_dir) / backup.manifest)) {
+                std::cout << "状态: 已清理" << std::endl;
+            }
+            std::cout << "文件数: " << backup.copied_files << "/" << backup.file_count << " (共 " << backup.bytes
+                      << " 字节)" << std::endl;
             std::cout << "------------------------" << std::endl;
         }
     }
@@ -299,15 +7577,17 @@ public:
         std::cout << "1. 完整备份" << std::endl;
         std::cout << "2. 增量备份" << std::endl;
         std::cout << "3. 查看备份历史" << std::endl;
-        std::cout << "4. 退出" << std::endl;
+        std::cout << "4. 恢复备份" << std::endl;
+        std::cout << "5. 退出" << std::endl;
     }
 
     void run() {
         std::cout << "欢迎使用数据备份应用" << std::endl;
+        catalog();
 
         while (true) {
             show_menu();
-            std::cout << "请选择操作 (1-4): ";
+            std::cout << "请选择操作 (1-5): ";
             std::string choice;
             std::getline(std::cin, choice);
 
@@ -320,7 +7600,7 @@ public:
                 std::string target;
                 std::getline(std::cin, target);
                 
-                create_backup(source, target);
+                measured("full", source, target, [&] { return create_backup(source, target); });
             } else if (choice == "2") {
                 std::cout << "请输入要备份的源目录路径: ";
                 std::string source;
@@ -330,10 +7610,20 @@ public:
                 std::string target;
                 std::getline(std::cin, target);
                 
-                incremental_backup(source, target);
+                measured("incremental", source, target, [&] { return incremental_backup(source, target); });
             } else if (choice == "3") {
                 show_backup_history();
             } else if (choice == "4") {
+                std::cout << "请输入要恢复的备份目录路径: ";
+                std::string snapshot;
+                std::getline(std::cin, snapshot);
+
+                std::cout << "请输入恢复目标目录路径: ";
+                std::string target;
+                std::getline(std::cin, target);
+
+                measured("restore", snapshot, target, [&] { return restore_backup(snapshot, target); });
+            } else if (choice == "5") {
                 std::cout << "感谢使用，再见!" << std::endl;
                 break;
             } else {
@@ -343,14 +7633,929 @@ public:
     }
 };
 
-int main() {
-    // 初始化OpenSSL MD5
+// 解析 "4096"、"256K"、"4M"、"1G" 形式的字节数
+static std::optional<size_t> parse_size(const std::string& text) {
+    size_t pos = 0;
+    unsigned long long value;
+    try {
+        value = std::stoull(text, &pos);
+    } catch (const std::exception&) {
+        return std::nullopt;
+    }
+    std::string suffix = text.substr(pos);
+    if (suffix == "K" || suffix == "k") value <<= 10;
+    else if (suffix == "M" || suffix == "m") value <<= 20;
+    else if (suffix == "G" || suffix == "g") value <<= 30;
+    else if (!suffix.empty()) return std::nullopt;
+    return static_cast<size_t>(value);
+}
+
+// 解析一个运行选项，args[i] 为选项名，带参数时 i 移到参数上。
+// 返回 1 表示已处理，0 表示不是运行选项，-1 表示参数有误(已输出错误信息)
+static int parse_option(const std::vector<std::string>& args, size_t& i, BackupApp::Options& options) {
+    const std::string arg = args[i];
+    const size_t argc = args.size();
+    if (arg == "--paranoid") {
+        options.paranoid = true;
+    } else if (arg == "--hash" && i + 1 < argc) {
+        auto algorithm = Hasher::parse(args[++i]);
+        if (!algorithm || !Hasher::available(*algorithm)) {
+            std::cerr << "不支持的摘要算法: " << args[i] << std::endl;
+            return -1;
+        }
+        options.hash_algorithm = *algorithm;
+    } else if (arg == "--repository") {
+        options.storage = BackupApp::StorageMode::Chunks;
+    } else if (arg == "--archive") {
+        options.storage = BackupApp::StorageMode::Archive;
+    } else if (arg == "--compress" && i + 1 < argc) {
+        // 格式为 codec 或 codec:level
+        std::string value = args[++i];
+        size_t colon = value.find(':');
+        auto codec = FrameCodec::parse(value.substr(0, colon));
+        if (!codec || !FrameCodec::available(*codec)) {
+            std::cerr << "不支持的压缩方式: " << value << std::endl;
+            return -1;
+        }
+        options.codec = *codec;
+        if (colon != std::string::npos) {
+            try {
+                options.compress_level = std::stoi(value.substr(colon + 1));
+            } catch (const std::exception&) {
+                std::cerr << "无效的压缩级别: " << value << std::endl;
+                return -1;
+            }
+        }
+    } else if (arg == "--read-mode" && i + 1 < argc) {
+        auto mode = FileReader::parse(args[++i]);
+        if (!mode) {
+            std::cerr << "不支持的读取方式: " << args[i] << std::endl;
+            return -1;
+        }
+        options.read_mode = *mode;
+    } else if (arg == "--read-buffer" && i + 1 < argc) {
+        auto size = parse_size(args[++i]);
+        if (!size || *size == 0) {
+            std::cerr << "无效的缓冲区大小: " << args[i] << std::endl;
+            return -1;
+        }
+        options.read_buffer_size = *size;
+    } else if (arg == "--workers" && i + 1 < argc) {
+        try {
+            options.workers = static_cast<unsigned>(std::max(1, std::stoi(args[++i])));
+        } catch (const std::exception&) {
+            std::cerr << "无效的线程数: " << args[i] << std::endl;
+            return -1;
+        }
+    } else if (arg == "--walk-jobs" && i + 1 < argc) {
+        try {
+            options.walk_jobs = static_cast<unsigned>(std::max(1, std::stoi(args[++i])));
+        } catch (const std::exception&) {
+            std::cerr << "无效的线程数: " << args[i] << std::endl;
+            return -1;
+        }
+    } else if ((arg == "--limit-read" || arg == "--limit-write") && i + 1 < argc) {
+        auto rate = parse_size(args[++i]);
+        if (!rate) {
+            std::cerr << "无效的速率: " << args[i] << " (如 50M 表示每秒 50 MiB)" << std::endl;
+            return -1;
+        }
+        (arg == "--limit-read" ? options.limits.read_bytes : options.limits.write_bytes) = *rate;
+    } else if (arg == "--limit-iops" && i + 1 < argc) {
+        try {
+            options.limits.ops = static_cast<uint64_t>(std::max(0, std::stoi(args[++i])));
+        } catch (const std::exception&) {
+            std::cerr << "无效的 I/O 次数: " << args[i] << std::endl;
+            return -1;
+        }
+    } else if (arg == "--idle-io") {
+        options.idle_io = true;
+    } else if (arg == "--nice" && i + 1 < argc) {
+        try {
+            options.nice = std::clamp(std::stoi(args[++i]), 0, 19);
+        } catch (const std::exception&) {
+            std::cerr << "无效的 nice 值: " << args[i] << std::endl;
+            return -1;
+        }
+    } else if (arg == "--progress") {
+        options.progress = true;
+    } else if (arg == "--no-progress") {
+        options.progress = false;
+    } else if (arg == "--metrics" && i + 1 < argc) {
+        options.metrics_path = args[++i];
+    } else if (arg == "--catalog" && i + 1 < argc) {
+        options.catalog_path = args[++i];
+    } else if (arg == "--delta") {
+        options.delta = true;
+    } else if (arg == "--delta-block" && i + 1 < argc) {
+        auto size = parse_size(args[++i]);
+        if (!size || *size < 512) {
+            std::cerr << "无效的块大小: " << args[i] << std::endl;
+            return -1;
+        }
+        options.delta_block = *size;
+    } else if (arg == "--io-uring") {
+        options.io_uring = true;
+    } else if (arg == "--uring-depth" && i + 1 < argc) {
+        try {
+            options.uring_depth = static_cast<unsigned>(std::max(1, std::stoi(args[++i])));
+        } catch (const std::exception&) {
+            std::cerr << "无效的队列深度: " << args[i] << std::endl;
+            return -1;
+        }
+    } else if (arg == "--checkpoint" && i + 1 < argc) {
+        try {
+            options.checkpoint_seconds = static_cast<unsigned>(std::max(1, std::stoi(args[++i])));
+        } catch (const std::exception&) {
+            std::cerr << "无效的检查点间隔: " << args[i] << std::endl;
+            return -1;
+        }
+    } else if ((arg == "--keep-last" || arg == "--keep-daily" || arg == "--keep-weekly" || arg == "--keep-monthly") &&
+               i + 1 < argc) {
+        BackupApp::Retention& retention = options.retention;
+        unsigned& count = arg == "--keep-last"    ? retention.last
+                          : arg == "--keep-daily" ? retention.daily
+                          : arg == "--keep-weekly" ? retention.weekly
+                                                   : retention.monthly;
+        try {
+            count = static_cast<unsigned>(std::max(0, std::stoi(args[++i])));
+        } catch (const std::exception&) {
+            std::cerr << "无效的保留数量: " << args[i] << std::endl;
+            return -1;
+        }
+    } else if (arg == "--s3-endpoint" && i + 1 < argc) {
+        options.s3_endpoint = args[++i];
+    } else if (arg == "--remote-cache" && i + 1 < argc) {
+        options.remote_cache = args[++i];
+    } else if (arg == "--part-size" && i + 1 < argc) {
+        auto size = parse_size(args[++i]);
+        if (!size || *size < S3SegmentStore::MIN_PART_SIZE) {
+            std::cerr << "无效的分片大小(至少 5M): " << args[i] << std::endl;
+            return -1;
+        }
+        options.part_size = *size;
+    } else if (arg == "--upload-jobs" && i + 1 < argc) {
+        try {
+            options.upload_jobs = static_cast<unsigned>(std::max(1, std::stoi(args[++i])));
+        } catch (const std::exception&) {
+            std::cerr << "无效的上传并发数: " << args[i] << std::endl;
+            return -1;
+        }
+    } else if (arg == "--dry-run") {
+        options.dry_run = true;
+    } else if (arg == "--sample" && i + 1 < argc) {
+        try {
+            options.verify_sample = std::stod(args[++i]);
+        } catch (const std::exception&) {
+            options.verify_sample = -1;
+        }
+        if (!(options.verify_sample > 0 && options.verify_sample <= 100)) {
+            std::cerr << "无效的抽样比例(应在 0 到 100 之间): " << args[i] << std::endl;
+            return -1;
+        }
+    } else if (arg == "--seed" && i + 1 < argc) {
+        try {
+            options.verify_seed = std::stoull(args[++i]);
+        } catch (const std::exception&) {
+            std::cerr << "无效的随机种子: " << args[i] << std::endl;
+            return -1;
+        }
+    } else if (arg == "--single-pass") {
+        options.single_pass = true;
+    } else if ((arg == "--jobs" || arg == "--io-jobs") && i + 1 < argc) {
+        try {
+            unsigned value = static_cast<unsigned>(std::max(1, std::stoi(args[++i])));
+            (arg == "--jobs" ? options.jobs : options.io_jobs) = value;
+        } catch (const std::exception&) {
+            std::cerr << "无效的线程数: " << args[i] << std::endl;
+            return -1;
+        }
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// 基准测试：在工作目录下生成合成目录树，分别测量扫描、哈希、读取方式、复制、
+// 完整备份(各存储方式)、比对和增量备份各阶段，输出 文件/s、MB/s 和该阶段的峰值内存
+class Benchmark {
+public:
+    struct Settings {
+        fs::path work_dir = fs::temp_directory_path() / ("backup_bench_" + std::to_string(::getpid()));
+        std::vector<std::string> profiles{"small", "huge", "deep"};
+        size_t files = 20000;               // small/deep 的文件数
+        size_t small_size = 4096;           // small/deep 中每个文件的大小
+        size_t huge_files = 4;
+        size_t huge_size = 128 << 20;
+        size_t depth = 40;                  // deep 中每条目录链的深度
+        double changed = 0.1;               // 增量阶段之前修改的文件比例
+        bool cold = false;                  // 每个阶段之前把源文件逐出页缓存
+        bool keep = false;                  // 结束后保留工作目录
+    };
+
+    Benchmark(Settings settings, BackupApp::Options options)
+        : settings_(std::move(settings)), base_options_(std::move(options)) {
+        // 基准测试的快照不写入用户的编目
+        base_options_.catalog_path = settings_.work_dir / "catalog.bin";
+    }
+
+    bool run() {
+        std::cout << "工作目录: " << settings_.work_dir << std::endl;
+        for (const std::string& profile : settings_.profiles) {
+            fs::path root = settings_.work_dir / profile;
+            fs::remove_all(root);
+            fs::path source = root / "src";
+            std::cout << "\n=== " << profile << " ===" << std::endl;
+            uint64_t bytes = generate(profile, source);
+            std::cout << "已生成 " << count_files(source) << " 个文件，" << bytes / (1 << 20) << " MB" << std::endl;
+            print_header();
+            run_profile(root, source);
+            if (!settings_.keep) fs::remove_all(root);
+        }
+        if (!settings_.keep) fs::remove_all(settings_.work_dir);
+        return true;
+    }
+
+private:
+    struct Measurement {
+        size_t files = 0;
+        uint64_t bytes = 0;     // 读写的数据量，0 表示该阶段只处理元数据
+        std::string note;
+    };
+
+    // 丢弃 std::cout 的输出，阶段内部的进度信息不混进结果表
+    struct NullBuffer : std::streambuf {
+        int overflow(int c) override { return c; }
+    };
+
+    void run_profile(const fs::path& root, const fs::path& source) {
+        using ScanOptions = BackupApp::ScanOptions;
+        const BackupApp::Options& o = base_options_;
+
+        stage("扫描", "元数据", source, o, [&](BackupApp& app) {
+            ScanOptions scan;
+            scan.hash = false;
+            FileIndex index = app.scan_directory(source, scan);
+            return Measurement{index.file_count(), 0, ""};
+        });
+
+        FileIndex hashed;
+        for (HashAlgorithm algorithm : {HashAlgorithm::MD5, HashAlgorithm::SHA256, HashAlgorithm::BLAKE2s256,
+                                        HashAlgorithm::BLAKE3, HashAlgorithm::XXH3_128}) {
+            if (!Hasher::available(algorithm)) continue;
+            BackupApp::Options options = o;
+            options.hash_algorithm = algorithm;
+            stage("哈希", Hasher::name(algorithm), source, options, [&](BackupApp& app) {
+                FileIndex index = app.scan_directory(source);
+                Measurement m{index.file_count(), total_size(index), ""};
+                if (algorithm == o.hash_algorithm) hashed = std::move(index);
+                return m;
+            });
+        }
+
+        for (ReadMode mode : {ReadMode::Buffered, ReadMode::Mmap, ReadMode::Direct}) {
+            BackupApp::Options options = o;
+            options.read_mode = mode;
+            options.io_uring = false;
+            stage("读取", FileReader::name(mode), source, options, [&](BackupApp& app) {
+                FileIndex index = app.scan_directory(source);
+                return Measurement{index.file_count(), total_size(index), ""};
+            });
+        }
+#ifdef BACKUP_HAVE_IO_URING
+        if (IoUring::supported()) {
+            BackupApp::Options options = o;
+            options.io_uring = true;
+            stage("读取", "io_uring", source, options, [&](BackupApp& app) {
+                FileIndex index = app.scan_directory(source);
+                return Measurement{index.file_count(), total_size(index), ""};
+            });
+        }
+#endif
+
+        // 复制阶段直接使用上面算好的索引，只测量复制本身
+        std::vector<FileIndex::Id> all(hashed.file_count());
+        for (FileIndex::Id f = 0; f < all.size(); ++f) all[f] = f;
+        for (bool single_pass : {false, true}) {
+            FileIndex index = hashed;
+            if (single_pass) std::fill(index.digests.begin(), index.digests.end(), Digest{});
+            fs::path dest = root / "copy";
+            stage("复制", single_pass ? "单遍" : "零拷贝", source, o, [&](BackupApp& app) {
+                BackupApp::CopyResult result = app.copy_files(index, all, source, dest);
+                return Measurement{result.copied, total_size(index), ""};
+            });
+            fs::remove_all(dest);
+        }
+
+        using StorageMode = BackupApp::StorageMode;
+        for (StorageMode storage : {StorageMode::Chunks, StorageMode::Archive, StorageMode::Files}) {
+            BackupApp::Options options = o;
+            options.storage = storage;
+            fs::path dest = root / "backup";
+            fs::remove_all(dest);
+            stage("完整备份", BackupApp::storage_mode_name(storage), source, options, [&](BackupApp& app) {
+                app.create_backup(source, dest);
+                return Measurement{hashed.file_count(), total_size(hashed), stored_note(dest)};
+            });
+        }
+
+        // 目录树模式的完整备份留作基准，修改一部分文件后测量比对和增量备份
+        fs::path dest = root / "backup";
+        size_t changed = mutate(hashed, source);
+        // 快照目录名精确到秒，增量快照不能与完整备份同名
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+        stage("比对", "修改 " + std::to_string(changed) + " 个", source, o, [&](BackupApp& app) {
+            std::optional<fs::path> latest = app.find_latest_backup(dest);
+            BackupApp::Manifest previous;
+            if (!latest || !app.load_manifest(*latest, previous)) return Measurement{0, 0, "没有清单"};
+            ScanOptions scan;
+            scan.previous = &previous.files;
+            scan.previous_scan_time = previous.scan_time;
+            scan.reuse_unchanged = true;
+            FileIndex index = app.scan_directory(source, scan);
+            std::vector<FileIndex::Id> previous_of;
+            auto files = BackupApp::find_changed_files(index, previous.files, previous_of);
+            return Measurement{index.file_count(), 0, "变更 " + std::to_string(files.size())};
+        });
+        stage("增量备份", BackupApp::storage_mode_name(StorageMode::Files), source, o, [&](BackupApp& app) {
+            app.incremental_backup(source, dest);
+            return Measurement{hashed.file_count(), 0, stored_note(dest)};
+        });
+    }
+
+    template <typename Body>
+    void stage(const std::string& name, const std::string& backend, const fs::path& source,
+               const BackupApp::Options& options, Body&& body) {
+        if (settings_.cold) evict(source);
+        BackupApp app;
+        app.options = options;
+        reset_peak_rss();
+        NullBuffer null;
+        std::streambuf* saved = std::cout.rdbuf(&null);
+        auto start = std::chrono::steady_clock::now();
+        Measurement m;
+        try {
+            m = body(app);
+        } catch (const std::exception& e) {
+            m.note = std::string("失败: ") + e.what();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout.rdbuf(saved);
+
+        seconds = std::max(seconds, 1e-9);
+        std::ostringstream mb_per_s;
+        if (m.bytes) mb_per_s << std::fixed << std::setprecision(1) << m.bytes / seconds / (1 << 20);
+        else mb_per_s << "-";
+        std::cout << pad(name, 10) << pad(backend, 16) << std::right << std::setw(9) << m.files << std::setw(10) << m.bytes / (1 << 20) << std::fixed
+                  << std::setprecision(3) << std::setw(10) << seconds << std::setprecision(0) << std::setw(12)
+                  << m.files / seconds << std::setw(10) << mb_per_s.str() << std::setw(10)
+                  << peak_rss() / (1 << 20) << "  " << m.note << std::endl;
+        std::cout.unsetf(std::ios::fixed);
+    }
+
+    static void print_header() {
+        std::cout << pad("阶段", 10) << pad("后端", 16) << pad("文件", 9, true) << pad("MB", 10, true)
+                  << pad("秒", 10, true) << pad("文件/s", 12, true) << pad("MB/s", 10, true)
+                  << pad("RSS(MB)", 10, true) << std::endl;
+    }
+
+    // 按显示宽度补齐空格：UTF-8 多字节字符(中文)占两列，std::setw 按字节计算会错位
+    static std::string pad(const std::string& text, size_t width, bool right = false) {
+        size_t columns = 0;
+        for (unsigned char c : text) {
+            if (c < 0x80) columns += 1;
+            else if (c >= 0xc0) columns += 2;
+        }
+        std::string fill(width > columns ? width - columns : 1, ' ');
+        return right ? fill + text : text + fill;
+    }
+
+    // 用 xorshift64 生成不可压缩、不重复的数据，块仓库和归档不会因为内容过于规整而失真
+    void fill(std::vector<uint8_t>& buffer) {
+        for (size_t i = 0; i + 8 <= buffer.size(); i += 8) {
+            seed_ ^= seed_ << 13;
+            seed_ ^= seed_ >> 7;
+            seed_ ^= seed_ << 17;
+            std::memcpy(buffer.data() + i, &seed_, 8);
+        }
+    }
+
+    uint64_t write_file(const fs::path& path, size_t size) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) throw std::runtime_error("无法创建文件: " + path.string());
+        std::vector<uint8_t> buffer(std::min<size_t>(size, 1 << 20) + 8);
+        for (size_t done = 0; done < size;) {
+            fill(buffer);
+            size_t n = std::min(buffer.size() - 8, size - done);
+            out.write(reinterpret_cast<const char*>(buffer.data()), static_cast<std::streamsize>(n));
+            done += n;
+        }
+        return size;
+    }
+
+    // small: 大量小文件，每个目录 200 个；huge: 少量大文件；deep: 多条深层目录链，每层一个文件
+    uint64_t generate(const std::string& profile, const fs::path& source) {
+        uint64_t bytes = 0;
+        fs::create_directories(source);
+        if (profile == "small") {
+            for (size_t i = 0; i < settings_.files; ++i) {
+                fs::path dir = source / ("d" + std::to_string(i / 200));
+                if (i % 200 == 0) fs::create_directories(dir);
+                bytes += write_file(dir / ("f" + std::to_string(i)), settings_.small_size);
+            }
+        } else if (profile == "huge") {
+            for (size_t i = 0; i < settings_.huge_files; ++i) {
+                bytes += write_file(source / ("huge" + std::to_string(i) + ".img"), settings_.huge_size);
+            }
+        } else if (profile == "deep") {
+            size_t chains = std::max<size_t>(1, settings_.files / settings_.depth);
+            for (size_t c = 0; c < chains; ++c) {
+                fs::path dir = source / ("c" + std::to_string(c));
+                for (size_t level = 0; level < settings_.depth; ++level) {
+                    dir /= "l" + std::to_string(level);
+                    fs::create_directories(dir);
+                    bytes += write_file(dir / "f", settings_.small_size);
+                }
+            }
+        } else {
+            throw std::runtime_error("未知的测试集: " + profile);
+        }
+#ifndef _WIN32
+        ::sync();
+#endif
+        return bytes;
+    }
+
+    // 均匀地挑出 changed 比例的文件，改写中间的 4K。大小不变，只能靠修改时间和摘要发现
+    size_t mutate(const FileIndex& index, const fs::path& source) {
+        if (settings_.changed <= 0 || index.file_count() == 0) return 0;
+        size_t step = std::max<size_t>(1, static_cast<size_t>(1.0 / settings_.changed));
+        std::vector<uint8_t> buffer(4096 + 8);
+        size_t changed = 0;
+        for (FileIndex::Id f = 0; f < index.file_count(); f += step) {
+            fill(buffer);
+            std::fstream out(source / index.relative_path(f), std::ios::binary | std::ios::in | std::ios::out);
+            uint64_t size = index.sizes[f];
+            size_t n = static_cast<size_t>(std::min<uint64_t>(4096, size));
+            out.seekp(static_cast<std::streamoff>((size - n) / 2));
+            out.write(reinterpret_cast<const char*>(buffer.data()), static_cast<std::streamsize>(n));
+            changed++;
+        }
+#ifndef _WIN32
+        ::sync();
+#endif
+        return changed;
+    }
+
+    static size_t count_files(const fs::path& root) {
+        size_t count = 0;
+        for (const auto& entry : fs::recursive_directory_iterator(root)) {
+            if (entry.is_regular_file()) count++;
+        }
+        return count;
+    }
+
+    static uint64_t total_size(const FileIndex& index) {
+        uint64_t total = 0;
+        for (uint64_t size : index.sizes) total += size;
+        return total;
+    }
+
+    // 备份目录实际占用的空间，硬链接只计一次
+    static std::string stored_note(const fs::path& dest) {
+        uint64_t used = 0;
+        std::error_code ec;
+        std::unordered_set<uint64_t> seen;
+        for (auto it = fs::recursive_directory_iterator(dest, ec); it != fs::recursive_directory_iterator();
+             it.increment(ec)) {
+#ifndef _WIN32
+            struct stat st;
+            if (::lstat(it->path().c_str(), &st) == 0 && S_ISREG(st.st_mode) && seen.insert(st.st_ino).second) {
+                used += static_cast<uint64_t>(st.st_blocks) * 512;
+            }
+#else
+            if (it->is_regular_file(ec)) used += it->file_size(ec);
+#endif
+        }
+        return "占用 " + std::to_string(used / (1 << 20)) + " MB";
+    }
+
+    // 把源文件逐出页缓存，测量冷缓存下的读取
+    static void evict(const fs::path& root) {
+#ifdef POSIX_FADV_DONTNEED
+        for (const auto& entry : fs::recursive_directory_iterator(root)) {
+            if (!entry.is_regular_file()) continue;
+            UniqueFd fd(::open(entry.path().c_str(), O_RDONLY | O_CLOEXEC));
+            if (fd) ::posix_fadvise(fd.get(), 0, 0, POSIX_FADV_DONTNEED);
+        }
+#else
+        (void)root;
+#endif
+    }
+
+    // Linux 下写 /proc/self/clear_refs 可以把峰值内存(VmHWM)重置为当前值，每个阶段单独统计
+    static void reset_peak_rss() {
+#ifdef __linux__
+        std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+    }
+
+    static uint64_t peak_rss() {
+#ifdef __linux__
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.rfind("VmHWM:", 0) == 0) return std::stoull(line.substr(6)) * 1024;
+        }
+#endif
+#ifndef _WIN32
+        struct rusage usage;
+        if (::getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+            return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+            return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+        }
+#endif
+        return 0;
+    }
+
+    Settings settings_;
+    BackupApp::Options base_options_;
+    uint64_t seed_ = 0x9e3779b97f4a7c15ULL;
+};
+
+// bench 子命令自己的参数，其余参数按运行选项解析
+static int run_benchmark(const std::vector<std::string>& args, BackupApp::Options options) {
+    Benchmark::Settings settings;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        bool has_value = i + 1 < args.size();
+        try {
+            if (arg == "--dir" && has_value) {
+                settings.work_dir = args[++i];
+            } else if (arg == "--profile" && has_value) {
+                std::string value = args[++i];
+                if (value == "all") continue;
+                if (value != "small" && value != "huge" && value != "deep") {
+                    std::cerr << "未知的测试集: " << value << " (small|huge|deep|all)" << std::endl;
+                    return 1;
+                }
+                settings.profiles = {value};
+            } else if (arg == "--files" && has_value) {
+                settings.files = std::max<size_t>(1, std::stoul(args[++i]));
+            } else if (arg == "--file-size" && has_value) {
+                settings.small_size = parse_size(args[++i]).value_or(settings.small_size);
+            } else if (arg == "--huge-files" && has_value) {
+                settings.huge_files = std::max<size_t>(1, std::stoul(args[++i]));
+            } else if (arg == "--huge-size" && has_value) {
+                settings.huge_size = parse_size(args[++i]).value_or(settings.huge_size);
+            } else if (arg == "--depth" && has_value) {
+                settings.depth = std::max<size_t>(1, std::stoul(args[++i]));
+            } else if (arg == "--changed" && has_value) {
+                settings.changed = std::clamp(std::stod(args[++i]), 0.0, 1.0);
+            } else if (arg == "--cold") {
+                settings.cold = true;
+            } else if (arg == "--keep") {
+                settings.keep = true;
+            } else {
+                int parsed = parse_option(args, i, options);
+                if (parsed < 0) return 1;
+                if (parsed == 0) {
+                    std::cerr << "未知参数: " << arg << std::endl;
+                    return 1;
+                }
+            }
+        } catch (const std::exception&) {
+            std::cerr << "无效的参数值: " << arg << " " << args[i] << std::endl;
+            return 1;
+        }
+    }
+    TaskScheduler::configure(BackupApp::scheduler_threads(options));
+    try {
+        return Benchmark(settings, options).run() ? 0 : 1;
+    } catch (const std::exception& e) {
+        std::cerr << "基准测试失败: " << e.what() << std::endl;
+        return 1;
+    }
+}
+
+// 一个备份作业：命令行子命令或作业文件中的一行
+struct BackupJob {
+    std::string command;    // full / incremental / restore / verify / prune
+    fs::path source;        // restore 时为快照目录，verify 时为快照目录或备份目录，prune 时为空
+    fs::path target;        // restore 时为恢复目标目录，verify 时为空，prune 时为备份目录
+    BackupApp::Options options;
+    std::string label;      // 输出时标识作业，如 "jobs.txt:3"
+};
+
+static bool run_job(const BackupJob& job) {
+    BackupApp app;
+    app.options = job.options;
+    try {
+        return app.measured(job.command, job.source, job.target, [&] {
+            if (job.command == "full") return app.create_backup(job.source, job.target);
+            if (job.command == "incremental") return app.incremental_backup(job.source, job.target);
+            if (job.command == "restore") return app.restore_backup(job.source, job.target);
+            if (job.command == "verify") return app.verify_backups(job.source);
+            if (job.command == "prune") return app.prune_backups(job.target);
+            std::cerr << "未知命令: " << job.command << std::endl;
+            return false;
+        });
+    } catch (const std::exception& e) {
+        std::cerr << "作业失败: " << e.what() << std::endl;
+    }
+    return false;
+}
+
+// 路径所在的设备。路径还不存在时取最近的已存在上级目录，无法取得设备号时按盘符区分
+static std::string device_of(const fs::path& path) {
+    std::error_code ec;
+    fs::path p = fs::absolute(path, ec);
+    while (!fs::exists(p, ec) && p.has_relative_path()) {
+        p = p.parent_path();
+    }
+#ifndef _WIN32
+    struct stat st;
+    if (::stat(p.c_str(), &st) == 0) return std::to_string(st.st_dev);
+#endif
+    return p.root_name().string();
+}
+
+// 按设备调度作业：涉及的源设备和目标设备都空闲时才开始(verify 只涉及源，prune 只涉及目标)，
+// 同一块盘上的作业按文件中的顺序依次执行，不同盘上的作业并行。同时运行的作业平分哈希线程和复制线程，
+// 总数与单个作业相同
+static bool run_jobs(std::vector<BackupJob>& jobs, unsigned parallel) {
+    std::vector<std::vector<std::string>> devices;
+    std::unordered_set<std::string> distinct;
+    for (const BackupJob& job : jobs) {
+        devices.emplace_back();
+        for (const fs::path& path : {job.source, job.target}) {
+            if (path.empty()) continue;
+            devices.back().push_back(device_of(path));
+            distinct.insert(devices.back().back());
+        }
+    }
+    size_t slots = parallel ? parallel : distinct.size();
+    slots = std::max<size_t>(1, std::min(slots, jobs.size()));
+    for (BackupJob& job : jobs) {
+        job.options.jobs = std::max(1u, static_cast<unsigned>(job.options.jobs / slots));
+        job.options.io_jobs = std::max(1u, static_cast<unsigned>(job.options.io_jobs / slots));
+        // 多个作业同时运行时各自的进度行会互相覆盖
+        if (slots > 1) job.options.progress = false;
+    }
+    std::cout << "共 " << jobs.size() << " 个作业，涉及 " << distinct.size() << " 个设备，最多同时运行 " << slots
+              << " 个" << std::endl;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<char> started(jobs.size(), 0);
+    std::unordered_map<std::string, int> busy;
+    size_t remaining = jobs.size(), failed = 0;
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < slots; ++w) {
+        workers.emplace_back([&] {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (remaining > 0) {
+                size_t pick = jobs.size();
+                for (size_t j = 0; j < jobs.size() && pick == jobs.size(); ++j) {
+                    if (!started[j] && std::none_of(devices[j].begin(), devices[j].end(),
+                                                    [&](const std::string& device) { return busy[device] > 0; })) {
+                        pick = j;
+                    }
+                }
+                if (pick == jobs.size()) {
+                    // 全部已开始时不再等待；否则等某个作业结束后重新挑选
+                    if (std::find(started.begin(), started.end(), 0) == started.end()) break;
+                    changed.wait(lock);
+                    continue;
+                }
+                started[pick] = 1;
+                for (const std::string& device : devices[pick]) busy[device]++;
+                lock.unlock();
+
+                const BackupJob& job = jobs[pick];
+                std::cout << "[" << job.label << "] 开始 " << job.command << ": ";
+                if (job.command == "verify") {
+                    std::cout << job.source << std::endl;
+                } else if (job.command == "prune") {
+                    std::cout << job.target << std::endl;
+                } else {
+                    std::cout << job.source << " -> " << job.target << std::endl;
+                }
+                bool ok = run_job(job);
+                std::cout << "[" << job.label << "] " << (ok ? "完成" : "失败") << std::endl;
+
+                lock.lock();
+                for (const std::string& device : devices[pick]) busy[device]--;
+                if (!ok) failed++;
+                remaining--;
+                changed.notify_all();
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+
+    std::cout << "\n作业全部结束: 成功 " << jobs.size() - failed << " 个，失败 " << failed << " 个" << std::endl;
+    return failed == 0;
+}
+
+// 按空白切分作业文件的一行，双引号括起的部分可以包含空格
+static std::vector<std::string> split_job_line(const std::string& line) {
+    std::vector<std::string> words;
+    std::string word;
+    bool quoted = false, have_word = false;
+    for (char c : line) {
+        if (c == '"') {
+            quoted = !quoted;
+            have_word = true;
+        } else if (!quoted && std::isspace(static_cast<unsigned char>(c))) {
+            if (have_word) words.push_back(std::move(word));
+            word.clear();
+            have_word = false;
+        } else {
+            word += c;
+            have_word = true;
+        }
+    }
+    if (have_word) words.push_back(std::move(word));
+    return words;
+}
+
+// 读取作业文件。每行为 "full|incremental|restore 源 目标 [选项...]"、"verify 快照目录或备份目录 [选项...]"
+// 或 "prune 备份目录 [选项...]"，# 开头的行和空行忽略，行内的选项只作用于该作业，其余选项取自命令行
+static bool load_job_file(const fs::path& path, const BackupApp::Options& defaults, std::vector<BackupJob>& jobs) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "无法打开作业文件: " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); ++number) {
+        std::vector<std::string> words = split_job_line(line);
+        if (words.empty() || words[0][0] == '#') continue;
+        std::string label = path.filename().string() + ":" + std::to_string(number);
+        bool copy = words[0] == "full" || words[0] == "incremental" || words[0] == "restore";
+        if ((!copy && words[0] != "verify" && words[0] != "prune") || words.size() < (copy ? 3u : 2u)) {
+            std::cerr << label << ": 格式应为 \"full|incremental|restore 源 目标 [选项...]\"、"
+                      << "\"verify 快照目录或备份目录 [选项...]\" 或 \"prune 备份目录 [选项...]\"" << std::endl;
+            return false;
+        }
+        // verify 只有源，prune 只有目标
+        BackupJob job{words[0], "", "", defaults, label};
+        (words[0] == "prune" ? job.target : job.source) = words[1];
+        if (copy) job.target = words[2];
+        for (size_t i = copy ? 3 : 2; i < words.size(); ++i) {
+            int parsed = parse_option(words, i, job.options);
+            if (parsed < 0) return false;
+            if (parsed == 0) {
+                std::cerr << label << ": 未知参数: " << words[i] << std::endl;
+                return false;
+            }
+        }
+        // 命令行的限额是所有作业合计的上限，行内只能调低
+        const Throttle::Limits& total = defaults.limits;
+        const Throttle::Limits& own = job.options.limits;
+        auto raised = [](uint64_t own, uint64_t total) { return total && (!own || own > total); };
+        if (raised(own.read_bytes, total.read_bytes) || raised(own.write_bytes, total.write_bytes) ||
+            raised(own.ops, total.ops)) {
+            std::cerr << label << ": 行内限速高于命令行的总限额，按总限额执行" << std::endl;
+        }
+        jobs.push_back(std::move(job));
+    }
+    if (jobs.empty()) {
+        std::cerr << "作业文件中没有作业: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static void print_usage(const char* program) {
+    std::cerr << "用法:\n"
+              << "  " << program << " [选项]                              交互菜单\n"
+              << "  " << program << " full --src 源目录 --dst 备份目录 [选项]\n"
+              << "  " << program << " incremental --src 源目录 --dst 备份目录 [选项]\n"
+              << "  " << program << " restore --src 快照目录 --dst 恢复目录 [选项]\n"
+              << "  " << program << " verify --src 快照目录或备份目录 [--sample 百分比] [--seed N] [选项]\n"
+              << "  " << program << " prune --dst 备份目录 [--keep-last N] [--keep-daily N] [--keep-weekly N]"
+              << " [--keep-monthly N] [--dry-run] [选项]\n"
+              << "  " << program << " jobs --file 作业文件 [--parallel N] [选项]\n"
+              << "  " << program << " watch --src 源目录 --dst 备份目录\n"
+              << "  " << program << " history [--catalog 编目文件]\n"
+              << "  " << program << " bench [--profile small|huge|deep|all] [--files N] [--file-size SIZE]"
+              << " [--huge-files N] [--huge-size SIZE] [--depth N] [--changed 比例] [--cold] [--dir 工作目录] [--keep]\n"
+              << "选项: [--paranoid] [--single-pass] [--repository] [--hash md5|sha256|blake2s|blake3|xxh3]"
+              << " [--archive] [--compress zstd|lz4|none[:level]] [--jobs N] [--io-jobs N]"
+              << " [--read-mode buffered|mmap|direct] [--read-buffer SIZE] [--io-uring] [--uring-depth N]"
+              << " [--walk-jobs N] [--workers N] [--delta] [--delta-block SIZE] [--catalog 编目文件] [--progress|--no-progress]"
+              << " [--metrics 指标文件(.prom 或 JSON 行)] [--limit-read 速率] [--limit-write 速率] [--limit-iops N]"
+              << " [--idle-io] [--nice N] [--checkpoint 秒]\n"
+              << "备份目录可以是 s3://bucket/prefix: [--s3-endpoint URL] [--part-size SIZE] [--upload-jobs N]"
+              << " [--remote-cache 缓存目录]，凭证取自 AWS_ACCESS_KEY_ID / AWS_SECRET_ACCESS_KEY" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    // 初始化OpenSSL摘要算法
     OpenSSL_add_all_digests();
 
     BackupApp app;
-    app.run();
+    std::vector<std::string> args(argv + 1, argv + argc);
+    std::string command;
+    std::string source, target, job_file;
+    unsigned parallel = 0;
+    size_t first = 0;
+    if (!args.empty() && (args[0] == "help" || args[0] == "-h" || args[0] == "--help")) {
+        print_usage(argv[0]);
+        return 0;
+    }
+    if (!args.empty() && args[0] == "bench") {
+        int status = run_benchmark(std::vector<std::string>(args.begin() + 1, args.end()), app.options);
+        EVP_cleanup();
+        return status;
+    }
+    if (!args.empty() && args[0].rfind("--", 0) != 0) {
+        command = args[0];
+        first = 1;
+        if (command != "full" && command != "incremental" && command != "restore" && command != "jobs" &&
+            command != "watch" && command != "history" && command != "verify" && command != "prune") {
+            std::cerr << "未知命令: " << command << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    for (size_t i = first; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        if (arg == "--watch" && i + 2 < args.size()) {
+            // 旧的写法: --watch 源目录 备份目录
+            command = "watch";
+            source = args[i + 1];
+            target = args[i + 2];
+            i += 2;
+        } else if (arg == "--src" && i + 1 < args.size()) {
+            source = args[++i];
+        } else if (arg == "--dst" && i + 1 < args.size()) {
+            target = args[++i];
+        } else if (arg == "--file" && i + 1 < args.size()) {
+            job_file = args[++i];
+        } else if (arg == "--parallel" && i + 1 < args.size()) {
+            try {
+                parallel = static_cast<unsigned>(std::max(1, std::stoi(args[++i])));
+            } catch (const std::exception&) {
+                std::cerr << "无效的作业数: " << args[i] << std::endl;
+                return 1;
+            }
+        } else {
+            int parsed = parse_option(args, i, app.options);
+            if (parsed < 0) return 1;
+            if (parsed == 0) {
+                std::cerr << "未知参数: " << arg << std::endl;
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+    }
+
+    TaskScheduler::configure(BackupApp::scheduler_threads(app.options));
+    Throttle::process().configure(app.options.limits);
+    bool ok = true;
+    if (command.empty()) {
+        app.run();
+    } else if (command == "history") {
+        app.show_backup_history();
+    } else if (command == "jobs") {
+        std::vector<BackupJob> jobs;
+        if (job_file.empty()) {
+            std::cerr << "jobs 命令需要 --file 作业文件" << std::endl;
+            ok = false;
+        } else {
+            ok = load_job_file(job_file, app.options, jobs) && run_jobs(jobs, parallel);
+        }
+    } else if (command == "prune") {
+        if (target.empty()) {
+            std::cerr << "prune 命令需要 --dst" << std::endl;
+            ok = false;
+        } else {
+            ok = run_job(BackupJob{command, source, target, app.options, command});
+        }
+    } else if (command == "verify") {
+        if (source.empty()) {
+            std::cerr << "verify 命令需要 --src" << std::endl;
+            ok = false;
+        } else {
+            ok = run_job(BackupJob{command, source, target, app.options, command});
+        }
+    } else if (source.empty() || target.empty()) {
+        std::cerr << command << " 命令需要 --src 和 --dst" << std::endl;
+        print_usage(argv[0]);
+        ok = false;
+    } else if (command == "watch") {
+        ok = app.watch_directory(source, target);
+    } else {
+        ok = run_job(BackupJob{command, source, target, app.options, command});
+    }
 
     // 清理OpenSSL
     EVP_cleanup();
-    return 0;
+    return ok ? 0 : 1;
 }